@@ -1,6 +1,8 @@
 #ifndef __CONDITIONER_HPP__
 #define __CONDITIONER_HPP__
 
+#include <thread>
+
 #include "clip.hpp"
 #include "t5.hpp"
 
@@ -38,8 +40,127 @@ struct Conditioner {
                                                                                           bool force_zero_embeddings = false) = 0;
     virtual std::string remove_trigger_from_prompt(ggml_context* work_ctx,
                                                    const std::string& prompt)                                                 = 0;
+
+    // the prompt and the negative prompt in one call, so conditioners with independent
+    // text encoders can overlap the two encodings
+    virtual std::pair<SDCondition, SDCondition> get_learned_condition_pair(ggml_context* work_ctx,
+                                                                           int n_threads,
+                                                                           const std::string& text,
+                                                                           const std::string& negative_text,
+                                                                           int clip_skip,
+                                                                           int width,
+                                                                           int height,
+                                                                           int adm_in_channels                 = -1,
+                                                                           bool negative_force_zero_embeddings = false) {
+        SDCondition cond   = get_learned_condition(work_ctx, n_threads, text, clip_skip, width, height, adm_in_channels);
+        SDCondition uncond = get_learned_condition(work_ctx, n_threads, negative_text, clip_skip, width, height, adm_in_channels, negative_force_zero_embeddings);
+        return {cond, uncond};
+    }
+
+    // a cpu backend the conditioner computes on next to the main one, and its share of n_threads,
+    // so the context can give it a threadpool of its own
+    virtual ggml_backend_t get_concurrent_cpu_backend(int n_threads, int* backend_threads) {
+        return NULL;
+    }
 };
 
+// scales the hidden states by the token weights, keeping their mean
+static void scale_by_token_weights(struct ggml_tensor* tensor, const float* weights) {
+    float original_mean = ggml_tensor_mean(tensor);
+    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
+        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
+            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
+                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
+                value *= weights[i1];
+                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
+            }
+        }
+    }
+    float new_mean = ggml_tensor_mean(tensor);
+    ggml_tensor_scale(tensor, (original_mean / new_mean));
+}
+
+// one chunk of tokens through a clip text model, the hidden states and the pooled output are optional
+static void clip_encode_chunk(std::shared_ptr<CLIPTextModelRunner> model,
+                              int eos_token_id,
+                              const std::pair<std::vector<int>, std::vector<float>>& tokens_and_weights,
+                              size_t offset,
+                              size_t len,
+                              int n_threads,
+                              ggml_context* ctx,
+                              struct ggml_tensor** hidden_states,
+                              struct ggml_tensor** pooled) {
+    std::vector<int> chunk_tokens(tokens_and_weights.first.begin() + offset,
+                                  tokens_and_weights.first.begin() + offset + len);
+    auto input_ids = vector_to_ggml_tensor_i32(ctx, chunk_tokens);
+    if (hidden_states != NULL) {
+        model->compute(n_threads, input_ids, 0, NULL, 0, false, hidden_states, ctx);
+        scale_by_token_weights(*hidden_states, tokens_and_weights.second.data() + offset);
+    }
+    if (pooled != NULL) {
+        auto it              = std::find(chunk_tokens.begin(), chunk_tokens.end(), eos_token_id);
+        size_t max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
+        model->compute(n_threads, input_ids, 0, NULL, max_token_idx, true, pooled, ctx);
+    }
+}
+
+// one chunk of tokens through t5
+static void t5_encode_chunk(std::shared_ptr<T5Runner> model,
+                            const std::pair<std::vector<int>, std::vector<float>>& tokens_and_weights,
+                            size_t offset,
+                            size_t len,
+                            int n_threads,
+                            ggml_context* ctx,
+                            struct ggml_tensor** hidden_states) {
+    std::vector<int> chunk_tokens(tokens_and_weights.first.begin() + offset,
+                                  tokens_and_weights.first.begin() + offset + len);
+    auto input_ids = vector_to_ggml_tensor_i32(ctx, chunk_tokens);
+    model->compute(n_threads, input_ids, hidden_states, ctx);
+    scale_by_token_weights(*hidden_states, tokens_and_weights.second.data() + offset);
+}
+
+// the outputs of an encoder running on its own thread go to its own context, ggml contexts are not thread safe
+static ggml_context* new_text_encoder_ctx(size_t n_floats, size_t n_tensors) {
+    struct ggml_init_params params;
+    params.mem_size   = n_floats * sizeof(float) + n_tensors * ggml_tensor_overhead() + 1024 * 1024;
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+    ggml_context* ctx = ggml_init(params);
+    GGML_ASSERT(ctx != NULL);
+    return ctx;
+}
+
+// the threads of the first encoder when two run concurrently, the second one gets the rest
+static int concurrent_first_threads(int n_threads, float first_share) {
+    if (n_threads < 2) {
+        return n_threads;
+    }
+    return std::min(std::max((int)(n_threads * first_share + 0.5f), 1), n_threads - 1);
+}
+
+// runs two independent text encoders, concurrently when they compute on separate cpu backends,
+// in that case first gets first_share of n_threads and second the rest
+static void run_text_encoders(bool concurrent,
+                              int n_threads,
+                              float first_share,
+                              std::function<void(int)> first,
+                              std::function<void(int)> second) {
+    if (!concurrent || n_threads < 2) {
+        first(n_threads);
+        second(n_threads);
+        return;
+    }
+    int first_threads               = concurrent_first_threads(n_threads, first_share);
+    int second_threads              = n_threads - first_threads;
+    sd_thread_callbacks_t callbacks = sd_get_thread_callbacks();
+    std::thread worker([&second, second_threads, callbacks]() {
+        sd_set_thread_callbacks(callbacks);
+        second(second_threads);
+    });
+    first(first_threads);
+    worker.join();
+}
+
 // ldm.modules.encoders.modules.FrozenCLIPEmbedder
 // Ref: https://github.com/AUTOMATIC1111/stable-diffusion-webui/blob/cad87bf4e3e0b0a759afa94e933527c3123d59bc/modules/sd_hijack_clip.py#L283
 struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
@@ -632,6 +753,8 @@ struct SD3CLIPEmbedder : public Conditioner {
     std::shared_ptr<CLIPTextModelRunner> clip_l;
     std::shared_ptr<CLIPTextModelRunner> clip_g;
     std::shared_ptr<T5Runner> t5;
+    ggml_backend_t clip_cpu_backend = NULL;   // so the clip models can run next to t5
+    float t5_thread_share           = 0.75f;  // t5 dominates, the clip models get a quarter of the threads
 
     SD3CLIPEmbedder(ggml_backend_t backend,
                     std::map<std::string, enum ggml_type>& tensor_types,
@@ -640,9 +763,26 @@ struct SD3CLIPEmbedder : public Conditioner {
         if (clip_skip <= 0) {
             clip_skip = 2;
         }
-        clip_l = std::make_shared<CLIPTextModelRunner>(backend, tensor_types, "text_encoders.clip_l.transformer.text_model", OPENAI_CLIP_VIT_L_14, clip_skip, false);
-        clip_g = std::make_shared<CLIPTextModelRunner>(backend, tensor_types, "text_encoders.clip_g.transformer.text_model", OPEN_CLIP_VIT_BIGG_14, clip_skip, false);
-        t5     = std::make_shared<T5Runner>(backend, tensor_types, "text_encoders.t5xxl.transformer");
+        if (ggml_backend_is_cpu(backend)) {
+            clip_cpu_backend = ggml_backend_cpu_init();
+        }
+        ggml_backend_t clip_backend = clip_cpu_backend != NULL ? clip_cpu_backend : backend;
+        clip_l                      = std::make_shared<CLIPTextModelRunner>(clip_backend, tensor_types, "text_encoders.clip_l.transformer.text_model", OPENAI_CLIP_VIT_L_14, clip_skip, false);
+        clip_g                      = std::make_shared<CLIPTextModelRunner>(clip_backend, tensor_types, "text_encoders.clip_g.transformer.text_model", OPEN_CLIP_VIT_BIGG_14, clip_skip, false);
+        t5                          = std::make_shared<T5Runner>(backend, tensor_types, "text_encoders.t5xxl.transformer");
+    }
+
+    ~SD3CLIPEmbedder() {
+        clip_l.reset();
+        clip_g.reset();
+        if (clip_cpu_backend != NULL) {
+            ggml_backend_free(clip_cpu_backend);
+        }
+    }
+
+    ggml_backend_t get_concurrent_cpu_backend(int n_threads, int* backend_threads) {
+        *backend_threads = n_threads - concurrent_first_threads(n_threads, t5_thread_share);
+        return n_threads < 2 ? NULL : clip_cpu_backend;
     }
 
     void set_clip_skip(int clip_skip) {
@@ -739,206 +879,114 @@ struct SD3CLIPEmbedder : public Conditioner {
         return {{clip_l_tokens, clip_l_weights}, {clip_g_tokens, clip_g_weights}, {t5_tokens, t5_weights}};
     }
 
-    SDCondition get_learned_condition_common(ggml_context* work_ctx,
-                                             int n_threads,
-                                             std::vector<std::pair<std::vector<int>, std::vector<float>>> token_and_weights,
-                                             int clip_skip,
-                                             bool force_zero_embeddings = false) {
+    // the prompts (e.g. the prompt and the negative prompt) are encoded together, so that
+    // the clip models can run on one set of threads while t5 runs on the other
+    std::vector<SDCondition> get_learned_conditions_common(ggml_context* work_ctx,
+                                                           int n_threads,
+                                                           const std::vector<std::vector<std::pair<std::vector<int>, std::vector<float>>>>& prompts,
+                                                           int clip_skip,
+                                                           const std::vector<bool>& force_zero_embeddings) {
         set_clip_skip(clip_skip);
-        auto& clip_l_tokens  = token_and_weights[0].first;
-        auto& clip_l_weights = token_and_weights[0].second;
-        auto& clip_g_tokens  = token_and_weights[1].first;
-        auto& clip_g_weights = token_and_weights[1].second;
-        auto& t5_tokens      = token_and_weights[2].first;
-        auto& t5_weights     = token_and_weights[2].second;
-
-        int64_t t0                                 = ggml_time_ms();
-        struct ggml_tensor* hidden_states          = NULL;  // [N, n_token*2, 4096]
-        struct ggml_tensor* chunk_hidden_states    = NULL;  // [n_token*2, 4096]
-        struct ggml_tensor* chunk_hidden_states_l  = NULL;  // [n_token, hidden_size_l]
-        struct ggml_tensor* chunk_hidden_states_g  = NULL;  // [n_token, hidden_size_g]
-        struct ggml_tensor* chunk_hidden_states_t5 = NULL;  // [n_token, hidden_size_t5]
-        struct ggml_tensor* pooled                 = NULL;
-        struct ggml_tensor* pooled_l               = NULL;  // [768,]
-        struct ggml_tensor* pooled_g               = NULL;  // [1280,]
-        std::vector<float> hidden_states_vec;
-
+        int64_t t0         = ggml_time_ms();
         size_t chunk_len   = 77;
-        size_t chunk_count = clip_l_tokens.size() / chunk_len;
-        for (int chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
-            // clip_l
-            {
-                std::vector<int> chunk_tokens(clip_l_tokens.begin() + chunk_idx * chunk_len,
-                                              clip_l_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(clip_l_weights.begin() + chunk_idx * chunk_len,
-                                                 clip_l_weights.begin() + (chunk_idx + 1) * chunk_len);
-
-                auto input_ids       = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-                size_t max_token_idx = 0;
-
-                clip_l->compute(n_threads,
-                                input_ids,
-                                0,
-                                NULL,
-                                max_token_idx,
-                                false,
-                                &chunk_hidden_states_l,
-                                work_ctx);
-                {
-                    auto tensor         = chunk_hidden_states_l;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
-                            }
-                        }
-                    }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
-                }
+        size_t total_count = 0;
+        std::vector<std::vector<ggml_tensor*>> hidden_states_l(prompts.size());   // [n_token, hidden_size_l]
+        std::vector<std::vector<ggml_tensor*>> hidden_states_g(prompts.size());   // [n_token, hidden_size_g]
+        std::vector<std::vector<ggml_tensor*>> hidden_states_t5(prompts.size());  // [n_token, hidden_size_t5]
+        std::vector<ggml_tensor*> pooled_l(prompts.size(), NULL);                 // [768,]
+        std::vector<ggml_tensor*> pooled_g(prompts.size(), NULL);                 // [1280,]
+        for (size_t p = 0; p < prompts.size(); p++) {
+            size_t chunk_count = prompts[p][0].first.size() / chunk_len;
+            hidden_states_l[p].resize(chunk_count, NULL);
+            hidden_states_g[p].resize(chunk_count, NULL);
+            hidden_states_t5[p].resize(chunk_count, NULL);
+            total_count += chunk_count;
+        }
 
-                if (chunk_idx == 0) {
-                    auto it       = std::find(chunk_tokens.begin(), chunk_tokens.end(), clip_l_tokenizer.EOS_TOKEN_ID);
-                    max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
-                    clip_l->compute(n_threads,
-                                    input_ids,
-                                    0,
-                                    NULL,
-                                    max_token_idx,
-                                    true,
-                                    &pooled_l,
-                                    work_ctx);
+        ggml_context* clip_ctx = new_text_encoder_ctx(total_count * chunk_len * (768 + 1280 + 2) + prompts.size() * (768 + 1280),
+                                                      total_count * 4 + prompts.size() * 2);
+        ggml_context* t5_ctx   = new_text_encoder_ctx(total_count * chunk_len * (4096 + 1), total_count * 2);
+
+        auto encode_clip = [&](int n_threads) {
+            for (size_t p = 0; p < prompts.size(); p++) {
+                for (size_t i = 0; i < hidden_states_l[p].size(); i++) {
+                    clip_encode_chunk(clip_l, clip_l_tokenizer.EOS_TOKEN_ID, prompts[p][0], i * chunk_len, chunk_len, n_threads, clip_ctx,
+                                      &hidden_states_l[p][i], i == 0 ? &pooled_l[p] : NULL);
+                    clip_encode_chunk(clip_g, clip_g_tokenizer.EOS_TOKEN_ID, prompts[p][1], i * chunk_len, chunk_len, n_threads, clip_ctx,
+                                      &hidden_states_g[p][i], i == 0 ? &pooled_g[p] : NULL);
                 }
             }
-
-            // clip_g
-            {
-                std::vector<int> chunk_tokens(clip_g_tokens.begin() + chunk_idx * chunk_len,
-                                              clip_g_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(clip_g_weights.begin() + chunk_idx * chunk_len,
-                                                 clip_g_weights.begin() + (chunk_idx + 1) * chunk_len);
-
-                auto input_ids       = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-                size_t max_token_idx = 0;
-
-                clip_g->compute(n_threads,
-                                input_ids,
-                                0,
-                                NULL,
-                                max_token_idx,
-                                false,
-                                &chunk_hidden_states_g,
-                                work_ctx);
-
-                {
-                    auto tensor         = chunk_hidden_states_g;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
+        };
+        auto encode_t5 = [&](int n_threads) {
+            for (size_t p = 0; p < prompts.size(); p++) {
+                for (size_t i = 0; i < hidden_states_t5[p].size(); i++) {
+                    t5_encode_chunk(t5, prompts[p][2], i * chunk_len, chunk_len, n_threads, t5_ctx, &hidden_states_t5[p][i]);
+                }
+            }
+        };
+        run_text_encoders(clip_cpu_backend != NULL, n_threads, t5_thread_share, encode_t5, encode_clip);
+        int64_t t1 = ggml_time_ms();
+        LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
+
+        std::vector<SDCondition> conds;
+        for (size_t p = 0; p < prompts.size(); p++) {
+            struct ggml_tensor* hidden_states       = NULL;  // [N, n_token*2, 4096]
+            struct ggml_tensor* chunk_hidden_states = NULL;  // [n_token*2, 4096]
+            struct ggml_tensor* pooled              = NULL;
+            std::vector<float> hidden_states_vec;
+            for (size_t chunk_idx = 0; chunk_idx < hidden_states_l[p].size(); chunk_idx++) {
+                struct ggml_tensor* chunk_hidden_states_l  = hidden_states_l[p][chunk_idx];
+                struct ggml_tensor* chunk_hidden_states_g  = hidden_states_g[p][chunk_idx];
+                struct ggml_tensor* chunk_hidden_states_t5 = hidden_states_t5[p][chunk_idx];
+
+                auto chunk_hidden_states_lg_pad = ggml_new_tensor_3d(work_ctx,
+                                                                     chunk_hidden_states_l->type,
+                                                                     4096,
+                                                                     chunk_hidden_states_l->ne[1],
+                                                                     chunk_hidden_states_l->ne[2]);  // [n_token, 4096]
+
+                for (int i2 = 0; i2 < chunk_hidden_states_lg_pad->ne[2]; i2++) {
+                    for (int i1 = 0; i1 < chunk_hidden_states_lg_pad->ne[1]; i1++) {
+                        for (int i0 = 0; i0 < chunk_hidden_states_lg_pad->ne[0]; i0++) {
+                            float value = 0.f;
+                            if (i0 < chunk_hidden_states_l->ne[0]) {
+                                value = ggml_tensor_get_f32(chunk_hidden_states_l, i0, i1, i2);
+                            } else if (i0 < chunk_hidden_states_l->ne[0] + chunk_hidden_states_g->ne[0]) {
+                                value = ggml_tensor_get_f32(chunk_hidden_states_g, i0 - chunk_hidden_states_l->ne[0], i1, i2);
                             }
+                            ggml_tensor_set_f32(chunk_hidden_states_lg_pad, value, i0, i1, i2);
                         }
                     }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
                 }
 
+                chunk_hidden_states = ggml_tensor_concat(work_ctx, chunk_hidden_states_lg_pad, chunk_hidden_states_t5, 1);  // [n_token*2, 4096]
+
                 if (chunk_idx == 0) {
-                    auto it       = std::find(chunk_tokens.begin(), chunk_tokens.end(), clip_g_tokenizer.EOS_TOKEN_ID);
-                    max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
-                    clip_g->compute(n_threads,
-                                    input_ids,
-                                    0,
-                                    NULL,
-                                    max_token_idx,
-                                    true,
-                                    &pooled_g,
-                                    work_ctx);
+                    pooled = ggml_tensor_concat(work_ctx, pooled_l[p], pooled_g[p], 0);  // [768 + 1280]
                 }
-            }
 
-            // t5
-            {
-                std::vector<int> chunk_tokens(t5_tokens.begin() + chunk_idx * chunk_len,
-                                              t5_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(t5_weights.begin() + chunk_idx * chunk_len,
-                                                 t5_weights.begin() + (chunk_idx + 1) * chunk_len);
-
-                auto input_ids = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-
-                t5->compute(n_threads,
-                            input_ids,
-                            &chunk_hidden_states_t5,
-                            work_ctx);
-                {
-                    auto tensor         = chunk_hidden_states_t5;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
-                            }
-                        }
+                if (force_zero_embeddings[p]) {
+                    float* vec = (float*)chunk_hidden_states->data;
+                    for (int i = 0; i < ggml_nelements(chunk_hidden_states); i++) {
+                        vec[i] = 0;
                     }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
                 }
-            }
 
-            auto chunk_hidden_states_lg_pad = ggml_new_tensor_3d(work_ctx,
-                                                                 chunk_hidden_states_l->type,
-                                                                 4096,
-                                                                 chunk_hidden_states_l->ne[1],
-                                                                 chunk_hidden_states_l->ne[2]);  // [n_token, 4096]
-
-            for (int i2 = 0; i2 < chunk_hidden_states_lg_pad->ne[2]; i2++) {
-                for (int i1 = 0; i1 < chunk_hidden_states_lg_pad->ne[1]; i1++) {
-                    for (int i0 = 0; i0 < chunk_hidden_states_lg_pad->ne[0]; i0++) {
-                        float value = 0.f;
-                        if (i0 < chunk_hidden_states_l->ne[0]) {
-                            value = ggml_tensor_get_f32(chunk_hidden_states_l, i0, i1, i2);
-                        } else if (i0 < chunk_hidden_states_l->ne[0] + chunk_hidden_states_g->ne[0]) {
-                            value = ggml_tensor_get_f32(chunk_hidden_states_g, i0 - chunk_hidden_states_l->ne[0], i1, i2);
-                        }
-                        ggml_tensor_set_f32(chunk_hidden_states_lg_pad, value, i0, i1, i2);
-                    }
-                }
+                hidden_states_vec.insert(hidden_states_vec.end(),
+                                         (float*)chunk_hidden_states->data,
+                                         ((float*)chunk_hidden_states->data) + ggml_nelements(chunk_hidden_states));
             }
 
-            chunk_hidden_states = ggml_tensor_concat(work_ctx, chunk_hidden_states_lg_pad, chunk_hidden_states_t5, 1);  // [n_token*2, 4096]
-
-            if (chunk_idx == 0) {
-                pooled = ggml_tensor_concat(work_ctx, pooled_l, pooled_g, 0);  // [768 + 1280]
-            }
-
-            int64_t t1 = ggml_time_ms();
-            LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
-            if (force_zero_embeddings) {
-                float* vec = (float*)chunk_hidden_states->data;
-                for (int i = 0; i < ggml_nelements(chunk_hidden_states); i++) {
-                    vec[i] = 0;
-                }
-            }
-
-            hidden_states_vec.insert(hidden_states_vec.end(),
-                                     (float*)chunk_hidden_states->data,
-                                     ((float*)chunk_hidden_states->data) + ggml_nelements(chunk_hidden_states));
+            hidden_states = vector_to_ggml_tensor(work_ctx, hidden_states_vec);
+            hidden_states = ggml_reshape_2d(work_ctx,
+                                            hidden_states,
+                                            chunk_hidden_states->ne[0],
+                                            ggml_nelements(hidden_states) / chunk_hidden_states->ne[0]);
+            conds.push_back(SDCondition(hidden_states, pooled, NULL));
         }
-
-        hidden_states = vector_to_ggml_tensor(work_ctx, hidden_states_vec);
-        hidden_states = ggml_reshape_2d(work_ctx,
-                                        hidden_states,
-                                        chunk_hidden_states->ne[0],
-                                        ggml_nelements(hidden_states) / chunk_hidden_states->ne[0]);
-        return SDCondition(hidden_states, pooled, NULL);
+        ggml_free(clip_ctx);
+        ggml_free(t5_ctx);
+        return conds;
     }
 
     SDCondition get_learned_condition(ggml_context* work_ctx,
@@ -950,7 +998,24 @@ struct SD3CLIPEmbedder : public Conditioner {
                                       int adm_in_channels        = -1,
                                       bool force_zero_embeddings = false) {
         auto tokens_and_weights = tokenize(text, 77, true);
-        return get_learned_condition_common(work_ctx, n_threads, tokens_and_weights, clip_skip, force_zero_embeddings);
+        return get_learned_conditions_common(work_ctx, n_threads, {tokens_and_weights}, clip_skip, {force_zero_embeddings})[0];
+    }
+
+    std::pair<SDCondition, SDCondition> get_learned_condition_pair(ggml_context* work_ctx,
+                                                                   int n_threads,
+                                                                   const std::string& text,
+                                                                   const std::string& negative_text,
+                                                                   int clip_skip,
+                                                                   int width,
+                                                                   int height,
+                                                                   int adm_in_channels                 = -1,
+                                                                   bool negative_force_zero_embeddings = false) {
+        auto conds = get_learned_conditions_common(work_ctx,
+                                                   n_threads,
+                                                   {tokenize(text, 77, true), tokenize(negative_text, 77, true)},
+                                                   clip_skip,
+                                                   {false, negative_force_zero_embeddings});
+        return {conds[0], conds[1]};
     }
 
     std::tuple<SDCondition, std::vector<bool>> get_learned_condition_with_trigger(ggml_context* work_ctx,
@@ -976,6 +1041,8 @@ struct FluxCLIPEmbedder : public Conditioner {
     T5UniGramTokenizer t5_tokenizer;
     std::shared_ptr<CLIPTextModelRunner> clip_l;
     std::shared_ptr<T5Runner> t5;
+    ggml_backend_t clip_cpu_backend = NULL;    // so clip_l can run next to t5
+    float t5_thread_share           = 0.875f;  // t5 dominates, clip_l only computes the pooled output
 
     FluxCLIPEmbedder(ggml_backend_t backend,
                      std::map<std::string, enum ggml_type>& tensor_types,
@@ -983,10 +1050,25 @@ struct FluxCLIPEmbedder : public Conditioner {
         if (clip_skip <= 0) {
             clip_skip = 2;
         }
-        clip_l = std::make_shared<CLIPTextModelRunner>(backend, tensor_types, "text_encoders.clip_l.transformer.text_model", OPENAI_CLIP_VIT_L_14, clip_skip, true);
+        if (ggml_backend_is_cpu(backend)) {
+            clip_cpu_backend = ggml_backend_cpu_init();
+        }
+        clip_l = std::make_shared<CLIPTextModelRunner>(clip_cpu_backend != NULL ? clip_cpu_backend : backend, tensor_types, "text_encoders.clip_l.transformer.text_model", OPENAI_CLIP_VIT_L_14, clip_skip, true);
         t5     = std::make_shared<T5Runner>(backend, tensor_types, "text_encoders.t5xxl.transformer");
     }
 
+    ~FluxCLIPEmbedder() {
+        clip_l.reset();
+        if (clip_cpu_backend != NULL) {
+            ggml_backend_free(clip_cpu_backend);
+        }
+    }
+
+    ggml_backend_t get_concurrent_cpu_backend(int n_threads, int* backend_threads) {
+        *backend_threads = n_threads - concurrent_first_threads(n_threads, t5_thread_share);
+        return n_threads < 2 ? NULL : clip_cpu_backend;
+    }
+
     void set_clip_skip(int clip_skip) {
         clip_l->set_clip_skip(clip_skip);
     }
@@ -1064,100 +1146,81 @@ struct FluxCLIPEmbedder : public Conditioner {
         return {{clip_l_tokens, clip_l_weights}, {t5_tokens, t5_weights}};
     }
 
-    SDCondition get_learned_condition_common(ggml_context* work_ctx,
-                                             int n_threads,
-                                             std::vector<std::pair<std::vector<int>, std::vector<float>>> token_and_weights,
-                                             int clip_skip,
-                                             bool force_zero_embeddings = false) {
+    // the prompts (e.g. the prompt and the negative prompt) are encoded together, so that
+    // clip_l can run on one set of threads while t5 runs on the other
+    std::vector<SDCondition> get_learned_conditions_common(ggml_context* work_ctx,
+                                                           int n_threads,
+                                                           const std::vector<std::vector<std::pair<std::vector<int>, std::vector<float>>>>& prompts,
+                                                           int clip_skip,
+                                                           const std::vector<bool>& force_zero_embeddings) {
         set_clip_skip(clip_skip);
-        auto& clip_l_tokens  = token_and_weights[0].first;
-        auto& clip_l_weights = token_and_weights[0].second;
-        auto& t5_tokens      = token_and_weights[1].first;
-        auto& t5_weights     = token_and_weights[1].second;
-
-        int64_t t0                              = ggml_time_ms();
-        struct ggml_tensor* hidden_states       = NULL;  // [N, n_token, 4096]
-        struct ggml_tensor* chunk_hidden_states = NULL;  // [n_token, 4096]
-        struct ggml_tensor* pooled              = NULL;  // [768,]
-        std::vector<float> hidden_states_vec;
-
+        int64_t t0         = ggml_time_ms();
         size_t chunk_len   = 256;
-        size_t chunk_count = t5_tokens.size() / chunk_len;
-        for (int chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
-            // clip_l
-            if (chunk_idx == 0) {
-                size_t chunk_len_l = 77;
-                std::vector<int> chunk_tokens(clip_l_tokens.begin(),
-                                              clip_l_tokens.begin() + chunk_len_l);
-                std::vector<float> chunk_weights(clip_l_weights.begin(),
-                                                 clip_l_weights.begin() + chunk_len_l);
-
-                auto input_ids       = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-                size_t max_token_idx = 0;
-
-                auto it       = std::find(chunk_tokens.begin(), chunk_tokens.end(), clip_l_tokenizer.EOS_TOKEN_ID);
-                max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
+        size_t chunk_len_l = 77;
+        size_t total_count = 0;
+        std::vector<std::vector<ggml_tensor*>> hidden_states_t5(prompts.size());  // [n_token, 4096]
+        std::vector<ggml_tensor*> pooled_l(prompts.size(), NULL);                 // [768,]
+        for (size_t p = 0; p < prompts.size(); p++) {
+            size_t chunk_count = prompts[p][1].first.size() / chunk_len;
+            hidden_states_t5[p].resize(chunk_count, NULL);
+            total_count += chunk_count;
+        }
 
-                clip_l->compute(n_threads,
-                                input_ids,
-                                0,
-                                NULL,
-                                max_token_idx,
-                                true,
-                                &pooled,
-                                work_ctx);
-            }
+        ggml_context* clip_ctx = new_text_encoder_ctx(prompts.size() * (chunk_len_l + 768), prompts.size() * 2);
+        ggml_context* t5_ctx   = new_text_encoder_ctx(total_count * chunk_len * (4096 + 1), total_count * 2);
 
-            // t5
-            {
-                std::vector<int> chunk_tokens(t5_tokens.begin() + chunk_idx * chunk_len,
-                                              t5_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(t5_weights.begin() + chunk_idx * chunk_len,
-                                                 t5_weights.begin() + (chunk_idx + 1) * chunk_len);
-
-                auto input_ids = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-
-                t5->compute(n_threads,
-                            input_ids,
-                            &chunk_hidden_states,
-                            work_ctx);
-                {
-                    auto tensor         = chunk_hidden_states;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
-                            }
-                        }
-                    }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
+        auto encode_clip = [&](int n_threads) {
+            for (size_t p = 0; p < prompts.size(); p++) {
+                if (hidden_states_t5[p].size() > 0) {
+                    clip_encode_chunk(clip_l, clip_l_tokenizer.EOS_TOKEN_ID, prompts[p][0], 0, chunk_len_l, n_threads, clip_ctx, NULL, &pooled_l[p]);
                 }
             }
-
-            int64_t t1 = ggml_time_ms();
-            LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
-            if (force_zero_embeddings) {
-                float* vec = (float*)chunk_hidden_states->data;
-                for (int i = 0; i < ggml_nelements(chunk_hidden_states); i++) {
-                    vec[i] = 0;
+        };
+        auto encode_t5 = [&](int n_threads) {
+            for (size_t p = 0; p < prompts.size(); p++) {
+                for (size_t i = 0; i < hidden_states_t5[p].size(); i++) {
+                    t5_encode_chunk(t5, prompts[p][1], i * chunk_len, chunk_len, n_threads, t5_ctx, &hidden_states_t5[p][i]);
                 }
             }
+        };
+        run_text_encoders(clip_cpu_backend != NULL, n_threads, t5_thread_share, encode_t5, encode_clip);
+        int64_t t1 = ggml_time_ms();
+        LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
+
+        std::vector<SDCondition> conds;
+        for (size_t p = 0; p < prompts.size(); p++) {
+            struct ggml_tensor* hidden_states       = NULL;  // [N, n_token, 4096]
+            struct ggml_tensor* chunk_hidden_states = NULL;  // [n_token, 4096]
+            struct ggml_tensor* pooled              = NULL;  // [768,]
+            std::vector<float> hidden_states_vec;
+            for (size_t chunk_idx = 0; chunk_idx < hidden_states_t5[p].size(); chunk_idx++) {
+                chunk_hidden_states = hidden_states_t5[p][chunk_idx];
+                if (force_zero_embeddings[p]) {
+                    float* vec = (float*)chunk_hidden_states->data;
+                    for (int i = 0; i < ggml_nelements(chunk_hidden_states); i++) {
+                        vec[i] = 0;
+                    }
+                }
 
-            hidden_states_vec.insert(hidden_states_vec.end(),
-                                     (float*)chunk_hidden_states->data,
-                                     ((float*)chunk_hidden_states->data) + ggml_nelements(chunk_hidden_states));
-        }
+                hidden_states_vec.insert(hidden_states_vec.end(),
+                                         (float*)chunk_hidden_states->data,
+                                         ((float*)chunk_hidden_states->data) + ggml_nelements(chunk_hidden_states));
+            }
 
-        hidden_states = vector_to_ggml_tensor(work_ctx, hidden_states_vec);
-        hidden_states = ggml_reshape_2d(work_ctx,
-                                        hidden_states,
-                                        chunk_hidden_states->ne[0],
-                                        ggml_nelements(hidden_states) / chunk_hidden_states->ne[0]);
-        return SDCondition(hidden_states, pooled, NULL);
+            if (pooled_l[p] != NULL) {
+                pooled = ggml_dup_tensor(work_ctx, pooled_l[p]);
+                memcpy(pooled->data, pooled_l[p]->data, ggml_nbytes(pooled));
+            }
+            hidden_states = vector_to_ggml_tensor(work_ctx, hidden_states_vec);
+            hidden_states = ggml_reshape_2d(work_ctx,
+                                            hidden_states,
+                                            chunk_hidden_states->ne[0],
+                                            ggml_nelements(hidden_states) / chunk_hidden_states->ne[0]);
+            conds.push_back(SDCondition(hidden_states, pooled, NULL));
+        }
+        ggml_free(clip_ctx);
+        ggml_free(t5_ctx);
+        return conds;
     }
 
     SDCondition get_learned_condition(ggml_context* work_ctx,
@@ -1169,7 +1232,24 @@ struct FluxCLIPEmbedder : public Conditioner {
                                       int adm_in_channels        = -1,
                                       bool force_zero_embeddings = false) {
         auto tokens_and_weights = tokenize(text, 256, true);
-        return get_learned_condition_common(work_ctx, n_threads, tokens_and_weights, clip_skip, force_zero_embeddings);
+        return get_learned_conditions_common(work_ctx, n_threads, {tokens_and_weights}, clip_skip, {force_zero_embeddings})[0];
+    }
+
+    std::pair<SDCondition, SDCondition> get_learned_condition_pair(ggml_context* work_ctx,
+                                                                   int n_threads,
+                                                                   const std::string& text,
+                                                                   const std::string& negative_text,
+                                                                   int clip_skip,
+                                                                   int width,
+                                                                   int height,
+                                                                   int adm_in_channels                 = -1,
+                                                                   bool negative_force_zero_embeddings = false) {
+        auto conds = get_learned_conditions_common(work_ctx,
+                                                   n_threads,
+                                                   {tokenize(text, 256, true), tokenize(negative_text, 256, true)},
+                                                   clip_skip,
+                                                   {false, negative_force_zero_embeddings});
+        return {conds[0], conds[1]};
     }
 
     std::tuple<SDCondition, std::vector<bool>> get_learned_condition_with_trigger(ggml_context* work_ctx,
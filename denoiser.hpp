@@ -468,13 +468,49 @@ struct FluxFlowDenoiser : public Denoiser {
 
 typedef std::function<ggml_tensor*(ggml_tensor*, float, int)> denoise_cb_t;
 
+// solves the small (<= 3x3) linear systems of the UniPC coefficients, gaussian elimination with partial pivoting
+static std::vector<float> solve_linear_system(std::vector<std::vector<float>> a, std::vector<float> b) {
+    int n = (int)b.size();
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        for (int row = col + 1; row < n; row++) {
+            if (std::fabs(a[row][col]) > std::fabs(a[pivot][col])) {
+                pivot = row;
+            }
+        }
+        std::swap(a[col], a[pivot]);
+        std::swap(b[col], b[pivot]);
+        for (int row = col + 1; row < n; row++) {
+            float f = a[row][col] / a[col][col];
+            for (int k = col; k < n; k++) {
+                a[row][k] -= f * a[col][k];
+            }
+            b[row] -= f * b[col];
+        }
+    }
+    std::vector<float> x(n);
+    for (int row = n - 1; row >= 0; row--) {
+        float sum = b[row];
+        for (int k = row + 1; k < n; k++) {
+            sum -= a[row][k] * x[k];
+        }
+        x[row] = sum / a[row][row];
+    }
+    return x;
+}
+
 // k diffusion reverse ODE: dx = (x - D(x;\sigma)) / \sigma dt; \sigma(t) = t
+// rtol/atol are only used by the adaptive sampler, which takes steps as its NFE budget
+// flow marks flow matching models (x = (1 - sigma) * x0 + sigma * noise), only the SDE samplers depend on it
 static void sample_k_diffusion(sample_method_t method,
                                denoise_cb_t model,
                                ggml_context* work_ctx,
                                ggml_tensor* x,
                                std::vector<float> sigmas,
-                               std::shared_ptr<RNG> rng) {
+                               std::shared_ptr<RNG> rng,
+                               float rtol = 0.05f,
+                               float atol = 0.0078f,
+                               bool flow  = false) {
     size_t steps = sigmas.size() - 1;
     // sample_euler_ancestral
     switch (method) {
@@ -1005,6 +1041,405 @@ static void sample_k_diffusion(sample_method_t method,
                 }
             }
         } break;
+        case DPM_ADAPTIVE:  // DPM-Solver-12 with adaptive step size, Ref: https://arxiv.org/abs/2206.00927 and k-diffusion
+        {
+            // embedded pair in data prediction form: DPM-Solver-1 (Euler in lambda = -log(sigma))
+            // against DPM-Solver-2 with a midpoint, the difference is the local error estimate
+            struct ggml_tensor* denoised_0 = ggml_dup_tensor(work_ctx, x);
+            struct ggml_tensor* x_mid      = ggml_dup_tensor(work_ctx, x);
+            struct ggml_tensor* x_low      = ggml_dup_tensor(work_ctx, x);
+            struct ggml_tensor* x_high     = ggml_dup_tensor(work_ctx, x);
+
+            float* vec_x          = (float*)x->data;
+            float* vec_denoised_0 = (float*)denoised_0->data;
+            float* vec_x_mid      = (float*)x_mid->data;
+            float* vec_x_low      = (float*)x_low->data;
+            float* vec_x_high     = (float*)x_high->data;
+            int64_t n             = ggml_nelements(x);
+
+            float sigma_max = sigmas[0];
+            float sigma_min = sigma_max;
+            for (float sigma : sigmas) {
+                if (sigma > 0) {
+                    sigma_min = sigma;
+                }
+            }
+            int max_nfe = (int)steps;
+
+            auto t_fn     = [](float sigma) -> float { return -log(sigma); };
+            auto sigma_fn = [](float t) -> float { return exp(-t); };
+
+            float t_end        = t_fn(sigma_min);
+            float t            = t_fn(sigma_max);
+            float h            = std::min(0.05f, t_end - t);
+            float error_prev   = 1.f;
+            bool has_denoised  = false;
+            int nfe            = 0;
+            int accepted       = 0;
+            int rejected       = 0;
+            const float safety = 0.81f;
+
+            // the calls of a step attempt are numbered by the accepted steps before it, the final
+            // call by max_nfe, so step == steps marks the last call like for the fixed step samplers
+            auto step_number = [&]() -> int { return std::max(std::min(accepted + 1, max_nfe - 1), 1); };
+
+            // keep one evaluation for the final step to sigma = 0
+            while (t < t_end - 1e-5f && nfe + (has_denoised ? 1 : 2) + 1 <= max_nfe) {
+                float t_next     = std::min(t + h, t_end);
+                h                = t_next - t;
+                float sigma      = sigma_fn(t);
+                float sigma_next = sigma_fn(t_next);
+                float sigma_mid  = sigma_fn(t + h / 2);
+
+                if (!has_denoised) {
+                    ggml_tensor* denoised = model(x, sigma, step_number());
+                    nfe++;
+                    memcpy(vec_denoised_0, denoised->data, ggml_nbytes(denoised));
+                    has_denoised = true;
+                }
+
+                // first order: x_low = sigma_next / sigma * x - (exp(-h) - 1) * D(x, sigma)
+                float a = sigma_next / sigma;
+                float b = exp(-h) - 1.f;
+                for (int64_t j = 0; j < n; j++) {
+                    vec_x_low[j] = a * vec_x[j] - b * vec_denoised_0[j];
+                }
+
+                // second order: evaluate at the midpoint in lambda
+                float a_mid = sigma_mid / sigma;
+                float b_mid = exp(-h / 2) - 1.f;
+                for (int64_t j = 0; j < n; j++) {
+                    vec_x_mid[j] = a_mid * vec_x[j] - b_mid * vec_denoised_0[j];
+                }
+                ggml_tensor* denoised_mid = model(x_mid, sigma_mid, step_number());
+                float* vec_denoised_mid   = (float*)denoised_mid->data;
+                nfe++;
+                for (int64_t j = 0; j < n; j++) {
+                    vec_x_high[j] = a * vec_x[j] - b * vec_denoised_mid[j];
+                }
+
+                // scaled RMS error, delta = max(atol, rtol * max(|x_low|, |x|))
+                double error_sum = 0.0;
+                for (int64_t j = 0; j < n; j++) {
+                    float delta = std::max(atol, rtol * std::max(std::fabs(vec_x_low[j]), std::fabs(vec_x[j])));
+                    float e     = (vec_x_low[j] - vec_x_high[j]) / delta;
+                    error_sum += e * e;
+                }
+                float error = (float)std::sqrt(error_sum / n) + 1e-8f;
+
+                // PI step size controller
+                float factor = std::pow(safety / error, 0.35f / 2) * std::pow(error_prev, 0.2f / 2);
+                factor       = std::min(std::max(factor, 0.2f), 5.f);
+                if (error <= 1.f) {
+                    memcpy(vec_x, vec_x_high, ggml_nbytes(x));
+                    t            = t_next;
+                    error_prev   = error;
+                    has_denoised = false;
+                    accepted++;
+                } else {
+                    rejected++;
+                }
+                h = h * factor;
+            }
+
+            if (t < t_end - 1e-5f) {
+                LOG_WARN("adaptive sampler hit the NFE limit (%d) at sigma %.4f", max_nfe, sigma_fn(t));
+            }
+
+            // last step to sigma = 0: x = D(x, sigma)
+            ggml_tensor* denoised = model(x, sigma_fn(t), max_nfe);
+            nfe++;
+            memcpy(vec_x, denoised->data, ggml_nbytes(x));
+
+            LOG_INFO("adaptive sampler: %d NFEs, %d steps accepted, %d rejected", nfe, accepted, rejected);
+        } break;
+
+        case DPMPP3M_SDE:  // DPM++ (3M) SDE, Ref: https://github.com/crowsonkb/k-diffusion/blob/master/k_diffusion/sampling.py
+        {
+            const float eta                = 1.0f;
+            struct ggml_tensor* noise      = ggml_dup_tensor(work_ctx, x);
+            struct ggml_tensor* denoised_1 = ggml_dup_tensor(work_ctx, x);
+            struct ggml_tensor* denoised_2 = ggml_dup_tensor(work_ctx, x);
+            float* vec_x                   = (float*)x->data;
+            float* vec_noise               = (float*)noise->data;
+            float* vec_denoised_1          = (float*)denoised_1->data;
+            float* vec_denoised_2          = (float*)denoised_2->data;
+            float h_1                      = 0.f;
+            float h_2                      = 0.f;
+
+            // half log SNR, alpha is 1 for eps/v models and 1 - sigma for flow models
+            auto alpha_fn  = [&](float sigma) -> float { return flow ? std::max(1.f - sigma, 1e-4f) : 1.f; };
+            auto lambda_fn = [&](float sigma) -> float { return log(alpha_fn(sigma) / sigma); };
+
+            for (int i = 0; i < steps; i++) {
+                // denoise
+                ggml_tensor* denoised = model(x, sigmas[i], i + 1);
+                float* vec_denoised   = (float*)denoised->data;
+                float h               = 0.f;
+
+                if (sigmas[i + 1] == 0) {
+                    // x = denoised
+                    for (int j = 0; j < ggml_nelements(x); j++) {
+                        vec_x[j] = vec_denoised[j];
+                    }
+                } else {
+                    h             = lambda_fn(sigmas[i + 1]) - lambda_fn(sigmas[i]);
+                    float h_eta   = h * (eta + 1.f);
+                    float alpha_t = alpha_fn(sigmas[i + 1]);
+                    float a       = sigmas[i + 1] / sigmas[i] * exp(-h * eta);
+                    float b       = alpha_t * -expm1(-h_eta);
+                    float phi_2   = expm1(-h_eta) / h_eta + 1.f;
+                    float phi_3   = phi_2 / h_eta - 0.5f;
+
+                    if (i >= 2) {
+                        float r0 = h_1 / h;
+                        float r1 = h_2 / h;
+                        for (int j = 0; j < ggml_nelements(x); j++) {
+                            float d1_0 = (vec_denoised[j] - vec_denoised_1[j]) / r0;
+                            float d1_1 = (vec_denoised_1[j] - vec_denoised_2[j]) / r1;
+                            float d1   = d1_0 + (d1_0 - d1_1) * r0 / (r0 + r1);
+                            float d2   = (d1_0 - d1_1) / (r0 + r1);
+                            vec_x[j]   = a * vec_x[j] + b * vec_denoised[j] + alpha_t * (phi_2 * d1 - phi_3 * d2);
+                        }
+                    } else if (i == 1) {
+                        float r = h_1 / h;
+                        for (int j = 0; j < ggml_nelements(x); j++) {
+                            float d  = (vec_denoised[j] - vec_denoised_1[j]) / r;
+                            vec_x[j] = a * vec_x[j] + b * vec_denoised[j] + alpha_t * phi_2 * d;
+                        }
+                    } else {
+                        for (int j = 0; j < ggml_nelements(x); j++) {
+                            vec_x[j] = a * vec_x[j] + b * vec_denoised[j];
+                        }
+                    }
+
+                    // x = x + noise * sigma_next * sqrt(1 - exp(-2 * h * eta))
+                    ggml_tensor_set_f32_randn(noise, rng);
+                    float noise_scale = sigmas[i + 1] * std::sqrt(-expm1(-2.f * h * eta));
+                    for (int j = 0; j < ggml_nelements(x); j++) {
+                        vec_x[j] = vec_x[j] + vec_noise[j] * noise_scale;
+                    }
+                }
+
+                // denoised_2 = denoised_1, denoised_1 = denoised
+                for (int j = 0; j < ggml_nelements(x); j++) {
+                    vec_denoised_2[j] = vec_denoised_1[j];
+                    vec_denoised_1[j] = vec_denoised[j];
+                }
+                h_2 = h_1;
+                h_1 = h;
+            }
+        } break;
+        case UNIPC_BH1:
+        case UNIPC_BH2:  // UniPC, Ref: https://arxiv.org/abs/2302.04867 and diffusers UniPCMultistepScheduler
+        {
+            // data prediction, predictor UniP and corrector UniC (the corrector reuses the next model output)
+            const int max_order = 2;  // recommended for guided sampling
+            bool bh2            = method == UNIPC_BH2;
+            int64_t n           = ggml_nelements(x);
+            float* vec_x        = (float*)x->data;
+
+            struct ggml_tensor* last_sample = ggml_dup_tensor(work_ctx, x);
+            float* vec_last_sample          = (float*)last_sample->data;
+
+            // model outputs of the previous steps, newest last
+            std::vector<ggml_tensor*> free_outputs;
+            std::vector<ggml_tensor*> outputs;
+            std::vector<float> output_sigmas;
+            for (int k = 0; k < max_order + 1; k++) {
+                free_outputs.push_back(ggml_dup_tensor(work_ctx, x));
+            }
+
+            auto lambda_fn = [](float sigma) -> float { return -log(sigma); };
+
+            // R[k][j] = rks[j]^k, b[k] = phi_{k+1}(h) * (k+1)! / B(h)
+            auto get_r_b = [&](float h, const std::vector<float>& rks, std::vector<std::vector<float>>& R, std::vector<float>& b) {
+                float hh          = -h;
+                float h_phi_k     = expm1(hh) / hh - 1.f;
+                float factorial_i = 1.f;
+                float B_h         = bh2 ? expm1(hh) : hh;
+                int order         = (int)rks.size();
+                R.assign(order, std::vector<float>(order));
+                b.assign(order, 0.f);
+                for (int k = 0; k < order; k++) {
+                    for (int j = 0; j < order; j++) {
+                        R[k][j] = std::pow(rks[j], (float)k);
+                    }
+                    b[k] = h_phi_k * factorial_i / B_h;
+                    factorial_i *= (k + 2);
+                    h_phi_k = h_phi_k / hh - 1.f / factorial_i;
+                }
+                return B_h;
+            };
+
+            int this_order = 1;
+            for (int i = 0; i < steps; i++) {
+                float sigma = sigmas[i];
+
+                // denoise
+                ggml_tensor* denoised = model(x, sigma, i + 1);
+                ggml_tensor* m_t      = free_outputs.back();
+                free_outputs.pop_back();
+                memcpy(m_t->data, denoised->data, ggml_nbytes(x));
+                float* vec_m_t = (float*)m_t->data;
+
+                if (i > 0) {
+                    // corrector from the previous sample, using the new model output
+                    float sigma_s0 = output_sigmas.back();
+                    float h        = lambda_fn(sigma) - lambda_fn(sigma_s0);
+                    float* vec_m0  = (float*)outputs.back()->data;
+
+                    std::vector<float> rks;
+                    std::vector<float*> vec_ms;
+                    for (int k = 1; k < this_order; k++) {
+                        rks.push_back((lambda_fn(output_sigmas[output_sigmas.size() - 1 - k]) - lambda_fn(sigma_s0)) / h);
+                        vec_ms.push_back((float*)outputs[outputs.size() - 1 - k]->data);
+                    }
+                    rks.push_back(1.f);
+
+                    std::vector<std::vector<float>> R;
+                    std::vector<float> b;
+                    float B_h = get_r_b(h, rks, R, b);
+                    std::vector<float> rhos_c;
+                    if (this_order == 1) {
+                        rhos_c = {0.5f};
+                    } else {
+                        rhos_c = solve_linear_system(R, b);
+                    }
+
+                    float a       = sigma / sigma_s0;
+                    float h_phi_1 = expm1(-h);
+                    for (int64_t j = 0; j < n; j++) {
+                        float corr_res = 0.f;
+                        for (size_t k = 0; k < vec_ms.size(); k++) {
+                            corr_res += rhos_c[k] * (vec_ms[k][j] - vec_m0[j]) / rks[k];
+                        }
+                        float D1_t = vec_m_t[j] - vec_m0[j];
+                        vec_x[j]   = a * vec_last_sample[j] - h_phi_1 * vec_m0[j] - B_h * (corr_res + rhos_c.back() * D1_t);
+                    }
+                }
+
+                outputs.push_back(m_t);
+                output_sigmas.push_back(sigma);
+                if ((int)outputs.size() > max_order) {
+                    free_outputs.push_back(outputs.front());
+                    outputs.erase(outputs.begin());
+                    output_sigmas.erase(output_sigmas.begin());
+                }
+
+                // lower order for the warmup and the final steps
+                this_order = std::min(std::min(max_order, (int)steps - i), i + 1);
+                memcpy(vec_last_sample, vec_x, ggml_nbytes(x));
+
+                if (sigmas[i + 1] == 0) {
+                    // x = denoised
+                    memcpy(vec_x, vec_m_t, ggml_nbytes(x));
+                    continue;
+                }
+
+                // predictor
+                float sigma_next = sigmas[i + 1];
+                float h          = lambda_fn(sigma_next) - lambda_fn(sigma);
+
+                std::vector<float> rks;
+                std::vector<float*> vec_ms;
+                for (int k = 1; k < this_order; k++) {
+                    rks.push_back((lambda_fn(output_sigmas[output_sigmas.size() - 1 - k]) - lambda_fn(sigma)) / h);
+                    vec_ms.push_back((float*)outputs[outputs.size() - 1 - k]->data);
+                }
+                rks.push_back(1.f);
+
+                std::vector<std::vector<float>> R;
+                std::vector<float> b;
+                float B_h = get_r_b(h, rks, R, b);
+                std::vector<float> rhos_p;
+                if (this_order == 2) {
+                    rhos_p = {0.5f};
+                } else if (this_order > 2) {
+                    std::vector<std::vector<float>> R_p(this_order - 1);
+                    for (int k = 0; k < this_order - 1; k++) {
+                        R_p[k].assign(R[k].begin(), R[k].end() - 1);
+                    }
+                    rhos_p = solve_linear_system(R_p, std::vector<float>(b.begin(), b.end() - 1));
+                }
+
+                float a       = sigma_next / sigma;
+                float h_phi_1 = expm1(-h);
+                for (int64_t j = 0; j < n; j++) {
+                    float pred_res = 0.f;
+                    for (size_t k = 0; k < vec_ms.size(); k++) {
+                        pred_res += rhos_p[k] * (vec_ms[k][j] - vec_m_t[j]) / rks[k];
+                    }
+                    vec_x[j] = a * vec_x[j] - h_phi_1 * vec_m_t[j] - B_h * pred_res;
+                }
+            }
+        } break;
+        case DEIS:  // DEIS (rhoAB), Ref: https://arxiv.org/abs/2204.13902 and https://github.com/zju-pi/diff-sampler
+        {
+            // Adams-Bashforth in sigma, the integrals of the Lagrange polynomials through
+            // the previous derivatives are computed analytically
+            const int max_order = 3;
+            int64_t n           = ggml_nelements(x);
+            float* vec_x        = (float*)x->data;
+            std::vector<ggml_tensor*> buffer_model;  // previous derivatives, newest last
+            for (int k = 0; k < max_order; k++) {
+                buffer_model.push_back(ggml_dup_tensor(work_ctx, x));
+            }
+            int n_history = 0;
+
+            // integral of (t - a)(t - b) / ((c - a)(c - b)) over [start, end]
+            auto integral_2 = [](float a, float b, float start, float end, float c) -> float {
+                float coeff = (std::pow(end, 3.f) - std::pow(start, 3.f)) / 3 - (end * end - start * start) * (a + b) / 2 + (end - start) * a * b;
+                return coeff / ((c - a) * (c - b));
+            };
+
+            for (int i = 0; i < steps; i++) {
+                float t_cur  = sigmas[i];
+                float t_next = sigmas[i + 1];
+
+                // denoise
+                ggml_tensor* denoised = model(x, t_cur, i + 1);
+                float* vec_denoised   = (float*)denoised->data;
+
+                // d_cur = (x - denoised) / sigma, stored in the oldest history slot
+                ggml_tensor* d_cur = buffer_model.front();
+                buffer_model.erase(buffer_model.begin());
+                buffer_model.push_back(d_cur);
+                float* vec_d_cur = (float*)d_cur->data;
+                for (int64_t j = 0; j < n; j++) {
+                    vec_d_cur[j] = (vec_x[j] - vec_denoised[j]) / t_cur;
+                }
+
+                int order = std::min(max_order, n_history + 1);
+                if (t_next <= 0) {
+                    order = 1;
+                }
+
+                std::vector<float> coeffs;
+                if (order == 1) {
+                    coeffs = {t_next - t_cur};
+                } else if (order == 2) {
+                    float t_1 = sigmas[i - 1];
+                    coeffs    = {((t_next - t_1) * (t_next - t_1) - (t_cur - t_1) * (t_cur - t_1)) / (2 * (t_cur - t_1)),
+                                 (t_next - t_cur) * (t_next - t_cur) / (2 * (t_1 - t_cur))};
+                } else {
+                    float t_1 = sigmas[i - 1];
+                    float t_2 = sigmas[i - 2];
+                    coeffs    = {integral_2(t_1, t_2, t_cur, t_next, t_cur),
+                                 integral_2(t_cur, t_2, t_cur, t_next, t_1),
+                                 integral_2(t_cur, t_1, t_cur, t_next, t_2)};
+                }
+
+                // x = x + sum(coeff_k * d_k), d_0 is the current derivative
+                for (int k = 0; k < order; k++) {
+                    float* vec_d = (float*)buffer_model[max_order - 1 - k]->data;
+                    for (int64_t j = 0; j < n; j++) {
+                        vec_x[j] += coeffs[k] * vec_d[j];
+                    }
+                }
+                n_history = std::min(n_history + 1, max_order - 1);
+            }
+        } break;
 
         default:
             LOG_ERROR("Attempting to sample with nonexisting sample method %i", method);
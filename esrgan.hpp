@@ -142,6 +142,11 @@ struct ESRGAN : public GGMLRunner {
     int scale     = 4;
     int tile_size = 128;  // avoid cuda OOM for 4gb VRAM
 
+    // graph of compute_batch, kept while the input shape does not change
+    struct ggml_cgraph* batch_graph  = NULL;
+    struct ggml_tensor* batch_input  = NULL;
+    struct ggml_tensor* batch_output = NULL;
+
     ESRGAN(ggml_backend_t backend, std::map<std::string, enum ggml_type>& tensor_types)
         : GGMLRunner(backend) {
         rrdb_net.init(params_ctx, tensor_types, "");
@@ -190,8 +195,72 @@ struct ESRGAN : public GGMLRunner {
         auto get_graph = [&]() -> struct ggml_cgraph* {
             return build_graph(x);
         };
+        batch_graph = NULL;  // the compute ctx is reset
         GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
     }
+
+    struct ggml_cgraph* build_batch_graph(int width, int height, int n) {
+        reset_compute_ctx();
+        struct ggml_cgraph* gf = ggml_new_graph(compute_ctx);
+        batch_input            = ggml_new_tensor_4d(compute_ctx, GGML_TYPE_F32, width, height, 3, n);
+        ggml_set_input(batch_input);
+        batch_output = rrdb_net.forward(compute_ctx, batch_input);
+        ggml_set_output(batch_output);
+        ggml_build_forward_expand(gf, batch_output);
+        return gf;
+    }
+
+    // compute buffer size per input pixel, measured on a small tile
+    size_t get_compute_buffer_size_per_pixel() {
+        const int probe_size        = 64;
+        struct ggml_cgraph* gf      = build_batch_graph(probe_size, probe_size, 1);
+        batch_graph                 = NULL;
+        struct ggml_gallocr* allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+        size_t size                 = 0;
+        if (ggml_gallocr_reserve(allocr, gf)) {
+            size = ggml_gallocr_get_buffer_size(allocr, 0);
+        }
+        ggml_gallocr_free(allocr);
+        return size / (probe_size * probe_size);
+    }
+
+    // x: [N, 3, H, W] tiles, output: [N, 3, H*scale, W*scale]
+    // unlike compute, the graph and its allocation are reused across calls with the same shape,
+    // only the input is uploaded
+    bool compute_batch(const int n_threads,
+                       struct ggml_tensor* x,
+                       struct ggml_tensor* output) {
+        if (batch_graph == NULL || compute_allocr == NULL || !ggml_are_same_shape(x, batch_input)) {
+            free_compute_buffer();
+            batch_graph    = build_batch_graph((int)x->ne[0], (int)x->ne[1], (int)x->ne[3]);
+            compute_allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+            if (!ggml_gallocr_alloc_graph(compute_allocr, batch_graph)) {
+                LOG_ERROR("%s: failed to allocate the compute buffer\n", get_desc().c_str());
+                free_compute_buffer();
+                batch_graph = NULL;
+                return false;
+            }
+            LOG_DEBUG("%s compute buffer size: %.2f MB(%s), %dx%d x %d tiles",
+                      get_desc().c_str(),
+                      ggml_gallocr_get_buffer_size(compute_allocr, 0) / 1024.0 / 1024.0,
+                      ggml_backend_is_cpu(backend) ? "RAM" : "VRAM",
+                      (int)x->ne[0],
+                      (int)x->ne[1],
+                      (int)x->ne[3]);
+        }
+        ggml_backend_tensor_set(batch_input, x->data, 0, ggml_nbytes(x));
+        if (ggml_backend_is_cpu(backend)) {
+            ggml_backend_cpu_set_n_threads(backend, n_threads);
+        }
+#ifdef SD_USE_METAL
+        if (ggml_backend_is_metal(backend)) {
+            ggml_backend_metal_set_n_cb(backend, n_threads);
+        }
+#endif
+        ggml_backend_graph_compute(backend, batch_graph);
+        ggml_backend_tensor_get(batch_output, output->data, 0, ggml_nbytes(output));
+        return true;
+    }
 };
 
 #endif  // __ESRGAN_HPP__
\ No newline at end of file
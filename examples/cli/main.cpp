@@ -1,9 +1,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 // #include "preprocessing.hpp"
@@ -39,6 +43,11 @@ const char* sample_method_str[] = {
     "ipndm",
     "ipndm_v",
     "lcm",
+    "dpm_adaptive",
+    "unipc_bh1",
+    "unipc_bh2",
+    "dpm++3m_sde",
+    "deis",
 };
 
 // Names of the sigma schedule overrides, same order as sample_schedule in stable-diffusion.h
@@ -51,6 +60,27 @@ const char* schedule_str[] = {
     "gits",
 };
 
+// Names of the hires fix upscalers, same order as hires_upscaler_t in stable-diffusion.h
+const char* hires_upscaler_str[] = {
+    "latent-bilinear",
+    "latent-bicubic",
+};
+
+const char* output_format_str[] = {
+    "png",
+    "jpg",
+    "ppm",
+    "ppm-stream",
+};
+
+enum OutputFormat {
+    OUTPUT_PNG,
+    OUTPUT_JPG,
+    OUTPUT_PPM,
+    OUTPUT_PPM_STREAM,  // every image appended to a single file, e.g. for ffmpeg -f ppm_pipe
+    OUTPUT_FORMAT_COUNT
+};
+
 const char* modes_str[] = {
     "txt2img",
     "img2img",
@@ -68,7 +98,11 @@ enum SDMode {
 
 struct SDParams {
     int n_threads = -1;
-    SDMode mode   = TXT2IMG;
+    std::string threads_cpumask;
+    int threads_prio    = 0;
+    int threads_poll    = 50;
+    bool threads_strict = false;
+    SDMode mode         = TXT2IMG;
     std::string model_path;
     std::string clip_l_path;
     std::string clip_g_path;
@@ -82,6 +116,8 @@ struct SDParams {
     std::string stacked_id_embeddings_path;
     std::string input_id_images_path;
     sd_type_t wtype = SD_TYPE_COUNT;
+    std::string tensor_type_rules;
+    std::string snapshot_dir;
     std::string lora_model_dir;
     std::string output_path = "output.png";
     std::string input_path;
@@ -102,6 +138,8 @@ struct SDParams {
     int motion_bucket_id     = 127;
     int fps                  = 6;
     float augmentation_level = 0.f;
+    int unet_frame_chunk     = 0;  // 0: all frames at once
+    int vae_frame_chunk      = 0;
 
     sample_method_t sample_method = EULER_A;
     schedule_t schedule           = DEFAULT;
@@ -112,6 +150,7 @@ struct SDParams {
     int64_t seed                  = 42;
     bool verbose                  = false;
     bool vae_tiling               = false;
+    int vae_attn_chunk            = 0;  // 0: all queries at once
     bool control_net_cpu          = false;
     bool normalize_input          = false;
     bool clip_on_cpu              = false;
@@ -120,19 +159,53 @@ struct SDParams {
     bool canny_preprocess         = false;
     bool color                    = false;
     int upscale_repeats           = 1;
+    int upscale_tile_size         = 0;
+    int upscale_tile_batch        = 1;
+    int upscale_budget            = 1024;  // MB
+    OutputFormat output_format    = OUTPUT_FORMAT_COUNT;  // from the output extension if unset
+    int png_compression           = 8;
+    int jpeg_quality              = 90;
+    int writer_threads            = 0;  // 0: min(4, cores)
+    std::string preview_path;
+    int preview_interval = 1;
+    bool preview_taesd   = false;
 
     std::vector<int> skip_layers = {7, 8, 9};
     float slg_scale              = 0.;
     float skip_layer_start       = 0.01;
     float skip_layer_end         = 0.2;
+
+    float adaptive_rtol = 0.05f;
+    float adaptive_atol = 0.0078f;
+
+    float cfg_sigma_min = 0.f;
+    float cfg_sigma_max = INFINITY;
+    int cfg_every       = 1;
+
+    int hires_width                 = 0;
+    int hires_height                = 0;
+    int hires_steps                 = 0;
+    float hires_strength            = 0.5f;
+    hires_upscaler_t hires_upscaler = HIRES_LATENT_BILINEAR;
+
+    int diffusion_tile_size      = 0;
+    float diffusion_tile_overlap = 0.25f;
+    int diffusion_tile_batch     = 1;
+
+    float control_start       = 0.f;
+    float control_end         = 1.f;
+    bool control_share_uncond = false;
 };
 
 void print_params(SDParams params) {
     printf("Option: \n");
     printf("    n_threads:         %d\n", params.n_threads);
+    printf("    threadpool:        cpumask '%s', prio %d, poll %d, strict %s\n", params.threads_cpumask.c_str(), params.threads_prio, params.threads_poll, params.threads_strict ? "true" : "false");
     printf("    mode:              %s\n", modes_str[params.mode]);
     printf("    model_path:        %s\n", params.model_path.c_str());
     printf("    wtype:             %s\n", params.wtype < SD_TYPE_COUNT ? sd_type_name(params.wtype) : "unspecified");
+    printf("    tensor_type_rules: %s\n", params.tensor_type_rules.c_str());
+    printf("    snapshot_dir:      %s\n", params.snapshot_dir.c_str());
     printf("    clip_l_path:       %s\n", params.clip_l_path.c_str());
     printf("    clip_g_path:       %s\n", params.clip_g_path.c_str());
     printf("    t5xxl_path:        %s\n", params.t5xxl_path.c_str());
@@ -154,10 +227,13 @@ void print_params(SDParams params) {
     printf("    vae decoder on cpu:%s\n", params.vae_on_cpu ? "true" : "false");
     printf("    diffusion flash attention:%s\n", params.diffusion_flash_attn ? "true" : "false");
     printf("    strength(control): %.2f\n", params.control_strength);
+    printf("    control window:    [%.2f, %.2f]%s\n", params.control_start, params.control_end, params.control_share_uncond ? ", shared with uncond" : "");
     printf("    prompt:            %s\n", params.prompt.c_str());
     printf("    negative_prompt:   %s\n", params.negative_prompt.c_str());
     printf("    min_cfg:           %.2f\n", params.min_cfg);
     printf("    cfg_scale:         %.2f\n", params.cfg_scale);
+    printf("    cfg_interval:      [%.3f, %.3f], every %d steps\n", params.cfg_sigma_min, params.cfg_sigma_max, params.cfg_every);
+    printf("    diffusion_tiling:  %d px, overlap %.2f, %d per batch\n", params.diffusion_tile_size, params.diffusion_tile_overlap, params.diffusion_tile_batch);
     printf("    slg_scale:         %.2f\n", params.slg_scale);
     printf("    guidance:          %.2f\n", params.guidance);
     printf("    clip_skip:         %d\n", params.clip_skip);
@@ -166,12 +242,20 @@ void print_params(SDParams params) {
     printf("    sample_method:     %s\n", sample_method_str[params.sample_method]);
     printf("    schedule:          %s\n", schedule_str[params.schedule]);
     printf("    sample_steps:      %d\n", params.sample_steps);
+    printf("    adaptive_rtol:     %.4f\n", params.adaptive_rtol);
+    printf("    adaptive_atol:     %.4f\n", params.adaptive_atol);
     printf("    strength(img2img): %.2f\n", params.strength);
+    printf("    hires:             %dx%d, %d steps, strength %.2f, %s\n", params.hires_width, params.hires_height, params.hires_steps, params.hires_strength, hires_upscaler_str[params.hires_upscaler]);
     printf("    rng:               %s\n", rng_type_to_str[params.rng_type]);
     printf("    seed:              %ld\n", params.seed);
     printf("    batch_count:       %d\n", params.batch_count);
     printf("    vae_tiling:        %s\n", params.vae_tiling ? "true" : "false");
+    printf("    vae_attn_chunk:    %d\n", params.vae_attn_chunk);
     printf("    upscale_repeats:   %d\n", params.upscale_repeats);
+    printf("    upscale_tiling:    tile size %d, %d tiles per batch, budget %d MB\n", params.upscale_tile_size, params.upscale_tile_batch, params.upscale_budget);
+    printf("    output_format:     %s, png compression %d, jpeg quality %d, %d writer threads\n", output_format_str[params.output_format], params.png_compression, params.jpeg_quality, params.writer_threads);
+    printf("    frame_chunks:      unet %d, vae %d\n", params.unet_frame_chunk, params.vae_frame_chunk);
+    printf("    preview:           %s, every %d steps%s\n", params.preview_path.c_str(), params.preview_interval, params.preview_taesd ? ", taesd" : "");
 }
 
 void print_usage(int argc, const char* argv[]) {
@@ -182,6 +266,10 @@ void print_usage(int argc, const char* argv[]) {
     printf("  -M, --mode [MODEL]                 run mode (txt2img or img2img or convert, default: txt2img)\n");
     printf("  -t, --threads N                    number of threads to use during computation (default: -1)\n");
     printf("                                     If threads <= 0, then threads will be set to the number of CPU physical cores\n");
+    printf("  --threads-cpumask MASK             cpus of the thread pool, hex (0xff00) or list (0-7,16-23) (default: no affinity)\n");
+    printf("  --threads-prio N                   thread pool priority: 0 normal, 1 medium, 2 high, 3 realtime (default: 0)\n");
+    printf("  --threads-poll N                   thread pool polling level between graphs, 0-100 (default: 50)\n");
+    printf("  --threads-strict                   pin each thread of the pool to its own cpu of the mask\n");
     printf("  -m, --model [MODEL]                path to full model\n");
     printf("  --diffusion-model                  path to the standalone diffusion model\n");
     printf("  --clip_l                           path to the clip-l text encoder\n");
@@ -196,15 +284,36 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --normalize-input                  normalize PHOTOMAKER input id images\n");
     printf("  --upscale-model [ESRGAN_PATH]      path to esrgan model. Upscale images after generate, just RealESRGAN_x4plus_anime_6B supported by now\n");
     printf("  --upscale-repeats                  Run the ESRGAN upscaler this many times (default 1)\n");
+    printf("  --upscale-tile-size N              ESRGAN tile size in pixels, 0 derives it from --upscale-budget (default: 0)\n");
+    printf("  --upscale-tile-batch N             number of ESRGAN tiles per forward (default: 1)\n");
+    printf("  --upscale-budget MB                ESRGAN compute buffer budget for a batch of tiles (default: 1024)\n");
     printf("  --type [TYPE]                      weight type (examples: f32, f16, q4_0, q4_1, q5_0, q5_1, q8_0, q2_K, q3_K, q4_K)\n");
     printf("                                     If not specified, the default is the type of the weight file\n");
+    printf("  --tensor-type-rules [RULES]        per tensor weight type, \"pattern=type,...\" or a file with one rule per line\n");
+    printf("                                     patterns are regexes on tensor names, the first match wins (type 'keep' skips conversion)\n");
     printf("  --lora-model-dir [DIR]             lora model directory\n");
+    printf("  --snapshot-dir [DIR]               cache the prepared (converted) model in this directory to speed up the next start\n");
     printf("  -i, --init-img [IMAGE]             path to the input image, required by img2img\n");
     printf("  --control-image [IMAGE]            path to image condition, control net\n");
     printf("  -o, --output OUTPUT                path to write result image to (default: ./output.png)\n");
+    printf("  --output-format {png, jpg, ppm, ppm-stream}\n");
+    printf("                                     format of the result images, ppm-stream writes all of them to one file (default: from the output extension, else png)\n");
+    printf("  --png-compression N                png deflate level 0-9, lower is faster (default: 8)\n");
+    printf("  --jpeg-quality N                   jpeg quality 1-100 (default: 90)\n");
+    printf("  --writer-threads N                 threads encoding the result images, <= 0 for min(4, cores) (default: 0)\n");
+    printf("  --unet-frame-chunk N               frames per chunk in the spatial attention of the video unet, 0 for all (default: 0)\n");
+    printf("  --vae-frame-chunk N                frames per chunk in the video decoder, chunks overlap and are cross-faded, 0 for all (default: 0)\n");
+    printf("  --preview PATH                     write a preview of the denoised latent to PATH (png) while sampling\n");
+    printf("  --preview-interval N               steps between previews (default: 1)\n");
+    printf("  --preview-taesd                    decode the previews with taesd, needs --taesd (default: linear projection)\n");
     printf("  -p, --prompt [PROMPT]              the prompt to render\n");
     printf("  -n, --negative-prompt PROMPT       the negative prompt (default: \"\")\n");
     printf("  --cfg-scale SCALE                  unconditional guidance scale: (default: 7.0)\n");
+    printf("  --cfg-sigma-min SIGMA              only apply cfg while sigma >= SIGMA (default: 0)\n");
+    printf("  --cfg-sigma-max SIGMA              only apply cfg while sigma <= SIGMA (default: inf)\n");
+    printf("                                     the unconditional pass is skipped outside of this interval\n");
+    printf("  --cfg-every K                      run the unconditional pass every K steps inside the cfg interval,\n");
+    printf("                                     reusing the last guidance delta in between (default: 1)\n");
     printf("  --slg-scale SCALE                  skip layer guidance (SLG) scale, only for DiT models: (default: 0)\n");
     printf("                                     0 means disabled, a value of 2.5 is nice for sd3.5 medium\n");
     printf("  --skip_layers LAYERS               Layers to skip for SLG steps: (default: [7,8,9])\n");
@@ -212,21 +321,38 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --skip_layer_end END               SLG disabling point: (default: 0.2)\n");
     printf("                                     SLG will be enabled at step int([STEPS]*[START]) and disabled at int([STEPS]*[END])\n");
     printf("  --strength STRENGTH                strength for noising/unnoising (default: 0.75)\n");
+    printf("  --hires-width W                    hires fix target width, txt2img samples at -W x -H first (default: 0, disabled)\n");
+    printf("  --hires-height H                   hires fix target height (default: 0, disabled)\n");
+    printf("  --hires-steps STEPS                number of steps of the hires pass schedule (default: same as --steps)\n");
+    printf("  --hires-strength STRENGTH          denoising strength of the hires pass (default: 0.5)\n");
+    printf("  --hires-upscaler {latent-bilinear, latent-bicubic}\n");
+    printf("                                     latent upscaler of the hires pass (default: latent-bilinear)\n");
     printf("  --style-ratio STYLE-RATIO          strength for keeping input identity (default: 20%%)\n");
     printf("  --control-strength STRENGTH        strength to apply Control Net (default: 0.9)\n");
+    printf("  --control-start START              fraction of the steps at which Control Net starts (default: 0.0)\n");
+    printf("  --control-end END                  fraction of the steps at which Control Net stops (default: 1.0)\n");
+    printf("  --control-share-uncond             reuse the Control Net outputs of the cond pass for the uncond pass\n");
     printf("                                     1.0 corresponds to full destruction of information in init image\n");
     printf("  -H, --height H                     image height, in pixel space (default: 512)\n");
     printf("  -W, --width W                      image width, in pixel space (default: 512)\n");
-    printf("  --sampling-method {euler, euler_a, heun, dpm2, dpm++2s_a, dpm++2m, dpm++2mv2, ipndm, ipndm_v, lcm}\n");
+    printf("  --sampling-method {euler, euler_a, heun, dpm2, dpm++2s_a, dpm++2m, dpm++2mv2, ipndm, ipndm_v, lcm, dpm_adaptive,\n");
+    printf("                                     unipc_bh1, unipc_bh2, dpm++3m_sde, deis}\n");
     printf("                                     sampling method (default: \"euler_a\")\n");
     printf("  --steps  STEPS                     number of sample steps (default: 20)\n");
+    printf("                                     for dpm_adaptive, the maximum number of model evaluations\n");
+    printf("  --adaptive-rtol RTOL               relative error tolerance of dpm_adaptive (default: 0.05)\n");
+    printf("  --adaptive-atol ATOL               absolute error tolerance of dpm_adaptive (default: 0.0078)\n");
     printf("  --rng {std_default, cuda}          RNG (default: cuda)\n");
     printf("  -s SEED, --seed SEED               RNG seed (default: 42, use random seed for < 0)\n");
     printf("  -b, --batch-count COUNT            number of images to generate\n");
     printf("  --schedule {discrete, karras, exponential, ays, gits} Denoiser sigma schedule (default: discrete)\n");
     printf("  --clip-skip N                      ignore last layers of CLIP network; 1 ignores none, 2 ignores one layer (default: -1)\n");
     printf("                                     <= 0 represents unspecified, will be 1 for SD1.x, 2 for SD2.x\n");
-    printf("  --vae-tiling                       process vae in tiles to reduce memory usage\n");
+    printf("  --vae-tiling                       process vae in tiles to reduce memory usage (decode and encode)\n");
+    printf("  --vae-attn-chunk N                 latent pixels per chunk in the vae attention, bounds its memory without tiling, 0 for all (default: 0)\n");
+    printf("  --diffusion-tile-size SIZE         run the diffusion model on overlapping SIZE x SIZE pixel windows (default: 0, disabled)\n");
+    printf("  --diffusion-tile-overlap OVERLAP   overlap of the diffusion windows, as a fraction of SIZE (default: 0.25)\n");
+    printf("  --diffusion-tile-batch N           number of diffusion windows evaluated per forward (default: 1)\n");
     printf("  --vae-on-cpu                       keep vae in cpu (for low vram)\n");
     printf("  --clip-on-cpu                      keep clip in cpu (for low vram)\n");
     printf("  --diffusion-fa                     use flash attention in the diffusion model (for low vram)\n");
@@ -250,6 +376,26 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                 break;
             }
             params.n_threads = std::stoi(argv[i]);
+        } else if (arg == "--threads-cpumask") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.threads_cpumask = argv[i];
+        } else if (arg == "--threads-prio") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.threads_prio = std::stoi(argv[i]);
+        } else if (arg == "--threads-poll") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.threads_poll = std::stoi(argv[i]);
+        } else if (arg == "--threads-strict") {
+            params.threads_strict = true;
         } else if (arg == "-M" || arg == "--mode") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -372,6 +518,18 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                         valid_types.c_str());
                 exit(1);
             }
+        } else if (arg == "--tensor-type-rules") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.tensor_type_rules = argv[i];
+        } else if (arg == "--snapshot-dir") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.snapshot_dir = argv[i];
         } else if (arg == "--lora-model-dir") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -412,6 +570,91 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                 fprintf(stderr, "error: upscale multiplier must be at least 1\n");
                 exit(1);
             }
+        } else if (arg == "--upscale-tile-size") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.upscale_tile_size = std::stoi(argv[i]);
+        } else if (arg == "--upscale-tile-batch") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.upscale_tile_batch = std::stoi(argv[i]);
+        } else if (arg == "--upscale-budget") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.upscale_budget = std::stoi(argv[i]);
+        } else if (arg == "--output-format") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            const char* format_selected = argv[i];
+            int format_found            = -1;
+            for (int d = 0; d < OUTPUT_FORMAT_COUNT; d++) {
+                if (!strcmp(format_selected, output_format_str[d])) {
+                    format_found = d;
+                }
+            }
+            if (format_found == -1) {
+                invalid_arg = true;
+                break;
+            }
+            params.output_format = (OutputFormat)format_found;
+        } else if (arg == "--png-compression") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.png_compression = std::stoi(argv[i]);
+        } else if (arg == "--jpeg-quality") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.jpeg_quality = std::stoi(argv[i]);
+        } else if (arg == "--writer-threads") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.writer_threads = std::stoi(argv[i]);
+        } else if (arg == "--vae-attn-chunk") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.vae_attn_chunk = std::stoi(argv[i]);
+        } else if (arg == "--unet-frame-chunk") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.unet_frame_chunk = std::stoi(argv[i]);
+        } else if (arg == "--vae-frame-chunk") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.vae_frame_chunk = std::stoi(argv[i]);
+        } else if (arg == "--preview") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.preview_path = argv[i];
+        } else if (arg == "--preview-interval") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.preview_interval = std::stoi(argv[i]);
+        } else if (arg == "--preview-taesd") {
+            params.preview_taesd = true;
         } else if (arg == "-n" || arg == "--negative-prompt") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -448,6 +691,20 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                 break;
             }
             params.control_strength = std::stof(argv[i]);
+        } else if (arg == "--control-start") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.control_start = std::stof(argv[i]);
+        } else if (arg == "--control-end") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.control_end = std::stof(argv[i]);
+        } else if (arg == "--control-share-uncond") {
+            params.control_share_uncond = true;
         } else if (arg == "-H" || arg == "--height") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -466,6 +723,36 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                 break;
             }
             params.sample_steps = std::stoi(argv[i]);
+        } else if (arg == "--adaptive-rtol") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.adaptive_rtol = std::stof(argv[i]);
+        } else if (arg == "--adaptive-atol") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.adaptive_atol = std::stof(argv[i]);
+        } else if (arg == "--cfg-sigma-min") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.cfg_sigma_min = std::stof(argv[i]);
+        } else if (arg == "--cfg-sigma-max") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.cfg_sigma_max = std::stof(argv[i]);
+        } else if (arg == "--cfg-every") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.cfg_every = std::stoi(argv[i]);
         } else if (arg == "--clip-skip") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -474,6 +761,24 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             params.clip_skip = std::stoi(argv[i]);
         } else if (arg == "--vae-tiling") {
             params.vae_tiling = true;
+        } else if (arg == "--diffusion-tile-size") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.diffusion_tile_size = std::stoi(argv[i]);
+        } else if (arg == "--diffusion-tile-overlap") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.diffusion_tile_overlap = std::stof(argv[i]);
+        } else if (arg == "--diffusion-tile-batch") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.diffusion_tile_batch = std::stoi(argv[i]);
         } else if (arg == "--control-net-cpu") {
             params.control_net_cpu = true;
         } else if (arg == "--normalize-input") {
@@ -506,6 +811,47 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                 invalid_arg = true;
                 break;
             }
+        } else if (arg == "--hires-width") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.hires_width = std::stoi(argv[i]);
+        } else if (arg == "--hires-height") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.hires_height = std::stoi(argv[i]);
+        } else if (arg == "--hires-steps") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.hires_steps = std::stoi(argv[i]);
+        } else if (arg == "--hires-strength") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.hires_strength = std::stof(argv[i]);
+        } else if (arg == "--hires-upscaler") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            const char* upscaler_selected = argv[i];
+            int upscaler_found            = -1;
+            for (int d = 0; d < N_HIRES_UPSCALERS; d++) {
+                if (!strcmp(upscaler_selected, hires_upscaler_str[d])) {
+                    upscaler_found = d;
+                }
+            }
+            if (upscaler_found == -1) {
+                invalid_arg = true;
+                break;
+            }
+            params.hires_upscaler = (hires_upscaler_t)upscaler_found;
         } else if (arg == "--schedule") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -657,6 +1003,16 @@ void parse_args(int argc, const char** argv, SDParams& params) {
         exit(1);
     }
 
+    if (params.hires_width < 0 || params.hires_width % 64 != 0 || params.hires_height < 0 || params.hires_height % 64 != 0) {
+        fprintf(stderr, "error: the hires width and height must be multiples of 64\n");
+        exit(1);
+    }
+
+    if (params.hires_strength < 0.f || params.hires_strength > 1.f) {
+        fprintf(stderr, "error: can only work with hires strength in [0.0, 1.0]\n");
+        exit(1);
+    }
+
     if (params.sample_steps <= 0) {
         fprintf(stderr, "error: the sample_steps must be greater than 0\n");
         exit(1);
@@ -677,6 +1033,23 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             params.output_path = "output.gguf";
         }
     }
+
+    if (params.output_format == OUTPUT_FORMAT_COUNT) {
+        size_t dot            = params.output_path.find_last_of(".");
+        std::string extension = dot != std::string::npos ? params.output_path.substr(dot + 1) : "";
+        if (extension == "jpg" || extension == "jpeg") {
+            params.output_format = OUTPUT_JPG;
+        } else if (extension == "ppm") {
+            params.output_format = OUTPUT_PPM;
+        } else {
+            params.output_format = OUTPUT_PNG;
+        }
+    }
+    params.png_compression = std::min(std::max(params.png_compression, 0), 9);
+    params.jpeg_quality    = std::min(std::max(params.jpeg_quality, 1), 100);
+    if (params.writer_threads <= 0) {
+        params.writer_threads = std::min(4, std::max(1, get_num_physical_cores()));
+    }
 }
 
 static std::string sd_basename(const std::string& path) {
@@ -711,6 +1084,11 @@ std::string get_image_params(SDParams params, int64_t seed) {
     parameter_string += "Guidance: " + std::to_string(params.guidance) + ", ";
     parameter_string += "Seed: " + std::to_string(seed) + ", ";
     parameter_string += "Size: " + std::to_string(params.width) + "x" + std::to_string(params.height) + ", ";
+    if (params.hires_width > 0 && params.hires_height > 0) {
+        parameter_string += "Hires resize: " + std::to_string(params.hires_width) + "x" + std::to_string(params.hires_height) + ", ";
+        parameter_string += "Hires upscaler: " + std::string(hires_upscaler_str[params.hires_upscaler]) + ", ";
+        parameter_string += "Denoising strength: " + std::to_string(params.hires_strength) + ", ";
+    }
     parameter_string += "Model: " + sd_basename(params.model_path) + ", ";
     parameter_string += "RNG: " + std::string(rng_type_to_str[params.rng_type]) + ", ";
     parameter_string += "Sampler: " + std::string(sample_method_str[params.sample_method]);
@@ -722,6 +1100,152 @@ std::string get_image_params(SDParams params, int64_t seed) {
     return parameter_string;
 }
 
+static bool write_ppm(FILE* file, const sd_image_t& image) {
+    fprintf(file, "%s\n%u %u\n255\n", image.channel == 1 ? "P5" : "P6", image.width, image.height);
+    size_t size = (size_t)image.width * image.height * image.channel;
+    return fwrite(image.data, 1, size, file) == size;
+}
+
+// encodes the result images on a few threads as soon as they are queued. The images
+// are queued after upscaling, so freeing the context overlaps with png deflate.
+// Queued images are owned and freed by the writer.
+class ImageWriter {
+private:
+    struct Job {
+        sd_image_t image;
+        std::string path;
+        std::string parameters;
+    };
+
+    const SDParams& params;
+    std::string base_path;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Job> jobs;
+    bool stopping = false;
+    int n_failed  = 0;
+
+    FILE* stream     = NULL;  // ppm-stream only, written in order on the calling thread
+    int stream_count = 0;
+
+    bool write(const Job& job) {
+        const sd_image_t& image = job.image;
+        if (params.output_format == OUTPUT_JPG) {
+            return stbi_write_jpg(job.path.c_str(), image.width, image.height, image.channel, image.data, params.jpeg_quality) != 0;
+        }
+        if (params.output_format == OUTPUT_PPM) {
+            FILE* file = fopen(job.path.c_str(), "wb");
+            if (file == NULL) {
+                return false;
+            }
+            bool success = write_ppm(file, image);
+            return fclose(file) == 0 && success;
+        }
+        return stbi_write_png(job.path.c_str(), image.width, image.height, image.channel,
+                              image.data, 0, job.parameters.c_str()) != 0;
+    }
+
+    void run() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopping || jobs.size() > 0; });
+                if (jobs.empty()) {
+                    return;
+                }
+                job = jobs.front();
+                jobs.pop_front();
+            }
+            bool success = write(job);
+            free(job.image.data);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (success) {
+                printf("save result image to '%s'\n", job.path.c_str());
+            } else {
+                fprintf(stderr, "save result image to '%s' failed\n", job.path.c_str());
+                n_failed++;
+            }
+        }
+    }
+
+public:
+    ImageWriter(const SDParams& params)
+        : params(params) {
+        size_t last = params.output_path.find_last_of(".");
+        base_path   = last != std::string::npos ? params.output_path.substr(0, last) : params.output_path;
+
+        stbi_write_png_compression_level = params.png_compression;
+        if (params.output_format != OUTPUT_PPM_STREAM) {
+            for (int i = 0; i < params.writer_threads; i++) {
+                threads.emplace_back(&ImageWriter::run, this);
+            }
+        }
+    }
+
+    ~ImageWriter() {
+        finish();
+    }
+
+    // index 0 is written to the output path, index i to <output>_<i + 1>
+    void add(sd_image_t image, int index, int64_t seed) {
+        if (params.output_format == OUTPUT_PPM_STREAM) {
+            if (stream == NULL && n_failed == 0) {
+                stream = fopen((base_path + ".ppm").c_str(), "wb");
+            }
+            if (stream == NULL || !write_ppm(stream, image)) {
+                n_failed++;
+            } else {
+                stream_count++;
+            }
+            free(image.data);
+            return;
+        }
+        const char* extension = params.output_format == OUTPUT_JPG ? ".jpg" : (params.output_format == OUTPUT_PPM ? ".ppm" : ".png");
+        Job job;
+        job.image = image;
+        job.path  = index > 0 ? base_path + "_" + std::to_string(index + 1) + extension : base_path + extension;
+        if (params.output_format == OUTPUT_PNG) {
+            job.parameters = get_image_params(params, seed);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(job);
+        }
+        cv.notify_one();
+    }
+
+    // waits for the queued images, returns false if any of them failed
+    bool finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+        if (stream != NULL) {
+            if (fclose(stream) != 0) {
+                n_failed++;
+            }
+            stream = NULL;
+            printf("save %d result images to '%s.ppm'\n", stream_count, base_path.c_str());
+        }
+        return n_failed == 0;
+    }
+};
+
+bool sd_preview_cb(int step, int steps, const sd_image_t* image, void* data) {
+    SDParams* params = (SDParams*)data;
+    if (!stbi_write_png(params->preview_path.c_str(), image->width, image->height, image->channel, image->data, 0, NULL)) {
+        fprintf(stderr, "write preview %s failed\n", params->preview_path.c_str());
+    }
+    return true;
+}
+
 /* Enables Printing the log level tag in color using ANSI escape codes */
 void sd_log_cb(enum sd_log_level_t level, const char* log, void* data) {
     SDParams* params = (SDParams*)data;
@@ -771,6 +1295,9 @@ int main(int argc, const char* argv[]) {
     parse_args(argc, argv, params);
 
     sd_set_log_callback(sd_log_cb, (void*)&params);
+    if (params.preview_path.size() > 0) {
+        sd_set_preview_callback(sd_preview_cb, params.preview_interval, params.preview_taesd ? SD_PREVIEW_TAE : SD_PREVIEW_PROJ, (void*)&params);
+    }
 
     if (params.verbose) {
         print_params(params);
@@ -778,7 +1305,11 @@ int main(int argc, const char* argv[]) {
     }
 
     if (params.mode == CONVERT) {
-        bool success = convert(params.model_path.c_str(), params.vae_path.c_str(), params.output_path.c_str(), params.wtype);
+        bool success = convert(params.model_path.c_str(),
+                               params.vae_path.c_str(),
+                               params.output_path.c_str(),
+                               params.wtype,
+                               params.tensor_type_rules.c_str());
         if (!success) {
             fprintf(stderr,
                     "convert '%s'/'%s' to '%s' failed\n",
@@ -876,13 +1407,23 @@ int main(int argc, const char* argv[]) {
                                   params.clip_on_cpu,
                                   params.control_net_cpu,
                                   params.vae_on_cpu,
-                                  params.diffusion_flash_attn);
+                                  params.diffusion_flash_attn,
+                                  params.tensor_type_rules.c_str(),
+                                  params.snapshot_dir.c_str());
 
     if (sd_ctx == NULL) {
         printf("new_sd_ctx_t failed\n");
         return 1;
     }
 
+    if (!sd_set_threadpool(sd_ctx, params.threads_cpumask.c_str(), params.threads_prio, params.threads_poll, params.threads_strict)) {
+        printf("sd_set_threadpool failed\n");
+        free_sd_ctx(sd_ctx);
+        return 1;
+    }
+    sd_set_video_frame_chunks(sd_ctx, params.unet_frame_chunk, params.vae_frame_chunk);
+    sd_set_vae_attention_chunk(sd_ctx, params.vae_attn_chunk);
+
     sd_image_t* control_image = NULL;
     if (params.controlnet_path.size() > 0 && params.control_image_path.size() > 0) {
         int c                = 0;
@@ -930,7 +1471,23 @@ int main(int argc, const char* argv[]) {
                           params.skip_layers.size(),
                           params.slg_scale,
                           params.skip_layer_start,
-                          params.skip_layer_end);
+                          params.skip_layer_end,
+                          params.adaptive_rtol,
+                          params.adaptive_atol,
+                          params.cfg_sigma_min,
+                          params.cfg_sigma_max,
+                          params.cfg_every,
+                          params.hires_width,
+                          params.hires_height,
+                          params.hires_steps,
+                          params.hires_strength,
+                          params.hires_upscaler,
+                          params.diffusion_tile_size,
+                          params.diffusion_tile_overlap,
+                          params.diffusion_tile_batch,
+                          params.control_start,
+                          params.control_end,
+                          params.control_share_uncond);
     } else {
         sd_image_t input_image = {(uint32_t)params.width,
                                   (uint32_t)params.height,
@@ -957,22 +1514,15 @@ int main(int argc, const char* argv[]) {
                 free_sd_ctx(sd_ctx);
                 return 1;
             }
-            size_t last            = params.output_path.find_last_of(".");
-            std::string dummy_name = last != std::string::npos ? params.output_path.substr(0, last) : params.output_path;
+            ImageWriter writer(params);
             for (int i = 0; i < params.video_frames; i++) {
-                if (results[i].data == NULL) {
-                    continue;
+                if (results[i].data != NULL) {
+                    writer.add(results[i], i, params.seed + i);
                 }
-                std::string final_image_path = i > 0 ? dummy_name + "_" + std::to_string(i + 1) + ".png" : dummy_name + ".png";
-                stbi_write_png(final_image_path.c_str(), results[i].width, results[i].height, results[i].channel,
-                               results[i].data, 0, get_image_params(params, params.seed + i).c_str());
-                printf("save result image to '%s'\n", final_image_path.c_str());
-                free(results[i].data);
-                results[i].data = NULL;
             }
             free(results);
             free_sd_ctx(sd_ctx);
-            return 0;
+            return writer.finish() ? 0 : 1;
         } else {
             results = img2img(sd_ctx,
                               input_image,
@@ -997,7 +1547,18 @@ int main(int argc, const char* argv[]) {
                               params.skip_layers.size(),
                               params.slg_scale,
                               params.skip_layer_start,
-                              params.skip_layer_end);
+                              params.skip_layer_end,
+                              params.adaptive_rtol,
+                              params.adaptive_atol,
+                              params.cfg_sigma_min,
+                              params.cfg_sigma_max,
+                              params.cfg_every,
+                              params.diffusion_tile_size,
+                              params.diffusion_tile_overlap,
+                              params.diffusion_tile_batch,
+                              params.control_start,
+                              params.control_end,
+                              params.control_share_uncond);
         }
     }
 
@@ -1015,42 +1576,46 @@ int main(int argc, const char* argv[]) {
         if (upscaler_ctx == NULL) {
             printf("new_upscaler_ctx failed\n");
         } else {
+            sd_set_upscaler_tiling(upscaler_ctx, params.upscale_tile_size, params.upscale_tile_batch, (size_t)params.upscale_budget * 1024 * 1024);
+            // the whole batch is upscaled at once, so the tiles of all images share the forwards
+            std::vector<sd_image_t> current_images;
             for (int i = 0; i < params.batch_count; i++) {
-                if (results[i].data == NULL) {
-                    continue;
+                if (results[i].data != NULL) {
+                    current_images.push_back(results[i]);
                 }
-                sd_image_t current_image = results[i];
-                for (int u = 0; u < params.upscale_repeats; ++u) {
-                    sd_image_t upscaled_image = upscale(upscaler_ctx, current_image, upscale_factor);
-                    if (upscaled_image.data == NULL) {
-                        printf("upscale failed\n");
-                        break;
-                    }
-                    free(current_image.data);
-                    current_image = upscaled_image;
+            }
+            for (int u = 0; u < params.upscale_repeats && current_images.size() > 0; ++u) {
+                sd_image_t* upscaled_images = upscale_batch(upscaler_ctx, current_images.data(), (int)current_images.size(), upscale_factor);
+                if (upscaled_images == NULL) {
+                    printf("upscale failed\n");
+                    break;
+                }
+                for (size_t j = 0; j < current_images.size(); j++) {
+                    free(current_images[j].data);
+                    current_images[j] = upscaled_images[j];
+                }
+                free(upscaled_images);
+            }
+            // Set the final upscaled images as the results
+            for (int i = 0, j = 0; i < params.batch_count; i++) {
+                if (results[i].data != NULL) {
+                    results[i] = current_images[j++];
                 }
-                results[i] = current_image;  // Set the final upscaled image as the result
             }
+            free_upscaler_ctx(upscaler_ctx);
         }
     }
 
-    size_t last            = params.output_path.find_last_of(".");
-    std::string dummy_name = last != std::string::npos ? params.output_path.substr(0, last) : params.output_path;
+    ImageWriter writer(params);
     for (int i = 0; i < params.batch_count; i++) {
-        if (results[i].data == NULL) {
-            continue;
+        if (results[i].data != NULL) {
+            writer.add(results[i], i, params.seed + i);
         }
-        std::string final_image_path = i > 0 ? dummy_name + "_" + std::to_string(i + 1) + ".png" : dummy_name + ".png";
-        stbi_write_png(final_image_path.c_str(), results[i].width, results[i].height, results[i].channel,
-                       results[i].data, 0, get_image_params(params, params.seed + i).c_str());
-        printf("save result image to '%s'\n", final_image_path.c_str());
-        free(results[i].data);
-        results[i].data = NULL;
     }
     free(results);
     free_sd_ctx(sd_ctx);
     free(control_image_buffer);
     free(input_image_buffer);
 
-    return 0;
+    return writer.finish() ? 0 : 1;
 }
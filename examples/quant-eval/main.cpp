@@ -0,0 +1,761 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ggml.h"
+#include "model.h"
+#include "stable-diffusion.h"
+
+// Measures, per model component, what each weight type costs in quality, speed and memory:
+// - weights: every weight tensor is quantized to the candidate type and back, the relative
+//   L2 error is reported per layer and summarized per component
+// - images: the component alone is loaded at the candidate type (through tensor type rules,
+//   everything else stays at the reference type) and an image generated on a fixed seed is
+//   compared to the reference one (PSNR/SSIM), along with the load and generation time
+
+struct Component {
+    const char* name;
+    const char* pattern;  // matched against the tensor names, also used as tensor type rule
+};
+
+static const Component components[] = {
+    {"clip", "^(cond_stage_model\\.|text_encoders\\.clip_[lg]\\.)"},
+    {"t5", "^text_encoders\\.t5xxl\\."},
+    {"diffusion", "^model\\.diffusion_model\\."},
+    {"vae", "^first_stage_model\\."},
+};
+
+struct EvalParams {
+    int n_threads = -1;
+    std::string model_path;
+    std::string clip_l_path;
+    std::string clip_g_path;
+    std::string t5xxl_path;
+    std::string diffusion_model_path;
+    std::string vae_path;
+    std::string output_path;
+
+    ggml_type reference_type = GGML_TYPE_F16;
+    std::vector<ggml_type> types;
+    std::vector<std::string> components;
+
+    std::string prompt = "a lovely cat";
+    std::string negative_prompt;
+    float cfg_scale               = 7.0f;
+    float guidance                = 3.5f;
+    int width                     = 512;
+    int height                    = 512;
+    int sample_steps              = 20;
+    int64_t seed                  = 42;
+    sample_method_t sample_method = EULER;
+
+    bool skip_images = false;
+    float min_psnr   = 30.f;
+    int top_layers   = 5;
+    bool verbose     = false;
+};
+
+struct LayerError {
+    std::string name;
+    int64_t nelements;
+    double rel_error;
+};
+
+struct TypeResult {
+    ggml_type type;
+    size_t params_bytes     = 0;
+    double mean_rel_error   = 0;  // weighted by the number of elements
+    double max_rel_error    = 0;
+    std::string worst_layer = "-";
+    std::vector<LayerError> layers;
+
+    bool has_image = false;
+    double psnr    = 0;
+    double ssim    = 0;
+    float load_s   = 0;
+    float gen_s    = 0;
+    bool pareto    = false;
+};
+
+struct ComponentResult {
+    const Component* component;
+    size_t reference_bytes = 0;
+    int n_tensors          = 0;
+    std::vector<TypeResult> types;
+};
+
+/*================================================ weights ================================================*/
+
+static bool type_can_be_evaluated(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_F16:
+        case GGML_TYPE_BF16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q2_K:
+        case GGML_TYPE_Q3_K:
+        case GGML_TYPE_Q4_K:
+        case GGML_TYPE_Q5_K:
+        case GGML_TYPE_Q6_K:
+        case GGML_TYPE_IQ4_NL:
+        case GGML_TYPE_IQ4_XS:
+        case GGML_TYPE_TQ1_0:
+        case GGML_TYPE_TQ2_0:
+            return true;
+        default:
+            // the remaining i-quants need an importance matrix, which this tool does not compute
+            return false;
+    }
+}
+
+static ggml_type parse_type(const std::string& name) {
+    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+        const char* type_name = ggml_type_name((ggml_type)i);
+        if (type_name != NULL && name == type_name) {
+            return (ggml_type)i;
+        }
+    }
+    return GGML_TYPE_COUNT;
+}
+
+// relative L2 error of a round trip through type, rows are split across threads
+static double quantization_error(const float* data, int64_t nrows, int64_t n_per_row, ggml_type type, int n_threads) {
+    n_threads = (int)std::max<int64_t>(1, std::min<int64_t>(n_threads, nrows));
+    std::vector<double> err(n_threads, 0.0);
+    std::vector<double> ref(n_threads, 0.0);
+    auto worker = [&](int ith) {
+        int64_t row_begin = nrows * ith / n_threads;
+        int64_t row_end   = nrows * (ith + 1) / n_threads;
+        size_t row_size   = ggml_row_size(type, n_per_row);
+        std::vector<uint8_t> quantized(row_size * 16);
+        std::vector<float> restored(n_per_row * 16);
+        for (int64_t row = row_begin; row < row_end; row += 16) {
+            int64_t n        = std::min<int64_t>(16, row_end - row);
+            const float* src = data + row * n_per_row;
+            ggml_quantize_chunk(type, src, quantized.data(), 0, n, n_per_row, NULL);
+            ggml_get_type_traits(type)->to_float(quantized.data(), restored.data(), n * n_per_row);
+            for (int64_t i = 0; i < n * n_per_row; i++) {
+                double d = (double)src[i] - (double)restored[i];
+                err[ith] += d * d;
+                ref[ith] += (double)src[i] * src[i];
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int ith = 1; ith < n_threads; ith++) {
+        workers.emplace_back(worker, ith);
+    }
+    worker(0);
+    for (auto& t : workers) {
+        t.join();
+    }
+    double total_err = 0;
+    double total_ref = 0;
+    for (int ith = 0; ith < n_threads; ith++) {
+        total_err += err[ith];
+        total_ref += ref[ith];
+    }
+    return total_ref > 0 ? sqrt(total_err / total_ref) : 0;
+}
+
+static bool init_model_loader(ModelLoader& model_loader, const EvalParams& params) {
+    if (params.model_path.size() > 0 && !model_loader.init_from_file(params.model_path)) {
+        fprintf(stderr, "init model loader from '%s' failed\n", params.model_path.c_str());
+        return false;
+    }
+    const std::pair<std::string, const char*> files[] = {
+        {params.clip_l_path, "text_encoders.clip_l.transformer."},
+        {params.clip_g_path, "text_encoders.clip_g.transformer."},
+        {params.t5xxl_path, "text_encoders.t5xxl.transformer."},
+        {params.diffusion_model_path, "model.diffusion_model."},
+        {params.vae_path, "vae."},
+    };
+    for (auto& file : files) {
+        if (file.first.size() > 0 && !model_loader.init_from_file(file.first, file.second)) {
+            fprintf(stderr, "init model loader from '%s' failed\n", file.first.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// streams the weights once as f32, each tensor is evaluated at every candidate type
+// before the next one is read, so only one tensor is kept in memory
+static bool evaluate_weights(const EvalParams& params, std::vector<ComponentResult>& results) {
+    ModelLoader model_loader;
+    if (!init_model_loader(model_loader, params)) {
+        return false;
+    }
+    std::vector<std::regex> patterns;
+    for (auto& result : results) {
+        patterns.push_back(std::regex(result.component->pattern));
+        for (ggml_type type : params.types) {
+            TypeResult type_result;
+            type_result.type = type;
+            result.types.push_back(type_result);
+        }
+    }
+
+    struct Pending {
+        TensorStorage storage;
+        ComponentResult* result = NULL;
+        ggml_context* ctx       = NULL;
+        ggml_tensor* tensor     = NULL;
+    } pending;
+
+    auto tensor_bytes = [&](const TensorStorage& storage, ggml_type type) -> size_t {
+        if (!model_loader.tensor_should_be_converted(storage, type)) {
+            return (size_t)storage.nbytes();
+        }
+        return ggml_row_size(type, storage.ne[0]) * (storage.nelements() / storage.ne[0]);
+    };
+
+    auto process_pending = [&]() {
+        if (pending.ctx == NULL) {
+            return;
+        }
+        const TensorStorage& storage = pending.storage;
+        ComponentResult* result      = pending.result;
+        int64_t n_per_row            = storage.ne[0];
+        int64_t nrows                = storage.nelements() / n_per_row;
+        result->reference_bytes += tensor_bytes(storage, params.reference_type);
+        result->n_tensors++;
+        for (auto& type_result : result->types) {
+            type_result.params_bytes += tensor_bytes(storage, type_result.type);
+            if (!model_loader.tensor_should_be_converted(storage, type_result.type)) {
+                continue;
+            }
+            double rel_error = quantization_error((const float*)pending.tensor->data, nrows, n_per_row, type_result.type, params.n_threads);
+            type_result.layers.push_back({storage.name, storage.nelements(), rel_error});
+            if (rel_error > type_result.max_rel_error) {
+                type_result.max_rel_error = rel_error;
+                type_result.worst_layer   = storage.name;
+            }
+        }
+        ggml_free(pending.ctx);
+        pending.ctx = NULL;
+    };
+
+    auto on_new_tensor_cb = [&](const TensorStorage& storage, ggml_tensor** dst_tensor) -> bool {
+        process_pending();
+        for (size_t i = 0; i < results.size(); i++) {
+            if (!std::regex_search(storage.name, patterns[i])) {
+                continue;
+            }
+            size_t mem_size = storage.nelements() * sizeof(float) + ggml_tensor_overhead();
+            pending.ctx     = ggml_init({mem_size, NULL, false});
+            if (pending.ctx == NULL) {
+                return false;
+            }
+            pending.storage = storage;
+            pending.result  = &results[i];
+            pending.tensor  = ggml_new_tensor_1d(pending.ctx, GGML_TYPE_F32, storage.nelements());
+            *dst_tensor     = pending.tensor;
+            break;
+        }
+        return true;
+    };
+
+    int64_t t0   = ggml_time_ms();
+    bool success = model_loader.load_tensors(on_new_tensor_cb, NULL);
+    process_pending();
+    int64_t t1 = ggml_time_ms();
+    printf("weights evaluated in %.2fs\n", (t1 - t0) / 1000.f);
+
+    for (auto& result : results) {
+        for (auto& type_result : result.types) {
+            double sum     = 0;
+            int64_t weight = 0;
+            for (auto& layer : type_result.layers) {
+                sum += layer.rel_error * layer.nelements;
+                weight += layer.nelements;
+            }
+            type_result.mean_rel_error = weight > 0 ? sum / weight : 0;
+        }
+    }
+    return success;
+}
+
+/*================================================ images ================================================*/
+
+static double image_psnr(const sd_image_t& a, const sd_image_t& b) {
+    size_t n   = (size_t)a.width * a.height * a.channel;
+    double mse = 0;
+    for (size_t i = 0; i < n; i++) {
+        double d = (double)a.data[i] - (double)b.data[i];
+        mse += d * d;
+    }
+    mse /= n;
+    return mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : 99.0;
+}
+
+// mean SSIM of the luma over 8x8 windows with a stride of 4
+static double image_ssim(const sd_image_t& a, const sd_image_t& b) {
+    const int window = 8;
+    const int stride = 4;
+    const double c1  = (0.01 * 255) * (0.01 * 255);
+    const double c2  = (0.03 * 255) * (0.03 * 255);
+    int w            = (int)a.width;
+    int h            = (int)a.height;
+    auto luma        = [&](const sd_image_t& img, int x, int y) {
+        const uint8_t* p = img.data + ((size_t)y * w + x) * img.channel;
+        return img.channel >= 3 ? 0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2] : (double)p[0];
+    };
+    double sum = 0;
+    int count  = 0;
+    for (int y0 = 0; y0 + window <= h; y0 += stride) {
+        for (int x0 = 0; x0 + window <= w; x0 += stride) {
+            double ma = 0, mb = 0, va = 0, vb = 0, cov = 0;
+            for (int y = y0; y < y0 + window; y++) {
+                for (int x = x0; x < x0 + window; x++) {
+                    ma += luma(a, x, y);
+                    mb += luma(b, x, y);
+                }
+            }
+            ma /= window * window;
+            mb /= window * window;
+            for (int y = y0; y < y0 + window; y++) {
+                for (int x = x0; x < x0 + window; x++) {
+                    double da = luma(a, x, y) - ma;
+                    double db = luma(b, x, y) - mb;
+                    va += da * da;
+                    vb += db * db;
+                    cov += da * db;
+                }
+            }
+            va /= window * window - 1;
+            vb /= window * window - 1;
+            cov /= window * window - 1;
+            sum += ((2 * ma * mb + c1) * (2 * cov + c2)) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            count++;
+        }
+    }
+    return count > 0 ? sum / count : 1.0;
+}
+
+// loads the model with rules applied on top of the reference type and generates one image,
+// returns false when loading or generating failed
+static bool generate(const EvalParams& params, const std::string& rules, sd_image_t& image, float& load_s, float& gen_s) {
+    int64_t t0       = ggml_time_ms();
+    sd_ctx_t* sd_ctx = new_sd_ctx(params.model_path.c_str(),
+                                  params.clip_l_path.c_str(),
+                                  params.clip_g_path.c_str(),
+                                  params.t5xxl_path.c_str(),
+                                  params.diffusion_model_path.c_str(),
+                                  params.vae_path.c_str(),
+                                  "",
+                                  "",
+                                  "",
+                                  "",
+                                  "",
+                                  true,
+                                  false,
+                                  false,
+                                  params.n_threads,
+                                  (sd_type_t)params.reference_type,
+                                  CUDA_RNG,
+                                  DEFAULT,
+                                  false,
+                                  false,
+                                  false,
+                                  false,
+                                  rules.c_str(),
+                                  "");
+    if (sd_ctx == NULL) {
+        return false;
+    }
+    int64_t t1 = ggml_time_ms();
+
+    sd_image_t* results = txt2img(sd_ctx,
+                                  params.prompt.c_str(),
+                                  params.negative_prompt.c_str(),
+                                  -1,
+                                  params.cfg_scale,
+                                  params.guidance,
+                                  params.width,
+                                  params.height,
+                                  params.sample_method,
+                                  params.sample_steps,
+                                  params.seed,
+                                  1,
+                                  NULL,
+                                  0.9f,
+                                  20.f,
+                                  false,
+                                  "",
+                                  NULL,
+                                  0,
+                                  0.f,
+                                  0.01f,
+                                  0.2f,
+                                  0.05f,
+                                  0.0078f,
+                                  0.f,
+                                  INFINITY,
+                                  1,
+                                  0,
+                                  0,
+                                  0,
+                                  0.5f,
+                                  HIRES_LATENT_BILINEAR,
+                                  0,
+                                  0.25f,
+                                  1,
+                                  0.f,
+                                  1.f,
+                                  false);
+    int64_t t2 = ggml_time_ms();
+    free_sd_ctx(sd_ctx);
+    if (results == NULL || results[0].data == NULL) {
+        free(results);
+        return false;
+    }
+    image  = results[0];
+    load_s = (t1 - t0) / 1000.f;
+    gen_s  = (t2 - t1) / 1000.f;
+    free(results);
+    return true;
+}
+
+static void evaluate_images(const EvalParams& params, std::vector<ComponentResult>& results) {
+    sd_image_t reference;
+    float load_s, gen_s;
+    printf("generating the reference image (%s)\n", ggml_type_name(params.reference_type));
+    if (!generate(params, "", reference, load_s, gen_s)) {
+        fprintf(stderr, "generate the reference image failed, skipping the image metrics\n");
+        return;
+    }
+    printf("reference: load %.2fs, generate %.2fs\n", load_s, gen_s);
+
+    for (auto& result : results) {
+        for (auto& type_result : result.types) {
+            std::string rules = std::string(result.component->pattern) + "=" + ggml_type_name(type_result.type);
+            printf("generating with %s at %s\n", result.component->name, ggml_type_name(type_result.type));
+            sd_image_t image;
+            if (!generate(params, rules, image, type_result.load_s, type_result.gen_s)) {
+                fprintf(stderr, "generate with %s at %s failed\n", result.component->name, ggml_type_name(type_result.type));
+                continue;
+            }
+            type_result.has_image = true;
+            type_result.psnr      = image_psnr(reference, image);
+            type_result.ssim      = image_ssim(reference, image);
+            free(image.data);
+        }
+    }
+    free(reference.data);
+}
+
+/*================================================ report ================================================*/
+
+// a type is on the front when no other type is at least as small, as fast and as accurate
+// while being strictly better in one of them
+static void mark_pareto(ComponentResult& result) {
+    auto quality = [](const TypeResult& r) {
+        return r.has_image ? r.psnr : -r.mean_rel_error;
+    };
+    for (auto& a : result.types) {
+        a.pareto = true;
+        for (auto& b : result.types) {
+            if (&a == &b || a.has_image != b.has_image) {
+                continue;
+            }
+            bool no_worse = b.params_bytes <= a.params_bytes && quality(b) >= quality(a) && (!a.has_image || b.gen_s <= a.gen_s);
+            bool better   = b.params_bytes < a.params_bytes || quality(b) > quality(a) || (a.has_image && b.gen_s < a.gen_s);
+            if (no_worse && better) {
+                a.pareto = false;
+                break;
+            }
+        }
+    }
+}
+
+static void print_report(const EvalParams& params, std::vector<ComponentResult>& results) {
+    for (auto& result : results) {
+        if (result.n_tensors == 0) {
+            continue;
+        }
+        mark_pareto(result);
+        printf("\n%s: %d tensors, %.2fMB at %s\n",
+               result.component->name, result.n_tensors, result.reference_bytes / 1024.0 / 1024.0, ggml_type_name(params.reference_type));
+        printf("  %-8s %10s %7s %12s %12s %8s %7s %8s %8s  %s\n",
+               "type", "params MB", "ratio", "mean relerr", "max relerr", "PSNR", "SSIM", "load s", "gen s", "pareto");
+        const TypeResult* recommended = NULL;
+        for (auto& r : result.types) {
+            printf("  %-8s %10.2f %7.3f %12.6f %12.6f ",
+                   ggml_type_name(r.type), r.params_bytes / 1024.0 / 1024.0,
+                   result.reference_bytes > 0 ? (double)r.params_bytes / result.reference_bytes : 0.0,
+                   r.mean_rel_error, r.max_rel_error);
+            if (r.has_image) {
+                printf("%8.2f %7.4f %8.2f %8.2f", r.psnr, r.ssim, r.load_s, r.gen_s);
+            } else {
+                printf("%8s %7s %8s %8s", "-", "-", "-", "-");
+            }
+            printf("  %s\n", r.pareto ? "*" : "");
+            if (r.has_image && r.psnr >= params.min_psnr && (recommended == NULL || r.gen_s < recommended->gen_s ||
+                                                             (r.gen_s == recommended->gen_s && r.params_bytes < recommended->params_bytes))) {
+                recommended = &r;
+            }
+        }
+        for (auto& r : result.types) {
+            if (params.top_layers <= 0 || r.layers.empty()) {
+                continue;
+            }
+            std::vector<LayerError> layers = r.layers;
+            std::sort(layers.begin(), layers.end(), [](const LayerError& a, const LayerError& b) {
+                return a.rel_error > b.rel_error;
+            });
+            printf("  worst layers at %s:\n", ggml_type_name(r.type));
+            for (int i = 0; i < params.top_layers && i < (int)layers.size(); i++) {
+                printf("    %.6f  %s\n", layers[i].rel_error, layers[i].name.c_str());
+            }
+        }
+        if (recommended != NULL) {
+            printf("  fastest type with PSNR >= %.1f: %s\n", params.min_psnr, ggml_type_name(recommended->type));
+        }
+    }
+}
+
+static bool write_csv(const std::string& path, const std::vector<ComponentResult>& results) {
+    std::ofstream file(path);
+    std::ofstream layers_file(path + ".layers.csv");
+    if (!file.is_open() || !layers_file.is_open()) {
+        fprintf(stderr, "open '%s' failed\n", path.c_str());
+        return false;
+    }
+    file << "component,type,params_bytes,reference_bytes,mean_rel_error,max_rel_error,worst_layer,psnr,ssim,load_s,gen_s,pareto\n";
+    layers_file << "component,type,layer,nelements,rel_error\n";
+    for (auto& result : results) {
+        if (result.n_tensors == 0) {
+            continue;
+        }
+        for (auto& r : result.types) {
+            file << result.component->name << "," << ggml_type_name(r.type) << "," << r.params_bytes << ","
+                 << result.reference_bytes << "," << r.mean_rel_error << "," << r.max_rel_error << ","
+                 << r.worst_layer << ",";
+            if (r.has_image) {
+                file << r.psnr << "," << r.ssim << "," << r.load_s << "," << r.gen_s;
+            } else {
+                file << ",,,";
+            }
+            file << "," << (r.pareto ? 1 : 0) << "\n";
+            for (auto& layer : r.layers) {
+                layers_file << result.component->name << "," << ggml_type_name(r.type) << "," << layer.name << ","
+                            << layer.nelements << "," << layer.rel_error << "\n";
+            }
+        }
+    }
+    printf("\nreport written to '%s' and '%s.layers.csv'\n", path.c_str(), path.c_str());
+    return true;
+}
+
+/*================================================ main ================================================*/
+
+void print_usage(int argc, const char* argv[]) {
+    printf("usage: %s [arguments]\n", argv[0]);
+    printf("\n");
+    printf("arguments:\n");
+    printf("  -h, --help                         show this help message and exit\n");
+    printf("  -t, --threads N                    number of threads to use (default: number of physical cores)\n");
+    printf("  -m, --model [MODEL]                path to full model\n");
+    printf("  --diffusion-model                  path to the standalone diffusion model\n");
+    printf("  --clip_l                           path to the clip-l text encoder\n");
+    printf("  --clip_g                           path to the clip-g text encoder\n");
+    printf("  --t5xxl                            path to the the t5xxl text encoder\n");
+    printf("  --vae [VAE]                        path to vae\n");
+    printf("  --reference {f32, f16}             type the candidates are compared to (default: f16)\n");
+    printf("  --types [TYPES]                    candidate types, comma separated (default: q8_0,q6_K,q5_0,q5_K,q4_0,q4_K,q3_K)\n");
+    printf("  --components [NAMES]               clip,t5,diffusion,vae, comma separated (default: all present in the model)\n");
+    printf("  -p, --prompt [PROMPT]              the prompt of the evaluated images (default: \"a lovely cat\")\n");
+    printf("  -n, --negative-prompt PROMPT       the negative prompt (default: \"\")\n");
+    printf("  --cfg-scale SCALE                  unconditional guidance scale (default: 7.0)\n");
+    printf("  --guidance SCALE                   guidance scale (default: 3.5)\n");
+    printf("  --sampling-method {euler, euler_a} sampling method of the evaluated images (default: euler)\n");
+    printf("  --steps STEPS                      number of sample steps (default: 20)\n");
+    printf("  -H, --height H                     image height, in pixel space (default: 512)\n");
+    printf("  -W, --width W                      image width, in pixel space (default: 512)\n");
+    printf("  -s SEED, --seed SEED               RNG seed (default: 42)\n");
+    printf("  --skip-images                      only evaluate the weights, no image is generated\n");
+    printf("  --min-psnr PSNR                    quality bar of the recommended type (default: 30)\n");
+    printf("  --layers N                         worst layers printed per type (default: 5)\n");
+    printf("  -o, --output REPORT                write the summary to REPORT and the per layer errors to REPORT.layers.csv\n");
+    printf("  -v, --verbose                      print extra info\n");
+}
+
+void parse_args(int argc, const char** argv, EvalParams& params) {
+    bool invalid_arg = false;
+    std::string arg;
+    std::string types_arg = "q8_0,q6_K,q5_0,q5_K,q4_0,q4_K,q3_K";
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        auto next = [&]() -> const char* {
+            if (++i >= argc) {
+                invalid_arg = true;
+                return "";
+            }
+            return argv[i];
+        };
+
+        if (arg == "-t" || arg == "--threads") {
+            params.n_threads = std::stoi(next());
+        } else if (arg == "-m" || arg == "--model") {
+            params.model_path = next();
+        } else if (arg == "--diffusion-model") {
+            params.diffusion_model_path = next();
+        } else if (arg == "--clip_l") {
+            params.clip_l_path = next();
+        } else if (arg == "--clip_g") {
+            params.clip_g_path = next();
+        } else if (arg == "--t5xxl") {
+            params.t5xxl_path = next();
+        } else if (arg == "--vae") {
+            params.vae_path = next();
+        } else if (arg == "--reference") {
+            params.reference_type = parse_type(next());
+            if (params.reference_type != GGML_TYPE_F32 && params.reference_type != GGML_TYPE_F16) {
+                fprintf(stderr, "error: the reference type must be f32 or f16\n");
+                exit(1);
+            }
+        } else if (arg == "--types") {
+            types_arg = next();
+        } else if (arg == "--components") {
+            std::stringstream ss(next());
+            std::string name;
+            while (std::getline(ss, name, ',')) {
+                params.components.push_back(name);
+            }
+        } else if (arg == "-p" || arg == "--prompt") {
+            params.prompt = next();
+        } else if (arg == "-n" || arg == "--negative-prompt") {
+            params.negative_prompt = next();
+        } else if (arg == "--cfg-scale") {
+            params.cfg_scale = std::stof(next());
+        } else if (arg == "--guidance") {
+            params.guidance = std::stof(next());
+        } else if (arg == "--sampling-method") {
+            std::string method = next();
+            if (method == "euler") {
+                params.sample_method = EULER;
+            } else if (method == "euler_a") {
+                params.sample_method = EULER_A;
+            } else {
+                invalid_arg = true;
+            }
+        } else if (arg == "--steps") {
+            params.sample_steps = std::stoi(next());
+        } else if (arg == "-H" || arg == "--height") {
+            params.height = std::stoi(next());
+        } else if (arg == "-W" || arg == "--width") {
+            params.width = std::stoi(next());
+        } else if (arg == "-s" || arg == "--seed") {
+            params.seed = std::stoll(next());
+        } else if (arg == "--skip-images") {
+            params.skip_images = true;
+        } else if (arg == "--min-psnr") {
+            params.min_psnr = std::stof(next());
+        } else if (arg == "--layers") {
+            params.top_layers = std::stoi(next());
+        } else if (arg == "-o" || arg == "--output") {
+            params.output_path = next();
+        } else if (arg == "-v" || arg == "--verbose") {
+            params.verbose = true;
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argc, argv);
+            exit(1);
+        }
+        if (invalid_arg) {
+            break;
+        }
+    }
+    if (invalid_arg) {
+        fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+        print_usage(argc, argv);
+        exit(1);
+    }
+    if (params.model_path.length() == 0 && params.diffusion_model_path.length() == 0) {
+        fprintf(stderr, "error: the following arguments are required: model_path/diffusion_model\n");
+        print_usage(argc, argv);
+        exit(1);
+    }
+
+    std::stringstream ss(types_arg);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        ggml_type type = parse_type(name);
+        if (type == GGML_TYPE_COUNT || !type_can_be_evaluated(type)) {
+            fprintf(stderr, "error: type '%s' can not be evaluated\n", name.c_str());
+            exit(1);
+        }
+        params.types.push_back(type);
+    }
+    if (params.n_threads <= 0) {
+        params.n_threads = get_num_physical_cores();
+    }
+}
+
+void sd_log_cb(enum sd_log_level_t level, const char* log, void* data) {
+    EvalParams* params = (EvalParams*)data;
+    if (!log || (!params->verbose && level <= SD_LOG_INFO)) {
+        return;
+    }
+    fputs(log, level == SD_LOG_ERROR ? stderr : stdout);
+}
+
+int main(int argc, const char* argv[]) {
+    EvalParams params;
+    parse_args(argc, argv, params);
+
+    ggml_time_init();
+
+    sd_set_log_callback(sd_log_cb, (void*)&params);
+
+    std::vector<ComponentResult> results;
+    for (const Component& component : components) {
+        bool selected = params.components.empty() ||
+                        std::find(params.components.begin(), params.components.end(), component.name) != params.components.end();
+        if (selected) {
+            ComponentResult result;
+            result.component = &component;
+            results.push_back(result);
+        }
+    }
+    if (results.empty()) {
+        fprintf(stderr, "error: no known component selected\n");
+        return 1;
+    }
+
+    if (!evaluate_weights(params, results)) {
+        fprintf(stderr, "evaluate the weights failed\n");
+        return 1;
+    }
+    // components missing from the model files are dropped
+    results.erase(std::remove_if(results.begin(), results.end(), [](const ComponentResult& r) {
+                      return r.n_tensors == 0;
+                  }),
+                  results.end());
+
+    if (!params.skip_images) {
+        evaluate_images(params, results);
+    }
+
+    print_report(params, results);
+    if (params.output_path.size() > 0 && !write_csv(params.output_path, results)) {
+        return 1;
+    }
+    return 0;
+}
@@ -5,13 +5,17 @@
 #include <inttypes.h>
 #include <stdarg.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <regex>
 #include <set>
@@ -60,7 +64,11 @@ __STATIC_INLINE__ void ggml_log_callback_default(ggml_log_level level, const cha
 }
 
 __STATIC_INLINE__ void ggml_tensor_set_f32_randn(struct ggml_tensor* tensor, std::shared_ptr<RNG> rng) {
-    uint32_t n                        = (uint32_t)ggml_nelements(tensor);
+    uint32_t n = (uint32_t)ggml_nelements(tensor);
+    if (tensor->type == GGML_TYPE_F32 && ggml_is_contiguous(tensor)) {
+        rng->randn((float*)tensor->data, n);
+        return;
+    }
     std::vector<float> random_numbers = rng->randn(n);
     for (uint32_t i = 0; i < n; i++) {
         ggml_set_f32_1d(tensor, i, random_numbers[i]);
@@ -490,10 +498,75 @@ __STATIC_INLINE__ void ggml_tensor_scale_output(struct ggml_tensor* src) {
     }
 }
 
+// resizes input [N, C, H, W] to the spatial size of output, bilinear or bicubic (a = -0.75, half pixel centers)
+__STATIC_INLINE__ void ggml_tensor_resize_2d(struct ggml_tensor* input, struct ggml_tensor* output, bool bicubic = false) {
+    GGML_ASSERT(input->type == GGML_TYPE_F32 && output->type == GGML_TYPE_F32);
+    GGML_ASSERT(input->ne[2] == output->ne[2] && input->ne[3] == output->ne[3]);
+    int64_t in_w  = input->ne[0];
+    int64_t in_h  = input->ne[1];
+    int64_t out_w = output->ne[0];
+    int64_t out_h = output->ne[1];
+    float scale_x = (float)in_w / out_w;
+    float scale_y = (float)in_h / out_h;
+    int taps      = bicubic ? 4 : 2;
+
+    auto weight = [&](float d) -> float {
+        d = std::fabs(d);
+        if (!bicubic) {
+            return std::max(0.f, 1.f - d);
+        }
+        const float a = -0.75f;
+        if (d <= 1.f) {
+            return ((a + 2.f) * d - (a + 3.f)) * d * d + 1.f;
+        } else if (d < 2.f) {
+            return ((a * d - 5.f * a) * d + 8.f * a) * d - 4.f * a;
+        }
+        return 0.f;
+    };
+
+    // source indices and weights per output column/row
+    auto prepare = [&](int64_t out_size, int64_t in_size, float scale, std::vector<int64_t>& idx, std::vector<float>& w) {
+        idx.resize(out_size * taps);
+        w.resize(out_size * taps);
+        for (int64_t o = 0; o < out_size; o++) {
+            float s       = (o + 0.5f) * scale - 0.5f;
+            int64_t start = (int64_t)std::floor(s) - (bicubic ? 1 : 0);
+            for (int t = 0; t < taps; t++) {
+                int64_t i          = start + t;
+                idx[o * taps + t] = std::min(std::max(i, (int64_t)0), in_size - 1);
+                w[o * taps + t]   = weight(s - i);
+            }
+        }
+    };
+    std::vector<int64_t> idx_x, idx_y;
+    std::vector<float> w_x, w_y;
+    prepare(out_w, in_w, scale_x, idx_x, w_x);
+    prepare(out_h, in_h, scale_y, idx_y, w_y);
+
+    for (int64_t n = 0; n < output->ne[3]; n++) {
+        for (int64_t c = 0; c < output->ne[2]; c++) {
+            for (int64_t y = 0; y < out_h; y++) {
+                for (int64_t x = 0; x < out_w; x++) {
+                    float value = 0.f;
+                    for (int ty = 0; ty < taps; ty++) {
+                        float row = 0.f;
+                        for (int tx = 0; tx < taps; tx++) {
+                            row += w_x[x * taps + tx] * ggml_tensor_get_f32(input, (int)idx_x[x * taps + tx], (int)idx_y[y * taps + ty], (int)c, (int)n);
+                        }
+                        value += w_y[y * taps + ty] * row;
+                    }
+                    ggml_tensor_set_f32(output, value, (int)x, (int)y, (int)c, (int)n);
+                }
+            }
+        }
+    }
+}
+
 typedef std::function<void(ggml_tensor*, ggml_tensor*, bool)> on_tile_process;
 
 // Tiling
-__STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const int scale, const int tile_size, const float tile_overlap_factor, on_tile_process on_processing) {
+// scale may be fractional (e.g. 1/8 for vae encode), tile_size * scale and the tile offsets must map to whole output pixels
+__STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const float scale, const int tile_size, const float tile_overlap_factor, on_tile_process on_processing) {
     int input_width   = (int)input->ne[0];
     int input_height  = (int)input->ne[1];
     int output_width  = (int)output->ne[0];
@@ -502,10 +575,11 @@ __STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const
 
     int tile_overlap     = (int32_t)(tile_size * tile_overlap_factor);
     int non_tile_overlap = tile_size - tile_overlap;
+    int out_tile_size    = (int)(tile_size * scale);
 
     struct ggml_init_params params = {};
-    params.mem_size += tile_size * tile_size * input->ne[2] * sizeof(float);                       // input chunk
-    params.mem_size += (tile_size * scale) * (tile_size * scale) * output->ne[2] * sizeof(float);  // output chunk
+    params.mem_size += tile_size * tile_size * input->ne[2] * sizeof(float);           // input chunk
+    params.mem_size += out_tile_size * out_tile_size * output->ne[2] * sizeof(float);  // output chunk
     params.mem_size += 3 * ggml_tensor_overhead();
     params.mem_buffer = NULL;
     params.no_alloc   = false;
@@ -521,7 +595,7 @@ __STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const
 
     // tiling
     ggml_tensor* input_tile  = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_size, tile_size, input->ne[2], 1);
-    ggml_tensor* output_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_size * scale, tile_size * scale, output->ne[2], 1);
+    ggml_tensor* output_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, out_tile_size, out_tile_size, output->ne[2], 1);
     on_processing(input_tile, NULL, true);
     int num_tiles = ceil((float)input_width / non_tile_overlap) * ceil((float)input_height / non_tile_overlap);
     LOG_INFO("processing %i tiles", num_tiles);
@@ -542,7 +616,7 @@ __STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const
             int64_t t1 = ggml_time_ms();
             ggml_split_tensor_2d(input, input_tile, x, y);
             on_processing(input_tile, output_tile, false);
-            ggml_merge_tensor_2d(output_tile, output, x * scale, y * scale, tile_overlap * scale);
+            ggml_merge_tensor_2d(output_tile, output, (int)(x * scale), (int)(y * scale), (int)(tile_overlap * scale));
             int64_t t2 = ggml_time_ms();
             last_time  = (t2 - t1) / 1000.0f;
             pretty_progress(tile_count, num_tiles, last_time);
@@ -687,6 +761,48 @@ __STATIC_INLINE__ struct ggml_tensor* ggml_nn_attention(struct ggml_context* ctx
     return kqv;
 }
 
+// same as ggml_nn_attention without mask, but the queries are processed in chunks of
+// chunk_size rows, so only the [chunk_size, n_k] scores of one chunk are alive at once
+// q: [N, n_token, d_head]
+// k: [N, n_k, d_head]
+// v: [N, d_head, n_k]
+// return: [N, n_token, d_head]
+__STATIC_INLINE__ struct ggml_tensor* ggml_nn_attention_chunked(struct ggml_context* ctx,
+                                                                struct ggml_tensor* q,
+                                                                struct ggml_tensor* k,
+                                                                struct ggml_tensor* v,
+                                                                int64_t chunk_size) {
+    int64_t L_q = q->ne[1];
+    if (chunk_size <= 0 || chunk_size >= L_q) {
+        return ggml_nn_attention(ctx, q, k, v, false);
+    }
+    // bounds the graph size, every chunk adds a few nodes
+    chunk_size = std::max(chunk_size, (L_q + 255) / 256);
+    float scale = 1.0f / sqrt((float)q->ne[0]);
+
+    std::vector<struct ggml_tensor*> chunks;
+    for (int64_t i = 0; i < L_q; i += chunk_size) {
+        int64_t len = std::min(chunk_size, L_q - i);
+        auto q_i    = ggml_view_3d(ctx, q, q->ne[0], len, q->ne[2], q->nb[1], q->nb[2], q->nb[1] * i);
+        auto kq     = ggml_mul_mat(ctx, k, q_i);  // [N, len, n_k]
+        kq          = ggml_scale_inplace(ctx, kq, scale);
+        kq          = ggml_soft_max_inplace(ctx, kq);
+        chunks.push_back(ggml_mul_mat(ctx, v, kq));  // [N, len, d_head]
+    }
+    // pairwise concat, each row is copied log2(n_chunks) times instead of n_chunks times
+    while (chunks.size() > 1) {
+        std::vector<struct ggml_tensor*> merged;
+        for (size_t i = 0; i + 1 < chunks.size(); i += 2) {
+            merged.push_back(ggml_concat(ctx, chunks[i], chunks[i + 1], 1));
+        }
+        if (chunks.size() % 2 == 1) {
+            merged.push_back(chunks.back());
+        }
+        chunks = merged;
+    }
+    return chunks[0];
+}
+
 // q: [N, L_q, C] or [N*n_head, L_q, d_head]
 // k: [N, L_k, C] or [N*n_head, L_k, d_head]
 // v: [N, L_k, C] or [N, L_k, n_head, d_head]
@@ -963,6 +1079,7 @@ protected:
 
     struct ggml_context* compute_ctx    = NULL;
     struct ggml_gallocr* compute_allocr = NULL;
+    size_t compute_graph_size           = MAX_GRAPH_SIZE;  // raised by runners whose graphs grow with the input
 
     std::map<struct ggml_tensor*, const void*> backend_tensor_data_map;
 
@@ -987,7 +1104,7 @@ protected:
 
     void alloc_compute_ctx() {
         struct ggml_init_params params;
-        params.mem_size   = static_cast<size_t>(ggml_tensor_overhead() * MAX_GRAPH_SIZE + ggml_graph_overhead());
+        params.mem_size   = static_cast<size_t>(ggml_tensor_overhead() * compute_graph_size + ggml_graph_overhead_custom(compute_graph_size, false));
         params.mem_buffer = NULL;
         params.no_alloc   = true;
 
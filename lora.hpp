@@ -76,6 +76,39 @@ struct LoraModel : public GGMLRunner {
         return out;
     }
 
+    // "model.diffusion_model.x.weight" -> "model_diffusion_model_x", empty for non weights
+    std::string get_lora_key(const std::string& model_tensor_name) {
+        size_t k_pos = model_tensor_name.find(".weight");
+        if (k_pos == std::string::npos) {
+            return "";
+        }
+        std::string k_tensor = model_tensor_name.substr(0, k_pos);
+        replace_all_chars(k_tensor, '.', '_');
+        if (lora_tensors.find("lora." + k_tensor + ".lora_up.weight") == lora_tensors.end()) {
+            if (k_tensor == "model_diffusion_model_output_blocks_2_2_conv") {
+                // fix for some sdxl lora, like lcm-lora-xl
+                k_tensor = "model_diffusion_model_output_blocks_2_1_conv";
+            }
+        }
+        return k_tensor;
+    }
+
+    // names of the model tensors apply() would modify
+    std::set<std::string> get_target_tensors(const std::map<std::string, struct ggml_tensor*>& model_tensors) {
+        std::set<std::string> targets;
+        for (auto& pair : model_tensors) {
+            std::string k_tensor = get_lora_key(pair.first);
+            if (k_tensor.empty()) {
+                continue;
+            }
+            if (lora_tensors.find("lora." + k_tensor + ".lora_up.weight") != lora_tensors.end() &&
+                lora_tensors.find("lora." + k_tensor + ".lora_down.weight") != lora_tensors.end()) {
+                targets.insert(pair.first);
+            }
+        }
+        return targets;
+    }
+
     struct ggml_cgraph* build_lora_graph(std::map<std::string, struct ggml_tensor*> model_tensors) {
         struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, LORA_GRAPH_SIZE, false);
 
@@ -85,25 +118,13 @@ struct LoraModel : public GGMLRunner {
 
         std::set<std::string> applied_lora_tensors;
         for (auto it : model_tensors) {
-            std::string k_tensor       = it.first;
+            std::string k_tensor       = get_lora_key(it.first);
             struct ggml_tensor* weight = model_tensors[it.first];
-
-            size_t k_pos = k_tensor.find(".weight");
-            if (k_pos == std::string::npos) {
+            if (k_tensor.empty()) {
                 continue;
             }
-            k_tensor = k_tensor.substr(0, k_pos);
-            replace_all_chars(k_tensor, '.', '_');
             // LOG_DEBUG("k_tensor %s", k_tensor.c_str());
-            std::string lora_up_name = "lora." + k_tensor + ".lora_up.weight";
-            if (lora_tensors.find(lora_up_name) == lora_tensors.end()) {
-                if (k_tensor == "model_diffusion_model_output_blocks_2_2_conv") {
-                    // fix for some sdxl lora, like lcm-lora-xl
-                    k_tensor     = "model_diffusion_model_output_blocks_2_1_conv";
-                    lora_up_name = "lora." + k_tensor + ".lora_up.weight";
-                }
-            }
-
+            std::string lora_up_name   = "lora." + k_tensor + ".lora_up.weight";
             std::string lora_down_name = "lora." + k_tensor + ".lora_down.weight";
             std::string alpha_name     = "lora." + k_tensor + ".alpha";
             std::string scale_name     = "lora." + k_tensor + ".scale";
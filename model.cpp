@@ -1,8 +1,11 @@
 #include <stdarg.h>
 #include <fstream>
 #include <regex>
+#include <future>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -1580,18 +1583,145 @@ ggml_type ModelLoader::get_vae_wtype() {
 }
 
 void ModelLoader::set_wtype_override(ggml_type wtype, std::string prefix) {
+    std::unordered_map<std::string, const TensorStorage*> name_to_tensor_storage;
+    for (auto& tensor_storage : tensor_storages) {
+        name_to_tensor_storage[tensor_storage.name] = &tensor_storage;
+    }
     for (auto& pair : tensor_storages_types) {
         if (prefix.size() < 1 || pair.first.substr(0, prefix.size()) == prefix) {
-            for (auto& tensor_storage : tensor_storages) {
-                if (tensor_storage.name == pair.first) {
-                    if (tensor_should_be_converted(tensor_storage, wtype)) {
-                        pair.second = wtype;
-                    }
+            auto it = name_to_tensor_storage.find(pair.first);
+            if (it == name_to_tensor_storage.end()) {
+                continue;
+            }
+            ggml_type tensor_type = get_tensor_wtype(*it->second, wtype);
+            if (tensor_type != it->second->type) {
+                pair.second = tensor_type;
+            }
+        }
+    }
+}
+
+// an inline recipe is split on ';', or on a ',' that ends a complete "pattern=type"
+// (the type is a plain name), so regex quantifiers like \d{1,2} stay in their pattern
+static std::vector<std::string> split_inline_type_rules(const std::string& recipe) {
+    std::vector<std::string> items;
+    std::string item;
+    for (char c : recipe) {
+        if (c == ';') {
+            items.push_back(item);
+            item.clear();
+            continue;
+        }
+        if (c == ',') {
+            size_t pos            = item.rfind('=');
+            std::string type_name = pos == std::string::npos ? "" : trim(item.substr(pos + 1));
+            bool is_type_name     = type_name.size() > 0;
+            for (char t : type_name) {
+                is_type_name = is_type_name && (isalnum((unsigned char)t) || t == '_');
+            }
+            if (is_type_name) {
+                items.push_back(item);
+                item.clear();
+                continue;
+            }
+        }
+        item += c;
+    }
+    items.push_back(item);
+    return items;
+}
+
+bool ModelLoader::set_tensor_type_rules(const std::string& rules) {
+    tensor_type_rules.clear();
+    tensor_type_recipe.clear();
+    if (rules.size() == 0) {
+        return true;
+    }
+
+    // either the recipe itself or a file containing it, one rule per line
+    std::vector<std::string> items;
+    if (file_exists(rules)) {
+        std::ifstream file(rules);
+        std::string line;
+        while (std::getline(file, line)) {
+            items.push_back(line);
+        }
+    } else {
+        items = split_inline_type_rules(rules);
+    }
+
+    // rules are tried in order, the first matching pattern wins
+    for (std::string item : items) {
+        item = trim(item);
+        if (item.size() == 0 || item[0] == '#') {
+            continue;
+        }
+        size_t pos = item.rfind('=');
+        if (pos == std::string::npos || trim(item.substr(0, pos)).size() == 0) {
+            LOG_ERROR("invalid tensor type rule '%s', expected 'pattern=type'", item.c_str());
+            return false;
+        }
+        TensorTypeRule rule;
+        rule.pattern          = trim(item.substr(0, pos));
+        std::string type_name = trim(item.substr(pos + 1));
+        if (type_name != "keep") {
+            for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+                auto trait = ggml_get_type_traits((ggml_type)i);
+                // the i-quants needing an imatrix are only usable with real importance data,
+                // convert_tensor only has the uniform dummy one and would produce poor weights
+                if (type_name == trait->type_name && (i == GGML_TYPE_F32 || (trait->to_float && trait->type_size && !ggml_quantize_requires_imatrix((ggml_type)i)))) {
+                    rule.type = (ggml_type)i;
                     break;
                 }
             }
+            if (rule.type == GGML_TYPE_COUNT) {
+                LOG_ERROR("invalid type '%s' in tensor type rule '%s'", type_name.c_str(), item.c_str());
+                return false;
+            }
+        }
+        try {
+            rule.regex = std::regex(rule.pattern);
+        } catch (const std::regex_error& e) {
+            LOG_ERROR("invalid pattern in tensor type rule '%s': %s", item.c_str(), e.what());
+            return false;
+        }
+        LOG_DEBUG("tensor type rule: '%s' => %s", rule.pattern.c_str(), type_name.c_str());
+        tensor_type_rules.push_back(rule);
+        tensor_type_recipe += rule.pattern + "=" + type_name + "\n";
+    }
+    return true;
+}
+
+std::string ModelLoader::get_tensor_type_recipe() {
+    return tensor_type_recipe;
+}
+
+ggml_type ModelLoader::get_tensor_wtype(const TensorStorage& tensor_storage, ggml_type wtype) {
+    const std::string& name = tensor_storage.name;
+    if (ends_with(name, ".bias") || ends_with(name, ".scale")) {
+        return tensor_storage.type;
+    }
+
+    for (auto& rule : tensor_type_rules) {
+        if (!std::regex_search(name, rule.regex)) {
+            continue;
         }
+        ggml_type type = rule.type;
+        if (type == GGML_TYPE_COUNT) {
+            return tensor_storage.type;
+        }
+        if (ggml_is_quantized(type) && tensor_storage.ne[0] % ggml_blck_size(type) != 0) {
+            LOG_DEBUG("tensor '%s' can not be converted to %s, keep %s",
+                      name.c_str(), ggml_type_name(type), ggml_type_name(tensor_storage.type));
+            return tensor_storage.type;
+        }
+        return type;
     }
+
+    if (tensor_should_be_converted(tensor_storage, wtype)) {
+        return wtype;
+    }
+    return tensor_storage.type;
 }
 
 std::string ModelLoader::load_merges() {
@@ -1661,30 +1791,102 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
             }
         }
 
-        struct zip_t* zip = NULL;
+        // zip entries are read once, a few entries ahead on worker threads, and kept
+        // until the last tensor sharing the entry (e.g. fused qkv chunks) has been copied out
+        typedef std::shared_ptr<std::vector<uint8_t>> zip_entry_data_t;
+        const size_t n_prefetch_entries = 4;
+        std::vector<struct zip_t*> zip_handles;
+        std::mutex zip_handles_mutex;
+        std::vector<int> zip_entry_order;
+        std::unordered_map<int, int> zip_entry_refs;
+        std::unordered_map<int, std::shared_future<zip_entry_data_t>> zip_entries;
+        std::set<int> zip_entries_started;
+        size_t next_prefetch_entry      = 0;
+        sd_thread_callbacks_t callbacks = sd_get_thread_callbacks();  // for the prefetching threads
+
         if (is_zip) {
-            zip = zip_open(file_path.c_str(), 0, 'r');
+            for (auto& tensor_storage : processed_tensor_storages) {
+                if (tensor_storage.file_index != file_index) {
+                    continue;
+                }
+                if (zip_entry_refs[tensor_storage.index_in_zip]++ == 0) {
+                    zip_entry_order.push_back(tensor_storage.index_in_zip);
+                }
+            }
+        }
+
+        auto read_zip_entry = [&](int index) -> zip_entry_data_t {
+            struct zip_t* zip = NULL;
+            {
+                std::lock_guard<std::mutex> lock(zip_handles_mutex);
+                if (zip_handles.size() > 0) {
+                    zip = zip_handles.back();
+                    zip_handles.pop_back();
+                }
+            }
+            if (zip == NULL) {
+                zip = zip_open(file_path.c_str(), 0, 'r');
+            }
+            zip_entry_data_t data = std::make_shared<std::vector<uint8_t>>();
             if (zip == NULL) {
                 LOG_ERROR("failed to open zip '%s'", file_path.c_str());
-                return false;
+                return data;
             }
-        }
+            if (zip_entry_openbyindex(zip, index) == 0) {
+                data->resize(zip_entry_size(zip));
+                zip_entry_noallocread(zip, (void*)data->data(), data->size());
+                zip_entry_close(zip);
+            }
+            std::lock_guard<std::mutex> lock(zip_handles_mutex);
+            zip_handles.push_back(zip);
+            return data;
+        };
+
+        auto start_zip_entry = [&](int index) {
+            if (zip_entries_started.insert(index).second) {
+                zip_entries[index] = std::async(std::launch::async, [read_zip_entry, callbacks, index]() {
+                                         sd_set_thread_callbacks(callbacks);
+                                         return read_zip_entry(index);
+                                     }).share();
+            }
+        };
+
+        auto prefetch_zip_entries = [&]() {
+            while (next_prefetch_entry < zip_entry_order.size() && zip_entries.size() < n_prefetch_entries) {
+                start_zip_entry(zip_entry_order[next_prefetch_entry++]);
+            }
+        };
+
+        auto release_zip_entry = [&](const TensorStorage& tensor_storage) {
+            if (!is_zip) {
+                return;
+            }
+            if (--zip_entry_refs[tensor_storage.index_in_zip] == 0) {
+                zip_entries.erase(tensor_storage.index_in_zip);
+            }
+            prefetch_zip_entries();
+        };
+
+        prefetch_zip_entries();
 
         std::vector<uint8_t> read_buffer;
         std::vector<uint8_t> convert_buffer;
 
         auto read_data = [&](const TensorStorage& tensor_storage, char* buf, size_t n) {
-            if (zip != NULL) {
-                zip_entry_openbyindex(zip, tensor_storage.index_in_zip);
-                size_t entry_size = zip_entry_size(zip);
-                if (entry_size != n) {
-                    read_buffer.resize(entry_size);
-                    zip_entry_noallocread(zip, (void*)read_buffer.data(), entry_size);
-                    memcpy((void*)buf, (void*)(read_buffer.data() + tensor_storage.offset), n);
-                } else {
-                    zip_entry_noallocread(zip, (void*)buf, n);
+            if (is_zip) {
+                start_zip_entry(tensor_storage.index_in_zip);
+                auto it = zip_entries.find(tensor_storage.index_in_zip);
+                if (it == zip_entries.end()) {
+                    LOG_ERROR("zip entry %d of '%s' is already released", tensor_storage.index_in_zip, file_path.c_str());
+                    return false;
                 }
-                zip_entry_close(zip);
+                zip_entry_data_t data = it->second.get();
+                size_t offset         = data->size() != n ? tensor_storage.offset : 0;
+                if (offset + n > data->size()) {
+                    LOG_ERROR("read tensor data failed: '%s'", file_path.c_str());
+                    return false;
+                }
+                memcpy((void*)buf, (void*)(data->data() + offset), n);
             } else {
                 file.seekg(tensor_storage.offset);
                 file.read(buf, n);
@@ -1709,6 +1911,7 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
             }
 
             if (dst_tensor == NULL) {
+                release_zip_entry(tensor_storage);
                 continue;
             }
 
@@ -1775,9 +1978,12 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
                     ggml_backend_tensor_set(dst_tensor, convert_buffer.data(), 0, ggml_nbytes(dst_tensor));
                 }
             }
+            release_zip_entry(tensor_storage);
         }
 
-        if (zip != NULL) {
+        // waits for the reads still in flight before their handles are closed
+        zip_entries.clear();
+        for (struct zip_t* zip : zip_handles) {
             zip_close(zip);
         }
 
@@ -1861,83 +2067,252 @@ bool ModelLoader::load_tensors(std::map<std::string, struct ggml_tensor*>& tenso
     return true;
 }
 
+// tensors kept in their stored type unless a tensor type rule says otherwise
+static const std::vector<std::string> unconverted_tensor_patterns = {
+    // FLUX
+    "img_in.",
+    "txt_in.",
+    "time_in.",
+    "vector_in.",
+    "guidance_in.",
+    "final_layer.",
+    // MMDiT
+    "x_embedder.",
+    "t_embedder.",
+    "y_embedder.",
+    "pos_embed",
+    "context_embedder.",
+    // Unet
+    "time_embed.",
+    "label_emb.",
+};
+
 bool ModelLoader::tensor_should_be_converted(const TensorStorage& tensor_storage, ggml_type type) {
     const std::string& name = tensor_storage.name;
-    if (type != GGML_TYPE_COUNT) {
-        if (ggml_is_quantized(type) && tensor_storage.ne[0] % ggml_blck_size(type) != 0) {
-            // Pass, do not convert
-        } else if (ends_with(name, ".bias")) {
-            // Pass, do not convert
-        } else if (ends_with(name, ".scale")) {
-            // Pass, do not convert
-        } else if (contains(name, "img_in.") ||
-                   contains(name, "txt_in.") ||
-                   contains(name, "time_in.") ||
-                   contains(name, "vector_in.") ||
-                   contains(name, "guidance_in.") ||
-                   contains(name, "final_layer.")) {
-            // Pass, do not convert. For FLUX
-        } else if (contains(name, "x_embedder.") ||
-                   contains(name, "t_embedder.") ||
-                   contains(name, "y_embedder.") ||
-                   contains(name, "pos_embed") ||
-                   contains(name, "context_embedder.")) {
-            // Pass, do not convert. For MMDiT
-        } else if (contains(name, "time_embed.") || contains(name, "label_emb.")) {
-            // Pass, do not convert. For Unet
-        } else {
-            return true;
+    if (type == GGML_TYPE_COUNT) {
+        return false;
+    }
+    if (ggml_is_quantized(type) && tensor_storage.ne[0] % ggml_blck_size(type) != 0) {
+        return false;
+    }
+    if (ends_with(name, ".bias") || ends_with(name, ".scale")) {
+        return false;
+    }
+    for (auto& pattern : unconverted_tensor_patterns) {
+        if (contains(name, pattern)) {
+            return false;
         }
     }
-    return false;
+    return true;
 }
 
-bool ModelLoader::save_to_gguf_file(const std::string& file_path, ggml_type type) {
-    auto backend    = ggml_backend_cpu_init();
-    size_t mem_size = 1 * 1024 * 1024;  // for padding
-    mem_size += tensor_storages.size() * ggml_tensor_overhead();
-    mem_size += get_params_mem_size(backend, type);
-    LOG_INFO("model tensors mem size: %.2fMB", mem_size / 1024.f / 1024.f);
-    ggml_context* ggml_ctx = ggml_init({mem_size, NULL, false});
+bool ModelLoader::save_to_gguf_file(const std::string& file_path, ggml_type type, int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = get_num_physical_cores();
+    }
 
-    gguf_context* gguf_ctx = gguf_init_empty();
+    // same tensor list as load_tensors(), so every callback below finds its tensor info
+    std::vector<TensorStorage> processed_tensor_storages;
+    for (auto& tensor_storage : tensor_storages) {
+        if (is_unused_tensor(tensor_storage.name)) {
+            continue;
+        }
+        preprocess_tensor(tensor_storage, processed_tensor_storages);
+    }
+    processed_tensor_storages = remove_duplicates(processed_tensor_storages);
 
-    auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
-        const std::string& name = tensor_storage.name;
+    // meta only, the tensor data is streamed into the file after the header
+    size_t mem_size        = (processed_tensor_storages.size() + 1) * ggml_tensor_overhead();
+    ggml_context* meta_ctx = ggml_init({mem_size, NULL, true});
+    gguf_context* gguf_ctx = gguf_init_empty();
+    std::map<std::string, ggml_tensor*> dst_tensors;
 
-        ggml_type tensor_type = tensor_storage.type;
-        if (tensor_should_be_converted(tensor_storage, type)) {
-            tensor_type = type;
-        }
+    for (auto& tensor_storage : processed_tensor_storages) {
+        ggml_type tensor_type = get_tensor_wtype(tensor_storage, type);
 
-        ggml_tensor* tensor = ggml_new_tensor(ggml_ctx, tensor_type, tensor_storage.n_dims, tensor_storage.ne);
+        ggml_tensor* tensor = ggml_new_tensor(meta_ctx, tensor_type, tensor_storage.n_dims, tensor_storage.ne);
         if (tensor == NULL) {
             LOG_ERROR("ggml_new_tensor failed");
+            ggml_free(meta_ctx);
+            gguf_free(gguf_ctx);
+            return false;
+        }
+        ggml_set_name(tensor, tensor_storage.name.c_str());
+        gguf_add_tensor(gguf_ctx, tensor);
+        dst_tensors[tensor_storage.name] = tensor;
+    }
+
+    std::ofstream file(file_path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        LOG_ERROR("failed to open '%s'", file_path.c_str());
+        ggml_free(meta_ctx);
+        gguf_free(gguf_ctx);
+        return false;
+    }
+
+    size_t meta_size = gguf_get_meta_size(gguf_ctx);
+    {
+        std::vector<uint8_t> meta(meta_size);
+        gguf_get_meta_data(gguf_ctx, meta.data());
+        file.write((const char*)meta.data(), meta_size);
+    }
+    size_t alignment = gguf_get_alignment(gguf_ctx);
+    LOG_INFO("trying to save tensors to %s (%d tensors, %d threads)",
+             file_path.c_str(), (int)processed_tensor_storages.size(), n_threads);
+
+    // the source tensor is read into one staging buffer while the previous one
+    // is quantized and written from the other, so at most two tensors are in flight
+    ggml_context* staging_ctx       = ggml_init({2 * ggml_tensor_overhead(), NULL, true});
+    ggml_tensor* staging_tensors[2] = {ggml_new_tensor_1d(staging_ctx, GGML_TYPE_I8, 1),
+                                       ggml_new_tensor_1d(staging_ctx, GGML_TYPE_I8, 1)};
+    std::vector<uint8_t> staging_buffers[2];
+    std::vector<uint8_t> write_buffer;
+    int staging_index = 0;
+
+    struct pending_tensor_t {
+        TensorStorage tensor_storage;
+        ggml_tensor* dst = NULL;
+        ggml_tensor* src = NULL;
+    };
+    pending_tensor_t pending;
+    std::future<bool> writing;
+    sd_thread_callbacks_t callbacks = sd_get_thread_callbacks();  // for the writing thread
+
+    auto flush = [&](pending_tensor_t task) -> bool {
+        ggml_tensor* dst  = task.dst;
+        ggml_tensor* src  = task.src;
+        int64_t n_per_row = task.tensor_storage.ne[0];
+        int64_t nrows     = task.tensor_storage.nelements() / n_per_row;
+        size_t nbytes     = ggml_nbytes(dst);
+
+        char* dst_data = (char*)src->data;
+        if (src->type != dst->type) {
+            write_buffer.resize(nbytes);
+            dst_data = (char*)write_buffer.data();
+
+            // split rows across the workers, every row is converted independently
+            int n_workers = (int)std::min<int64_t>(n_threads, nrows);
+            if (nbytes < 1024 * 1024) {
+                n_workers = 1;
+            }
+            int64_t rows_per_worker = (nrows + n_workers - 1) / n_workers;
+            size_t src_row_size     = ggml_row_size(src->type, n_per_row);
+            size_t dst_row_size     = ggml_row_size(dst->type, n_per_row);
+
+            auto convert_rows = [&](int64_t row_start) {
+                int64_t n = std::min(rows_per_worker, nrows - row_start);
+                if (n <= 0) {
+                    return;
+                }
+                convert_tensor((char*)src->data + row_start * src_row_size, src->type,
+                               dst_data + row_start * dst_row_size, dst->type,
+                               (int)n, (int)n_per_row);
+            };
+
+            std::vector<std::thread> workers;
+            for (int i = 1; i < n_workers; i++) {
+                workers.emplace_back(convert_rows, i * rows_per_worker);
+            }
+            convert_rows(0);
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+
+        int tensor_id = gguf_find_tensor(gguf_ctx, ggml_get_name(dst));
+        file.seekp(meta_size + gguf_get_tensor_offset(gguf_ctx, tensor_id));
+        file.write(dst_data, nbytes);
+        size_t padding = GGML_PAD(nbytes, alignment) - nbytes;
+        if (padding > 0) {
+            std::vector<char> zeros(padding, 0);
+            file.write(zeros.data(), padding);
+        }
+        if (!file) {
+            LOG_ERROR("write tensor data failed: '%s'", file_path.c_str());
             return false;
         }
-        ggml_set_name(tensor, name.c_str());
+        return true;
+    };
 
-        // LOG_DEBUG("%s %d %s %d[%d %d %d %d] %d[%d %d %d %d]", name.c_str(),
-        // ggml_nbytes(tensor), ggml_type_name(tensor_type),
-        // tensor_storage.n_dims,
-        // tensor_storage.ne[0], tensor_storage.ne[1], tensor_storage.ne[2], tensor_storage.ne[3],
-        // tensor->n_dims, tensor->ne[0], tensor->ne[1], tensor->ne[2], tensor->ne[3]);
+    auto wait_writing = [&]() -> bool {
+        if (writing.valid()) {
+            return writing.get();
+        }
+        return true;
+    };
 
-        *dst_tensor = tensor;
+    auto submit_pending = [&]() -> bool {
+        if (pending.dst == NULL) {
+            return true;
+        }
+        if (!wait_writing()) {
+            return false;
+        }
+        pending_tensor_t task = pending;
+        writing               = std::async(std::launch::async, [flush, callbacks, task]() {
+            sd_set_thread_callbacks(callbacks);
+            return flush(task);
+        });
+        pending.dst = NULL;
+        return true;
+    };
 
-        gguf_add_tensor(gguf_ctx, tensor);
+    int64_t t0            = ggml_time_ms();
+    size_t n_done         = 0;
+    auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
+        // load_tensors() has finished reading the previous tensor when it asks for the next one
+        if (!submit_pending()) {
+            return false;
+        }
+
+        auto it = dst_tensors.find(tensor_storage.name);
+        if (it == dst_tensors.end()) {
+            return true;
+        }
+
+        // the previous user of this staging buffer has already been written by now
+        ggml_tensor* src = staging_tensors[staging_index];
+
+        // read as stored (bf16/f8 are expanded in place by load_tensors)
+        src->type = tensor_storage.type;
+        for (int i = 0; i < GGML_MAX_DIMS; i++) {
+            src->ne[i] = tensor_storage.ne[i];
+        }
+        src->nb[0] = ggml_type_size(src->type);
+        src->nb[1] = src->nb[0] * (src->ne[0] / ggml_blck_size(src->type));
+        for (int i = 2; i < GGML_MAX_DIMS; i++) {
+            src->nb[i] = src->nb[i - 1] * src->ne[i - 1];
+        }
+        staging_buffers[staging_index].resize(tensor_storage.nbytes());
+        src->data = staging_buffers[staging_index].data();
 
+        pending.tensor_storage = tensor_storage;
+        pending.dst            = it->second;
+        pending.src            = src;
+        staging_index          = 1 - staging_index;
+        *dst_tensor            = src;
+
+        n_done++;
+        pretty_progress((int)n_done, (int)processed_tensor_storages.size(), (ggml_time_ms() - t0) / 1000.0f / n_done);
         return true;
     };
 
-    bool success = load_tensors(on_new_tensor_cb, backend);
-    ggml_backend_free(backend);
-    LOG_INFO("load tensors done");
-    LOG_INFO("trying to save tensors to %s", file_path.c_str());
+    bool success = load_tensors(on_new_tensor_cb, NULL);
+    if (success) {
+        success = submit_pending();
+    }
+    success = wait_writing() && success;
+    file.close();
+
+    int64_t t1 = ggml_time_ms();
     if (success) {
-        gguf_write_to_file(gguf_ctx, file_path.c_str(), false);
+        LOG_INFO("save tensors done, taking %.2fs", (t1 - t0) * 1.0f / 1000);
+    } else {
+        LOG_ERROR("save tensors to %s failed", file_path.c_str());
     }
-    ggml_free(ggml_ctx);
+
+    ggml_free(staging_ctx);
+    ggml_free(meta_ctx);
     gguf_free(gguf_ctx);
     return success;
 }
@@ -1957,16 +2332,18 @@ int64_t ModelLoader::get_params_mem_size(ggml_backend_t backend, ggml_type type)
     }
 
     for (auto& tensor_storage : processed_tensor_storages) {
-        if (tensor_should_be_converted(tensor_storage, type)) {
-            tensor_storage.type = type;
-        }
+        tensor_storage.type = get_tensor_wtype(tensor_storage, type);
         mem_size += tensor_storage.nbytes() + alignment;
     }
 
     return mem_size;
 }
 
-bool convert(const char* input_path, const char* vae_path, const char* output_path, sd_type_t output_type) {
+bool convert(const char* input_path,
+             const char* vae_path,
+             const char* output_path,
+             sd_type_t output_type,
+             const char* tensor_type_rules) {
     ModelLoader model_loader;
 
     if (!model_loader.init_from_file(input_path)) {
@@ -1980,6 +2357,9 @@ bool convert(const char* input_path, const char* vae_path, const char* output_pa
             return false;
         }
     }
+    if (tensor_type_rules != NULL && !model_loader.set_tensor_type_rules(tensor_type_rules)) {
+        return false;
+    }
     bool success = model_loader.save_to_gguf_file(output_path, (ggml_type)output_type);
     return success;
 }
@@ -4,6 +4,7 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <regex>
 #include <set>
 #include <sstream>
 #include <string>
@@ -156,10 +157,19 @@ struct TensorStorage {
 
 typedef std::function<bool(const TensorStorage&, ggml_tensor**)> on_new_tensor_cb_t;
 
+// one "pattern=type" entry of a quantization recipe
+struct TensorTypeRule {
+    std::string pattern;
+    std::regex regex;
+    ggml_type type = GGML_TYPE_COUNT;  // GGML_TYPE_COUNT keeps the stored type
+};
+
 class ModelLoader {
 protected:
     std::vector<std::string> file_paths_;
     std::vector<TensorStorage> tensor_storages;
+    std::vector<TensorTypeRule> tensor_type_rules;
+    std::string tensor_type_recipe;  // the parsed rules, one "pattern=type" per line
 
     bool parse_data_pkl(uint8_t* buffer,
                         size_t buffer_size,
@@ -183,12 +193,15 @@ public:
     ggml_type get_diffusion_model_wtype();
     ggml_type get_vae_wtype();
     void set_wtype_override(ggml_type wtype, std::string prefix = "");
+    bool set_tensor_type_rules(const std::string& rules);
+    std::string get_tensor_type_recipe();
+    ggml_type get_tensor_wtype(const TensorStorage& tensor_storage, ggml_type wtype);
     bool load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend);
     bool load_tensors(std::map<std::string, struct ggml_tensor*>& tensors,
                       ggml_backend_t backend,
                       std::set<std::string> ignore_tensors = {});
 
-    bool save_to_gguf_file(const std::string& file_path, ggml_type type);
+    bool save_to_gguf_file(const std::string& file_path, ggml_type type, int n_threads = -1);
     bool tensor_should_be_converted(const TensorStorage& tensor_storage, ggml_type type);
     int64_t get_params_mem_size(ggml_backend_t backend, ggml_type type = GGML_TYPE_COUNT);
     ~ModelLoader() = default;
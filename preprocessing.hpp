@@ -1,227 +1,319 @@
 #ifndef __PREPROCESSING_HPP__
 #define __PREPROCESSING_HPP__
 
+#include <thread>
+
 #include "ggml_extend.hpp"
-#define M_PI_ 3.14159265358979323846
-
-void convolve(struct ggml_tensor* input, struct ggml_tensor* output, struct ggml_tensor* kernel, int padding) {
-    struct ggml_init_params params;
-    params.mem_size                 = 20 * 1024 * 1024;  // 10
-    params.mem_buffer               = NULL;
-    params.no_alloc                 = false;
-    struct ggml_context* ctx0       = ggml_init(params);
-    struct ggml_tensor* kernel_fp16 = ggml_new_tensor_4d(ctx0, GGML_TYPE_F16, kernel->ne[0], kernel->ne[1], 1, 1);
-    ggml_fp32_to_fp16_row((float*)kernel->data, (ggml_fp16_t*)kernel_fp16->data, ggml_nelements(kernel));
-    ggml_tensor* h  = ggml_conv_2d(ctx0, kernel_fp16, input, 1, 1, padding, padding, 1, 1);
-    ggml_cgraph* gf = ggml_new_graph(ctx0);
-    ggml_build_forward_expand(gf, ggml_cpy(ctx0, h, output));
-    ggml_graph_compute_with_ctx(ctx0, gf, 1);
-    ggml_free(ctx0);
-}
 
-void gaussian_kernel(struct ggml_tensor* kernel) {
-    int ks_mid   = kernel->ne[0] / 2;
-    float sigma  = 1.4f;
-    float normal = 1.f / (2.0f * M_PI_ * powf(sigma, 2.0f));
-    for (int y = 0; y < kernel->ne[0]; y++) {
-        float gx = -ks_mid + y;
-        for (int x = 0; x < kernel->ne[1]; x++) {
-            float gy = -ks_mid + x;
-            float k_ = expf(-((gx * gx + gy * gy) / (2.0f * powf(sigma, 2.0f)))) * normal;
-            ggml_tensor_set_f32(kernel, k_, x, y);
-        }
-    }
-}
+/*=============================================== Images ================================================*/
 
-void grayscale(struct ggml_tensor* rgb_img, struct ggml_tensor* grayscale) {
-    for (int iy = 0; iy < rgb_img->ne[1]; iy++) {
-        for (int ix = 0; ix < rgb_img->ne[0]; ix++) {
-            float r    = ggml_tensor_get_f32(rgb_img, ix, iy);
-            float g    = ggml_tensor_get_f32(rgb_img, ix, iy, 1);
-            float b    = ggml_tensor_get_f32(rgb_img, ix, iy, 2);
-            float gray = 0.2989f * r + 0.5870f * g + 0.1140f * b;
-            ggml_tensor_set_f32(grayscale, gray, ix, iy);
-        }
+// single channel float image, row major
+struct SDGrayImage {
+    int width  = 0;
+    int height = 0;
+    std::vector<float> data;
+
+    void resize(int w, int h) {
+        width  = w;
+        height = h;
+        data.resize((size_t)w * h);
     }
-}
 
-void prop_hypot(struct ggml_tensor* x, struct ggml_tensor* y, struct ggml_tensor* h) {
-    int n_elements = ggml_nelements(h);
-    float* dx      = (float*)x->data;
-    float* dy      = (float*)y->data;
-    float* dh      = (float*)h->data;
-    for (int i = 0; i < n_elements; i++) {
-        dh[i] = sqrtf(dx[i] * dx[i] + dy[i] * dy[i]);
+    float* row(int y) {
+        return data.data() + (size_t)y * width;
     }
-}
 
-void prop_arctan2(struct ggml_tensor* x, struct ggml_tensor* y, struct ggml_tensor* h) {
-    int n_elements = ggml_nelements(h);
-    float* dx      = (float*)x->data;
-    float* dy      = (float*)y->data;
-    float* dh      = (float*)h->data;
-    for (int i = 0; i < n_elements; i++) {
-        dh[i] = atan2f(dy[i], dx[i]);
+    const float* row(int y) const {
+        return data.data() + (size_t)y * width;
     }
-}
+};
 
-void normalize_tensor(struct ggml_tensor* g) {
-    int n_elements = ggml_nelements(g);
-    float* dg      = (float*)g->data;
-    float max      = -INFINITY;
-    for (int i = 0; i < n_elements; i++) {
-        max = dg[i] > max ? dg[i] : max;
+// runs fn(y_begin, y_end) on bands of rows, one band per thread
+static void preprocess_parallel_rows(int height, int n_threads, const std::function<void(int, int)>& fn) {
+    const int min_rows_per_band = 16;
+    n_threads                   = std::max(1, std::min(n_threads, height / min_rows_per_band));
+    if (n_threads == 1) {
+        fn(0, height);
+        return;
     }
-    max = 1.0f / max;
-    for (int i = 0; i < n_elements; i++) {
-        dg[i] *= max;
+    std::vector<std::thread> workers;
+    int band = (height + n_threads - 1) / n_threads;
+    for (int y0 = 0; y0 < height; y0 += band) {
+        workers.emplace_back(fn, y0, std::min(height, y0 + band));
+    }
+    for (auto& worker : workers) {
+        worker.join();
     }
 }
 
-void non_max_supression(struct ggml_tensor* result, struct ggml_tensor* G, struct ggml_tensor* D) {
-    for (int iy = 1; iy < result->ne[1] - 1; iy++) {
-        for (int ix = 1; ix < result->ne[0] - 1; ix++) {
-            float angle = ggml_tensor_get_f32(D, ix, iy) * 180.0f / M_PI_;
-            angle       = angle < 0.0f ? angle += 180.0f : angle;
-            float q     = 1.0f;
-            float r     = 1.0f;
-
-            // angle 0
-            if ((0 >= angle && angle < 22.5f) || (157.5f >= angle && angle <= 180)) {
-                q = ggml_tensor_get_f32(G, ix, iy + 1);
-                r = ggml_tensor_get_f32(G, ix, iy - 1);
-            }
-            // angle 45
-            else if (22.5f >= angle && angle < 67.5f) {
-                q = ggml_tensor_get_f32(G, ix + 1, iy - 1);
-                r = ggml_tensor_get_f32(G, ix - 1, iy + 1);
-            }
-            // angle 90
-            else if (67.5f >= angle && angle < 112.5) {
-                q = ggml_tensor_get_f32(G, ix + 1, iy);
-                r = ggml_tensor_get_f32(G, ix - 1, iy);
-            }
-            // angle 135
-            else if (112.5 >= angle && angle < 157.5f) {
-                q = ggml_tensor_get_f32(G, ix - 1, iy - 1);
-                r = ggml_tensor_get_f32(G, ix + 1, iy + 1);
+// rgb uint8 -> gray in [0, 1]
+static void preprocess_rgb_to_gray(const uint8_t* img, int width, int height, SDGrayImage& gray, int n_threads) {
+    gray.resize(width, height);
+    preprocess_parallel_rows(height, n_threads, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const uint8_t* src = img + (size_t)y * width * 3;
+            float* dst         = gray.row(y);
+            for (int x = 0; x < width; x++) {
+                dst[x] = (0.2989f * src[x * 3] + 0.5870f * src[x * 3 + 1] + 0.1140f * src[x * 3 + 2]) / 255.f;
             }
+        }
+    });
+}
 
-            float cur = ggml_tensor_get_f32(G, ix, iy);
-            if ((cur >= q) && (cur >= r)) {
-                ggml_tensor_set_f32(result, cur, ix, iy);
-            } else {
-                ggml_tensor_set_f32(result, 0.0f, ix, iy);
+// gray in [0, 1] -> rgb uint8, malloc'ed
+static uint8_t* preprocess_gray_to_rgb(const SDGrayImage& gray, bool inverse, int n_threads) {
+    uint8_t* img = (uint8_t*)malloc((size_t)gray.width * gray.height * 3);
+    if (img == NULL) {
+        return NULL;
+    }
+    preprocess_parallel_rows(gray.height, n_threads, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const float* src = gray.row(y);
+            uint8_t* dst     = img + (size_t)y * gray.width * 3;
+            for (int x = 0; x < gray.width; x++) {
+                float v        = inverse ? 1.0f - src[x] : src[x];
+                uint8_t value  = (uint8_t)(std::min(std::max(v, 0.f), 1.f) * 255.f);
+                dst[x * 3]     = value;
+                dst[x * 3 + 1] = value;
+                dst[x * 3 + 2] = value;
             }
         }
-    }
+    });
+    return img;
 }
 
-void threshold_hystersis(struct ggml_tensor* img, float high_threshold, float low_threshold, float weak, float strong) {
-    int n_elements = ggml_nelements(img);
-    float* imd     = (float*)img->data;
-    float max      = -INFINITY;
-    for (int i = 0; i < n_elements; i++) {
-        max = imd[i] > max ? imd[i] : max;
+// separable gaussian blur, the borders are clamped
+static void preprocess_gaussian_blur(const SDGrayImage& input, SDGrayImage& output, SDGrayImage& tmp, float sigma, int radius, int n_threads) {
+    int width  = input.width;
+    int height = input.height;
+    std::vector<float> kernel(2 * radius + 1);
+    float sum = 0.f;
+    for (int i = -radius; i <= radius; i++) {
+        kernel[i + radius] = expf(-(i * i) / (2.0f * sigma * sigma));
+        sum += kernel[i + radius];
     }
-    float ht = max * high_threshold;
-    float lt = ht * low_threshold;
-    for (int i = 0; i < n_elements; i++) {
-        float img_v = imd[i];
-        if (img_v >= ht) {  // strong pixel
-            imd[i] = strong;
-        } else if (img_v <= ht && img_v >= lt) {  // strong pixel
-            imd[i] = weak;
-        }
+    for (auto& k : kernel) {
+        k /= sum;
     }
 
-    for (int iy = 0; iy < img->ne[1]; iy++) {
-        for (int ix = 0; ix < img->ne[0]; ix++) {
-            if (ix >= 3 && ix <= img->ne[0] - 3 && iy >= 3 && iy <= img->ne[1] - 3) {
-                ggml_tensor_set_f32(img, ggml_tensor_get_f32(img, ix, iy), ix, iy);
-            } else {
-                ggml_tensor_set_f32(img, 0.0f, ix, iy);
+    tmp.resize(width, height);
+    output.resize(width, height);
+    // horizontal
+    preprocess_parallel_rows(height, n_threads, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const float* src = input.row(y);
+            float* dst       = tmp.row(y);
+            for (int x = 0; x < width; x++) {
+                float v = 0.f;
+                for (int i = -radius; i <= radius; i++) {
+                    v += kernel[i + radius] * src[std::min(std::max(x + i, 0), width - 1)];
+                }
+                dst[x] = v;
+            }
+        }
+    });
+    // vertical, row by row so the inner loop stays contiguous
+    preprocess_parallel_rows(height, n_threads, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            float* dst = output.row(y);
+            std::fill(dst, dst + width, 0.f);
+            for (int i = -radius; i <= radius; i++) {
+                const float* src = tmp.row(std::min(std::max(y + i, 0), height - 1));
+                float k          = kernel[i + radius];
+                for (int x = 0; x < width; x++) {
+                    dst[x] += k * src[x];
+                }
+            }
+        }
+    });
+}
+
+// 3x3 sobel, gy points up (top row minus bottom row)
+static void preprocess_sobel(const SDGrayImage& input, SDGrayImage& gx, SDGrayImage& gy, int n_threads) {
+    int width  = input.width;
+    int height = input.height;
+    gx.resize(width, height);
+    gy.resize(width, height);
+    preprocess_parallel_rows(height, n_threads, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const float* top    = input.row(std::max(y - 1, 0));
+            const float* mid    = input.row(y);
+            const float* bottom = input.row(std::min(y + 1, height - 1));
+            float* dx           = gx.row(y);
+            float* dy           = gy.row(y);
+            for (int x = 0; x < width; x++) {
+                int l = std::max(x - 1, 0);
+                int r = std::min(x + 1, width - 1);
+                dx[x] = (top[r] - top[l]) + 2.f * (mid[r] - mid[l]) + (bottom[r] - bottom[l]);
+                dy[x] = (top[l] + 2.f * top[x] + top[r]) - (bottom[l] + 2.f * bottom[x] + bottom[r]);
             }
         }
+    });
+}
+
+/*============================================ Preprocessors ============================================*/
+
+// turns a gray image in [0, 1] into a single channel control map in [0, 1],
+// the buffers of an instance are reused across calls
+class Preprocessor {
+protected:
+    int n_threads = 1;
+    SDGrayImage gray;
+    SDGrayImage result;
+
+public:
+    Preprocessor(int n_threads)
+        : n_threads(std::max(n_threads, 1)) {}
+    virtual ~Preprocessor() = default;
+
+    virtual void process(const SDGrayImage& input, SDGrayImage& output) = 0;
+
+    // rgb uint8 in, rgb uint8 out (malloc'ed)
+    uint8_t* process_rgb(const uint8_t* img, int width, int height, bool inverse) {
+        preprocess_rgb_to_gray(img, width, height, gray, n_threads);
+        process(gray, result);
+        return preprocess_gray_to_rgb(result, inverse, n_threads);
     }
+};
+
+class CannyPreprocessor : public Preprocessor {
+protected:
+    float high_threshold;
+    float low_threshold;
+    float strong;
+
+    SDGrayImage blurred;
+    SDGrayImage tmp;
+    SDGrayImage gx;
+    SDGrayImage gy;
+    SDGrayImage magnitude;
+    std::vector<uint8_t> edges;  // 0: none, 1: weak, 2: strong
+    std::vector<int> stack;
+
+public:
+    CannyPreprocessor(int n_threads, float high_threshold, float low_threshold, float strong)
+        : Preprocessor(n_threads), high_threshold(high_threshold), low_threshold(low_threshold), strong(strong) {}
+
+    void process(const SDGrayImage& input, SDGrayImage& output) override {
+        int width  = input.width;
+        int height = input.height;
+
+        preprocess_gaussian_blur(input, blurred, tmp, 1.4f, 2, n_threads);
+        preprocess_sobel(blurred, gx, gy, n_threads);
+
+        // gradient magnitude, non max suppression along the quantized gradient direction
+        magnitude.resize(width, height);
+        preprocess_parallel_rows(height, n_threads, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                const float* dx = gx.row(y);
+                const float* dy = gy.row(y);
+                float* m        = magnitude.row(y);
+                for (int x = 0; x < width; x++) {
+                    m[x] = sqrtf(dx[x] * dx[x] + dy[x] * dy[x]);
+                }
+            }
+        });
+
+        const float tan_22_5 = 0.41421356f;
+        const float tan_67_5 = 2.41421356f;
+        output.resize(width, height);
+        std::vector<float> band_max(height, 0.f);
+        preprocess_parallel_rows(height, n_threads, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                float* dst = output.row(y);
+                std::fill(dst, dst + width, 0.f);
+                if (y == 0 || y == height - 1) {
+                    continue;
+                }
+                const float* dx = gx.row(y);
+                const float* dy = gy.row(y);
+                const float* up = magnitude.row(y - 1);
+                const float* m  = magnitude.row(y);
+                const float* dn = magnitude.row(y + 1);
+                float row_max   = 0.f;
+                for (int x = 1; x < width - 1; x++) {
+                    float ax = std::fabs(dx[x]);
+                    float ay = std::fabs(dy[x]);
+                    float q, r;
+                    if (ay <= ax * tan_22_5) {  // 0 degrees
+                        q = m[x + 1];
+                        r = m[x - 1];
+                    } else if (ay >= ax * tan_67_5) {  // 90 degrees
+                        q = up[x];
+                        r = dn[x];
+                    } else if ((dx[x] > 0) == (dy[x] > 0)) {  // 45 degrees
+                        q = up[x + 1];
+                        r = dn[x - 1];
+                    } else {  // 135 degrees
+                        q = up[x - 1];
+                        r = dn[x + 1];
+                    }
+                    if (m[x] >= q && m[x] >= r) {
+                        dst[x]  = m[x];
+                        row_max = std::max(row_max, m[x]);
+                    }
+                }
+                band_max[y] = row_max;
+            }
+        });
 
-    // hysteresis
-    for (int iy = 1; iy < img->ne[1] - 1; iy++) {
-        for (int ix = 1; ix < img->ne[0] - 1; ix++) {
-            float imd_v = ggml_tensor_get_f32(img, ix, iy);
-            if (imd_v == weak) {
-                if (ggml_tensor_get_f32(img, ix + 1, iy - 1) == strong || ggml_tensor_get_f32(img, ix + 1, iy) == strong ||
-                    ggml_tensor_get_f32(img, ix, iy - 1) == strong || ggml_tensor_get_f32(img, ix, iy + 1) == strong ||
-                    ggml_tensor_get_f32(img, ix - 1, iy - 1) == strong || ggml_tensor_get_f32(img, ix - 1, iy) == strong) {
-                    ggml_tensor_set_f32(img, strong, ix, iy);
-                } else {
-                    ggml_tensor_set_f32(img, 0.0f, ix, iy);
+        // double threshold, relative to the strongest edge, 3 pixels of border are dropped
+        float max = *std::max_element(band_max.begin(), band_max.end());
+        float ht  = max * high_threshold;
+        float lt  = ht * low_threshold;
+        edges.assign((size_t)width * height, 0);
+        preprocess_parallel_rows(height, n_threads, [&](int y0, int y1) {
+            for (int y = std::max(y0, 3); y < std::min(y1, height - 3); y++) {
+                const float* src = output.row(y);
+                uint8_t* e       = edges.data() + (size_t)y * width;
+                for (int x = 3; x < width - 3; x++) {
+                    e[x] = max > 0 && src[x] >= ht ? 2 : (max > 0 && src[x] >= lt ? 1 : 0);
+                }
+            }
+        });
+
+        // hysteresis, weak pixels connected (8-neighborhood) to a strong pixel become strong
+        stack.clear();
+        for (int i = 0; i < width * height; i++) {
+            if (edges[i] == 2) {
+                stack.push_back(i);
+            }
+        }
+        while (!stack.empty()) {
+            int i = stack.back();
+            stack.pop_back();
+            int x = i % width;
+            int y = i / width;
+            for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ny++) {
+                for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++) {
+                    int j = ny * width + nx;
+                    if (edges[j] == 1) {
+                        edges[j] = 2;
+                        stack.push_back(j);
+                    }
                 }
             }
         }
+
+        for (size_t i = 0; i < edges.size(); i++) {
+            output.data[i] = edges[i] == 2 ? strong : 0.f;
+        }
     }
-}
+};
 
 uint8_t* preprocess_canny(uint8_t* img, int width, int height, float high_threshold, float low_threshold, float weak, float strong, bool inverse) {
-    struct ggml_init_params params;
-    params.mem_size               = static_cast<size_t>(10 * 1024 * 1024);  // 10
-    params.mem_buffer             = NULL;
-    params.no_alloc               = false;
-    struct ggml_context* work_ctx = ggml_init(params);
-
-    if (!work_ctx) {
-        LOG_ERROR("ggml_init() failed");
+    (void)weak;  // weak pixels are either promoted to strong or dropped
+    int64_t t0 = ggml_time_ms();
+    CannyPreprocessor canny(get_num_physical_cores(), high_threshold, low_threshold, strong);
+    uint8_t* output = canny.process_rgb(img, width, height, inverse);
+    if (output == NULL) {
+        LOG_ERROR("preprocess canny failed");
         return NULL;
     }
-
-    float kX[9] = {
-        -1, 0, 1,
-        -2, 0, 2,
-        -1, 0, 1};
-
-    float kY[9] = {
-        1, 2, 1,
-        0, 0, 0,
-        -1, -2, -1};
-
-    // generate kernel
-    int kernel_size             = 5;
-    struct ggml_tensor* gkernel = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, kernel_size, kernel_size, 1, 1);
-    struct ggml_tensor* sf_kx   = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, 3, 3, 1, 1);
-    memcpy(sf_kx->data, kX, ggml_nbytes(sf_kx));
-    struct ggml_tensor* sf_ky = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, 3, 3, 1, 1);
-    memcpy(sf_ky->data, kY, ggml_nbytes(sf_ky));
-    gaussian_kernel(gkernel);
-    struct ggml_tensor* image      = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
-    struct ggml_tensor* image_gray = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 1, 1);
-    struct ggml_tensor* iX         = ggml_dup_tensor(work_ctx, image_gray);
-    struct ggml_tensor* iY         = ggml_dup_tensor(work_ctx, image_gray);
-    struct ggml_tensor* G          = ggml_dup_tensor(work_ctx, image_gray);
-    struct ggml_tensor* tetha      = ggml_dup_tensor(work_ctx, image_gray);
-    sd_image_to_tensor(img, image);
-    grayscale(image, image_gray);
-    convolve(image_gray, image_gray, gkernel, 2);
-    convolve(image_gray, iX, sf_kx, 1);
-    convolve(image_gray, iY, sf_ky, 1);
-    prop_hypot(iX, iY, G);
-    normalize_tensor(G);
-    prop_arctan2(iX, iY, tetha);
-    non_max_supression(image_gray, G, tetha);
-    threshold_hystersis(image_gray, high_threshold, low_threshold, weak, strong);
-    // to RGB channels
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            float gray = ggml_tensor_get_f32(image_gray, ix, iy);
-            gray       = inverse ? 1.0f - gray : gray;
-            ggml_tensor_set_f32(image, gray, ix, iy);
-            ggml_tensor_set_f32(image, gray, ix, iy, 1);
-            ggml_tensor_set_f32(image, gray, ix, iy, 2);
-        }
-    }
     free(img);
-    uint8_t* output = sd_tensor_to_image(image);
-    ggml_free(work_ctx);
+    int64_t t1 = ggml_time_ms();
+    LOG_DEBUG("preprocess canny %dx%d completed, taking %.2fs", width, height, (t1 - t0) * 1.0f / 1000);
     return output;
 }
 
-#endif  // __PREPROCESSING_HPP__
\ No newline at end of file
+#endif  // __PREPROCESSING_HPP__
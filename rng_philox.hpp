@@ -1,7 +1,9 @@
 #ifndef __RNG_PHILOX_H__
 #define __RNG_PHILOX_H__
 
+#include <algorithm>
 #include <cmath>
+#include <thread>
 #include <vector>
 
 #include "rng.hpp"
@@ -12,72 +14,19 @@ class PhiloxRNG : public RNG {
 private:
     uint64_t seed;
     uint32_t offset;
+    int n_threads;  // the caller's thread budget for large fills
 
 private:
-    std::vector<uint32_t> philox_m = {0xD2511F53, 0xCD9E8D57};
-    std::vector<uint32_t> philox_w = {0x9E3779B9, 0xBB67AE85};
-    float two_pow32_inv            = 2.3283064e-10f;
-    float two_pow32_inv_2pi        = 2.3283064e-10f * 6.2831855f;
-
-    std::vector<uint32_t> uint32(uint64_t x) {
-        std::vector<uint32_t> result(2);
-        result[0] = static_cast<uint32_t>(x & 0xFFFFFFFF);
-        result[1] = static_cast<uint32_t>(x >> 32);
-        return result;
-    }
-
-    std::vector<std::vector<uint32_t>> uint32(const std::vector<uint64_t>& x) {
-        uint32_t N = (uint32_t)x.size();
-        std::vector<std::vector<uint32_t>> result(2, std::vector<uint32_t>(N));
-
-        for (uint32_t i = 0; i < N; ++i) {
-            result[0][i] = static_cast<uint32_t>(x[i] & 0xFFFFFFFF);
-            result[1][i] = static_cast<uint32_t>(x[i] >> 32);
-        }
-
-        return result;
-    }
-
-    //  A single round of the Philox 4x32 random number generator.
-    void philox4_round(std::vector<std::vector<uint32_t>>& counter,
-                       const std::vector<std::vector<uint32_t>>& key) {
-        uint32_t N = (uint32_t)counter[0].size();
-        for (uint32_t i = 0; i < N; i++) {
-            std::vector<uint32_t> v1 = uint32(static_cast<uint64_t>(counter[0][i]) * static_cast<uint64_t>(philox_m[0]));
-            std::vector<uint32_t> v2 = uint32(static_cast<uint64_t>(counter[2][i]) * static_cast<uint64_t>(philox_m[1]));
-
-            counter[0][i] = v2[1] ^ counter[1][i] ^ key[0][i];
-            counter[1][i] = v2[0];
-            counter[2][i] = v1[1] ^ counter[3][i] ^ key[1][i];
-            counter[3][i] = v1[0];
-        }
-    }
-
-    // Generates 32-bit random numbers using the Philox 4x32 random number generator.
-    // Parameters:
-    //     counter : A 4xN array of 32-bit integers representing the counter values (offset into generation).
-    //     key : A 2xN array of 32-bit integers representing the key values (seed).
-    //     rounds : The number of rounds to perform.
-    // Returns:
-    //     std::vector<std::vector<uint32_t>>: A 4xN array of 32-bit integers containing the generated random numbers.
-    std::vector<std::vector<uint32_t>> philox4_32(std::vector<std::vector<uint32_t>>& counter,
-                                                  std::vector<std::vector<uint32_t>>& key,
-                                                  int rounds = 10) {
-        uint32_t N = (uint32_t)counter[0].size();
-        for (int i = 0; i < rounds - 1; ++i) {
-            philox4_round(counter, key);
-
-            for (uint32_t j = 0; j < N; ++j) {
-                key[0][j] += philox_w[0];
-                key[1][j] += philox_w[1];
-            }
-        }
-
-        philox4_round(counter, key);
-        return counter;
-    }
-
-    float box_muller(float x, float y) {
+    static const uint32_t philox_m0 = 0xD2511F53;
+    static const uint32_t philox_m1 = 0xCD9E8D57;
+    static const uint32_t philox_w0 = 0x9E3779B9;
+    static const uint32_t philox_w1 = 0xBB67AE85;
+    static const int lanes          = 8;        // counters processed together, the inner loops vectorize
+    static const uint32_t min_split = 1 << 16;  // samples per thread worth a thread
+    float two_pow32_inv             = 2.3283064e-10f;
+    float two_pow32_inv_2pi         = 2.3283064e-10f * 6.2831855f;
+
+    float box_muller(float x, float y) const {
         float u = x * two_pow32_inv + two_pow32_inv / 2;
         float v = y * two_pow32_inv_2pi + two_pow32_inv_2pi / 2;
 
@@ -87,10 +36,47 @@ private:
         return r1;
     }
 
+    // Philox 4x32-10 on the counters (offset, 0, i, 0) keyed by the seed, i in [begin, end),
+    // the first two words of each block feed Box-Muller for out[i]
+    void randn_range(float* out, uint32_t begin, uint32_t end, uint32_t offset) const {
+        const uint32_t key0 = static_cast<uint32_t>(seed & 0xFFFFFFFF);
+        const uint32_t key1 = static_cast<uint32_t>(seed >> 32);
+        for (uint32_t i0 = begin; i0 < end; i0 += lanes) {
+            uint32_t c0[lanes], c1[lanes], c2[lanes], c3[lanes];
+            for (int l = 0; l < lanes; l++) {
+                c0[l] = offset;
+                c1[l] = 0;
+                c2[l] = i0 + l;
+                c3[l] = 0;
+            }
+            uint32_t k0 = key0;
+            uint32_t k1 = key1;
+            for (int round = 0; round < 10; round++) {
+                for (int l = 0; l < lanes; l++) {
+                    uint64_t p0 = static_cast<uint64_t>(c0[l]) * philox_m0;
+                    uint64_t p1 = static_cast<uint64_t>(c2[l]) * philox_m1;
+                    c0[l]       = static_cast<uint32_t>(p1 >> 32) ^ c1[l] ^ k0;
+                    c2[l]       = static_cast<uint32_t>(p0 >> 32) ^ c3[l] ^ k1;
+                    c1[l]       = static_cast<uint32_t>(p1);
+                    c3[l]       = static_cast<uint32_t>(p0);
+                }
+                k0 += philox_w0;
+                k1 += philox_w1;
+            }
+            uint32_t count = std::min((uint32_t)lanes, end - i0);
+            for (uint32_t l = 0; l < count; l++) {
+                out[i0 + l] = box_muller((float)c0[l], (float)c1[l]);
+            }
+        }
+    }
+
 public:
-    PhiloxRNG(uint64_t seed = 0) {
-        this->seed   = seed;
-        this->offset = 0;
+    using RNG::randn;
+
+    PhiloxRNG(uint64_t seed = 0, int n_threads = 1) {
+        this->seed      = seed;
+        this->offset    = 0;
+        this->n_threads = std::max(n_threads, 1);
     }
 
     void manual_seed(uint64_t seed) {
@@ -98,28 +84,26 @@ public:
         this->offset = 0;
     }
 
-    std::vector<float> randn(uint32_t n) {
-        std::vector<std::vector<uint32_t>> counter(4, std::vector<uint32_t>(n, 0));
-        for (uint32_t i = 0; i < n; i++) {
-            counter[0][i] = this->offset;
-        }
-
-        for (uint32_t i = 0; i < n; i++) {
-            counter[2][i] = i;
-        }
+    // every sample only depends on (seed, offset, index), so the range splits freely across
+    // up to n_threads threads, fills below min_split samples per thread stay on the caller
+    void randn(float* out, uint32_t n) {
+        uint32_t offset = this->offset;
         this->offset += 1;
 
-        std::vector<uint64_t> key(n, this->seed);
-        std::vector<std::vector<uint32_t>> key_uint32 = uint32(key);
-
-        std::vector<std::vector<uint32_t>> g = philox4_32(counter, key_uint32);
-
-        std::vector<float> result;
-        for (uint32_t i = 0; i < n; ++i) {
-            result.push_back(box_muller((float)g[0][i], (float)g[1][i]));
+        int n_threads = (int)std::min<uint32_t>((uint32_t)this->n_threads, n / min_split);
+        if (n_threads <= 1) {
+            randn_range(out, 0, n, offset);
+            return;
+        }
+        std::vector<std::thread> workers;
+        uint32_t chunk = (n / n_threads + lanes - 1) / lanes * lanes;
+        for (uint32_t begin = 0; begin < n; begin += chunk) {
+            workers.emplace_back(&PhiloxRNG::randn_range, this, out, begin, std::min(n, begin + chunk), offset);
+        }
+        for (auto& worker : workers) {
+            worker.join();
         }
-        return result;
     }
 };
 
-#endif  // __RNG_PHILOX_H__
\ No newline at end of file
+#endif  // __RNG_PHILOX_H__
@@ -43,6 +43,11 @@ const char* sampling_methods_str[] = {
     "iPNDM",
     "iPNDM_v",
     "LCM",
+    "DPM adaptive (1/2)",
+    "UniPC (bh1)",
+    "UniPC (bh2)",
+    "DPM++ (3M) SDE",
+    "DEIS",
 };
 
 /*================================================== Helper Functions ================================================*/
@@ -62,6 +67,211 @@ void calculate_alphas_cumprod(float* alphas_cumprod,
     }
 }
 
+// FNV-1a, only used to key snapshots, shared weights and caches
+uint64_t fnv1a_hash(const void* data, size_t n, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t i = 0; i < n; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t fnv1a_hash(const std::string& str, uint64_t hash = 0xcbf29ce484222325ULL) {
+    return fnv1a_hash(str.data(), str.size(), hash);
+}
+
+// FNV-1a over 64 bit words, a few times faster than the byte version on whole weight files
+uint64_t fnv1a_hash_words(const void* data, size_t n, uint64_t hash) {
+    const uint8_t* p = (const uint8_t*)data;
+    size_t n_words   = n / sizeof(uint64_t);
+    for (size_t i = 0; i < n_words; i++) {
+        uint64_t word;
+        memcpy(&word, p + i * sizeof(uint64_t), sizeof(uint64_t));
+        hash ^= word;
+        hash *= 0x100000001b3ULL;
+    }
+    return fnv1a_hash(p + n_words * sizeof(uint64_t), n % sizeof(uint64_t), hash);
+}
+
+static std::mutex file_hashes_mutex;
+static std::map<std::string, std::pair<std::pair<int64_t, int64_t>, uint64_t>> file_hashes;  // path -> ((size, mtime), hash)
+
+// hash of the whole file content. Reading multi-GB weights takes a while, so the hash is
+// remembered per (path, size, mtime) in memory and, when cache_dir is set, in a sidecar
+// file there, only new or changed files are read again
+uint64_t fingerprint_file(const std::string& path, uint64_t hash = 0xcbf29ce484222325ULL, const std::string& cache_dir = "") {
+    int64_t size  = 0;
+    int64_t mtime = 0;
+    if (!get_file_stat(path, size, mtime)) {
+        return fnv1a_hash(path, hash);
+    }
+    std::pair<int64_t, int64_t> stat(size, mtime);
+    uint64_t content_hash = 0;
+    bool found            = false;
+    {
+        std::lock_guard<std::mutex> lock(file_hashes_mutex);
+        auto it = file_hashes.find(path);
+        if (it != file_hashes.end() && it->second.first == stat) {
+            content_hash = it->second.second;
+            found        = true;
+        }
+    }
+
+    std::string sidecar_path;
+    if (!found && cache_dir.size() > 0) {
+        sidecar_path = path_join(cache_dir, format("file-%016llx.hash", (unsigned long long)fnv1a_hash(path)));
+        std::ifstream sidecar(sidecar_path);
+        long long sidecar_size    = 0;
+        long long sidecar_mtime   = 0;
+        unsigned long long digest = 0;
+        if (sidecar >> sidecar_size >> sidecar_mtime >> std::hex >> digest && sidecar_size == size && sidecar_mtime == mtime) {
+            content_hash = digest;
+            found        = true;
+        }
+    }
+
+    if (!found) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            return fnv1a_hash(path, hash);
+        }
+        int64_t t0   = ggml_time_ms();
+        content_hash = 0xcbf29ce484222325ULL;
+        std::vector<char> buffer(16 * 1024 * 1024);
+        while (file) {
+            file.read(buffer.data(), buffer.size());
+            content_hash = fnv1a_hash_words(buffer.data(), (size_t)file.gcount(), content_hash);
+        }
+        int64_t t1 = ggml_time_ms();
+        LOG_INFO("hashed '%s', taking %.2fs", path.c_str(), (t1 - t0) * 1.0f / 1000);
+        if (sidecar_path.size() > 0) {
+            std::ofstream sidecar(sidecar_path, std::ios::trunc);
+            sidecar << size << " " << mtime << " " << std::hex << content_hash << std::endl;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(file_hashes_mutex);
+        file_hashes[path] = {stat, content_hash};
+    }
+    hash = fnv1a_hash(&size, sizeof(size), hash);
+    return fnv1a_hash(&content_hash, sizeof(content_hash), hash);
+}
+
+// cheap identity of a file for in-process sharing: canonical path, size and mtime, nothing is read
+uint64_t identify_file(const std::string& path, uint64_t hash) {
+    int64_t size  = 0;
+    int64_t mtime = 0;
+    hash          = fnv1a_hash(get_canonical_path(path), hash);
+    if (get_file_stat(path, size, mtime)) {
+        hash = fnv1a_hash(&size, sizeof(size), hash);
+        hash = fnv1a_hash(&mtime, sizeof(mtime), hash);
+    }
+    return hash;
+}
+
+/*=============================================== WeightStore ================================================*/
+
+// params loaded by one context, handed to the later contexts created from the same
+// files and settings instead of loading them again. The runners of the first context
+// own the params buffers and are kept alive until the last context sharing them is freed.
+struct WeightStore {
+    uint64_t key = 0;
+    std::map<std::string, ggml_tensor> tensors;  // copies of the loaded tensors, data/buffer included
+    std::vector<float> alphas_cumprod;
+    bool is_using_v_parameterization = false;
+    std::vector<std::shared_ptr<void>> owners;
+    bool retired = false;  // merged into by its last user, no longer handed out
+};
+
+static std::mutex weight_stores_mutex;
+static std::map<uint64_t, std::weak_ptr<WeightStore>> weight_stores;
+
+/*================================================= Preview =================================================*/
+
+struct SDPreviewCallback {
+    sd_preview_cb_t cb  = NULL;
+    int interval        = 1;
+    sd_preview_t method = SD_PREVIEW_PROJ;
+    void* data          = NULL;
+};
+
+static SDPreviewCallback sd_preview_cb;
+// per thread override, like the progress callback
+static thread_local SDPreviewCallback sd_thread_preview_cb;
+
+static const SDPreviewCallback& get_preview_callback() {
+    return sd_thread_preview_cb.cb != NULL ? sd_thread_preview_cb : sd_preview_cb;
+}
+
+// linear latent -> rgb approximation of the vae decoder, rgb in [-1, 1]
+struct LatentRGBProjection {
+    int channels;
+    const float* factors;  // [channels, 3]
+    float bias[3];
+};
+
+static const float sd1_latent_rgb_factors[] = {
+    0.3512f, 0.2297f, 0.3227f,
+    0.3250f, 0.4974f, 0.2350f,
+    -0.2829f, 0.1762f, 0.2721f,
+    -0.2120f, -0.2616f, -0.7177f};
+
+static const float sdxl_latent_rgb_factors[] = {
+    0.3651f, 0.4232f, 0.4341f,
+    -0.2533f, -0.0042f, 0.1068f,
+    0.1076f, 0.1111f, -0.0362f,
+    -0.3165f, -0.2492f, -0.2188f};
+
+static const float sd3_latent_rgb_factors[] = {
+    -0.0645f, 0.0177f, 0.1052f,
+    0.0028f, 0.0312f, 0.0650f,
+    0.1848f, 0.0762f, 0.0360f,
+    0.0944f, 0.0360f, 0.0889f,
+    0.0897f, 0.0506f, -0.0364f,
+    -0.0020f, 0.1203f, 0.0284f,
+    0.0855f, 0.0118f, 0.0283f,
+    -0.0539f, 0.0658f, 0.1047f,
+    -0.0057f, 0.0116f, 0.0700f,
+    -0.0412f, 0.0281f, -0.0039f,
+    0.1106f, 0.1171f, 0.1220f,
+    -0.0248f, 0.0682f, -0.0481f,
+    0.0815f, 0.0846f, 0.1207f,
+    -0.0120f, -0.0055f, -0.0867f,
+    -0.0749f, -0.0634f, -0.0456f,
+    -0.1418f, -0.1457f, -0.1259f};
+
+static const float flux_latent_rgb_factors[] = {
+    -0.0346f, 0.0244f, 0.0681f,
+    0.0034f, 0.0210f, 0.0687f,
+    0.0275f, -0.0668f, -0.0433f,
+    -0.0174f, 0.0160f, 0.0617f,
+    0.0859f, 0.0721f, 0.0329f,
+    0.0004f, 0.0383f, 0.0115f,
+    0.0405f, 0.0861f, 0.0915f,
+    -0.0236f, -0.0185f, -0.0259f,
+    -0.0245f, 0.0250f, 0.1180f,
+    0.1008f, 0.0755f, -0.0421f,
+    -0.0515f, 0.0201f, 0.0011f,
+    0.0428f, -0.0012f, -0.0036f,
+    0.0817f, 0.0765f, 0.0749f,
+    -0.1264f, -0.0522f, -0.1103f,
+    -0.0280f, -0.0881f, -0.0499f,
+    -0.1262f, -0.0982f, -0.0778f};
+
+static LatentRGBProjection get_latent_rgb_projection(SDVersion version) {
+    if (sd_version_is_flux(version)) {
+        return {16, flux_latent_rgb_factors, {-0.0329f, -0.0718f, -0.0851f}};
+    }
+    if (sd_version_is_sd3(version)) {
+        return {16, sd3_latent_rgb_factors, {0.f, 0.f, 0.f}};
+    }
+    if (version == VERSION_SDXL) {
+        return {4, sdxl_latent_rgb_factors, {0.1084f, -0.0175f, -0.0011f}};
+    }
+    return {4, sd1_latent_rgb_factors, {0.f, 0.f, 0.f}};
+}
+
 /*=============================================== StableDiffusionGGML ================================================*/
 
 class StableDiffusionGGML {
@@ -83,6 +293,9 @@ public:
     int n_threads            = -1;
     float scale_factor       = 0.18215f;
 
+    struct ggml_threadpool* threadpool      = NULL;  // persistent, shared by every cpu backend
+    struct ggml_threadpool* clip_threadpool = NULL;  // for the clip backend the conditioner runs next to t5
+
     std::shared_ptr<Conditioner> cond_stage_model;
     std::shared_ptr<FrozenCLIPVisionEmbedder> clip_vision;  // for svd
     std::shared_ptr<DiffusionModel> diffusion_model;
@@ -90,16 +303,89 @@ public:
     std::shared_ptr<TinyAutoEncoder> tae_first_stage;
     std::shared_ptr<ControlNet> control_net;
     std::shared_ptr<PhotoMakerIDEncoder> pmid_model;
+
+    // init image latent cache: source image -> vae moments (or the taesd latent), the hash only
+    // narrows the lookup and a hit is confirmed against the stored source image;
+    // the least recently used entries are evicted past latent_cache_max_bytes
+    struct LatentCacheEntry {
+        uint64_t key;
+        std::string source_tag;
+        std::vector<uint8_t> source;
+        int64_t ne[4];
+        std::vector<float> data;
+
+        size_t nbytes() const {
+            return source.size() + data.size() * sizeof(float);
+        }
+    };
+    std::list<LatentCacheEntry> latent_cache;  // most recently used first
+    size_t latent_cache_bytes     = 0;
+    size_t latent_cache_max_bytes = 256 * 1024 * 1024;  // 256 MB
     std::shared_ptr<LoraModel> pmid_lora;
     std::shared_ptr<PhotoMakerIDEmbed> pmid_id_embeds;
 
+    // PhotoMaker caches, both keyed on the content of the id images directory:
+    // the preprocessed id images (+ pmv2 id_embeds.bin), and the stacked id
+    // condition for a given prompt, a few of the most recently used of each are kept
+    struct CachedTensor {
+        ggml_type type = GGML_TYPE_F32;
+        int64_t ne[4]  = {0, 0, 0, 0};
+        std::vector<uint8_t> data;  // empty for a NULL tensor
+
+        void store(const ggml_tensor* t) {
+            data.clear();
+            if (t == NULL) {
+                return;
+            }
+            type = t->type;
+            for (int i = 0; i < 4; i++) {
+                ne[i] = t->ne[i];
+            }
+            data.resize(ggml_nbytes(t));
+            memcpy(data.data(), t->data, data.size());
+        }
+
+        ggml_tensor* restore(ggml_context* ctx) const {
+            if (data.empty()) {
+                return NULL;
+            }
+            ggml_tensor* t = ggml_new_tensor_4d(ctx, type, ne[0], ne[1], ne[2], ne[3]);
+            memcpy(t->data, data.data(), data.size());
+            return t;
+        }
+    };
+    // the key narrows the lookup, a hit also needs the same source (everything the entry was computed from)
+    struct IDImagesCacheEntry {
+        uint64_t key;
+        std::string source;
+        CachedTensor images;
+        CachedTensor id_embeds;
+    };
+    struct IDCondCacheEntry {
+        uint64_t key;
+        std::string source;
+        CachedTensor c_crossattn;
+        CachedTensor c_vector;
+        std::vector<bool> class_tokens_mask;
+    };
+    std::list<IDImagesCacheEntry> id_images_cache;  // most recently used first
+    std::list<IDCondCacheEntry> id_cond_cache;      // most recently used first
+    size_t id_cache_max_entries = 4;
+
     std::string taesd_path;
     bool use_tiny_autoencoder = false;
     bool vae_tiling           = false;
     bool stacked_id           = false;
+    int vae_frame_chunk       = 0;  // frames per video decoder chunk, 0 for all
 
     std::map<std::string, struct ggml_tensor*> tensors;
 
+    // params shared with the other contexts loaded from the same files, NULL when private,
+    // the shared tensors a LoRA is merged into are copied to lora_overlays first
+    std::shared_ptr<WeightStore> weight_store;
+    std::set<std::string> private_tensors;
+    std::vector<std::pair<ggml_context*, ggml_backend_buffer_t>> lora_overlays;
+
     std::string lora_model_dir;
     // lora_name => multiplier
     std::unordered_map<std::string, float> curr_lora_state;
@@ -120,11 +406,15 @@ public:
         if (rng_type == STD_DEFAULT_RNG) {
             rng = std::make_shared<STDDefaultRNG>();
         } else if (rng_type == CUDA_RNG) {
-            rng = std::make_shared<PhiloxRNG>();
+            rng = std::make_shared<PhiloxRNG>(0, n_threads > 0 ? n_threads : get_num_physical_cores());
         }
     }
 
     ~StableDiffusionGGML() {
+        for (auto& overlay : lora_overlays) {
+            ggml_backend_buffer_free(overlay.second);
+            ggml_free(overlay.first);
+        }
         if (clip_backend != backend) {
             ggml_backend_free(clip_backend);
         }
@@ -135,6 +425,74 @@ public:
             ggml_backend_free(vae_backend);
         }
         ggml_backend_free(backend);
+        if (threadpool != NULL) {
+            ggml_threadpool_free(threadpool);
+        }
+        if (clip_threadpool != NULL) {
+            ggml_threadpool_free(clip_threadpool);
+        }
+    }
+
+    // (re)creates the threadpool and hands it to every cpu backend of the context, a cpu backend the
+    // conditioner computes on concurrently gets a second pool sized to its share of the threads,
+    // cpumask: NULL or GGML_MAX_N_THREADS entries, all false lets the os schedule the threads
+    bool init_threadpool(const bool* cpumask, int priority, int poll, bool strict_cpu) {
+        int threads                          = n_threads > 0 ? n_threads : get_num_physical_cores();
+        struct ggml_threadpool_params params = ggml_threadpool_params_default(threads);
+        if (cpumask != NULL) {
+            memcpy(params.cpumask, cpumask, sizeof(params.cpumask));
+        }
+        params.prio       = (enum ggml_sched_priority)priority;
+        params.poll       = (uint32_t)std::max(poll, 0);
+        params.strict_cpu = strict_cpu;
+
+        struct ggml_threadpool* new_threadpool = ggml_threadpool_new(&params);
+        if (new_threadpool == NULL) {
+            LOG_ERROR("create threadpool failed");
+            return false;
+        }
+
+        int clip_threads                            = 0;
+        ggml_backend_t concurrent_backend           = cond_stage_model ? cond_stage_model->get_concurrent_cpu_backend(threads, &clip_threads) : NULL;
+        struct ggml_threadpool* new_clip_threadpool = NULL;
+        if (concurrent_backend != NULL) {
+            struct ggml_threadpool_params clip_params = params;
+            clip_params.n_threads                     = clip_threads;
+            // the main pool's first threads run t5 meanwhile, the clip threads take the cpus after them
+            int skip = threads - clip_threads;
+            for (int i = 0; i < GGML_MAX_N_THREADS && skip > 0; i++) {
+                if (clip_params.cpumask[i]) {
+                    clip_params.cpumask[i] = false;
+                    skip--;
+                }
+            }
+            if (std::find(clip_params.cpumask, clip_params.cpumask + GGML_MAX_N_THREADS, true) == clip_params.cpumask + GGML_MAX_N_THREADS) {
+                memcpy(clip_params.cpumask, params.cpumask, sizeof(params.cpumask));
+            }
+            new_clip_threadpool = ggml_threadpool_new(&clip_params);
+            if (new_clip_threadpool == NULL) {
+                LOG_ERROR("create clip threadpool failed");
+                ggml_threadpool_free(new_threadpool);
+                return false;
+            }
+            ggml_backend_cpu_set_threadpool(concurrent_backend, new_clip_threadpool);
+        }
+
+        for (ggml_backend_t b : {backend, clip_backend, control_net_backend, vae_backend}) {
+            if (b != NULL && ggml_backend_is_cpu(b)) {
+                ggml_backend_cpu_set_threadpool(b, new_threadpool);
+            }
+        }
+        if (threadpool != NULL) {
+            ggml_threadpool_free(threadpool);
+        }
+        if (clip_threadpool != NULL) {
+            ggml_threadpool_free(clip_threadpool);
+        }
+        threadpool      = new_threadpool;
+        clip_threadpool = new_clip_threadpool;
+        LOG_INFO("threadpool: %d threads, priority %d, poll %d%s", threads, priority, poll, strict_cpu ? ", strict cpu placement" : "");
+        return true;
     }
 
     bool load_from_file(const std::string& model_path,
@@ -149,6 +507,8 @@ public:
                         const std::string& taesd_path,
                         bool vae_tiling_,
                         ggml_type wtype,
+                        const std::string& tensor_type_rules,
+                        const std::string& snapshot_dir,
                         schedule_t schedule,
                         bool clip_on_cpu,
                         bool control_net_cpu,
@@ -184,52 +544,112 @@ public:
         }
 
         ModelLoader model_loader;
+        if (!model_loader.set_tensor_type_rules(tensor_type_rules)) {
+            return false;
+        }
+        // the rules as parsed, so an edited rules file changes the keys below
+        std::string tensor_type_recipe = model_loader.get_tensor_type_recipe();
 
         vae_tiling = vae_tiling_;
 
-        if (model_path.size() > 0) {
-            LOG_INFO("loading model from '%s'", model_path.c_str());
-            if (!model_loader.init_from_file(model_path)) {
-                LOG_ERROR("init model loader from file failed: '%s'", model_path.c_str());
+        // a snapshot holds every tensor already converted, so it replaces all the source files
+        std::string snapshot_path;
+        bool from_snapshot = false;
+        SnapshotMetadata snapshot_meta;
+        if (snapshot_dir.size() > 0) {
+            uint64_t key = fnv1a_hash("sd-snapshot-v3");
+            for (const std::string& path : {model_path, clip_l_path, clip_g_path, t5xxl_path,
+                                            diffusion_model_path, vae_path, id_embeddings_path}) {
+                key = path.size() > 0 ? fingerprint_file(path, key, snapshot_dir) : fnv1a_hash("-", key);
             }
+            key = fnv1a_hash(&wtype, sizeof(wtype), key);
+            key = fnv1a_hash(tensor_type_recipe, key);
+            key = fnv1a_hash(format("%d%d", vae_decode_only, use_tiny_autoencoder), key);
+
+            snapshot_path = path_join(snapshot_dir, format("sd-%016llx.gguf", (unsigned long long)key));
         }
 
-        if (clip_l_path.size() > 0) {
-            LOG_INFO("loading clip_l from '%s'", clip_l_path.c_str());
-            if (!model_loader.init_from_file(clip_l_path, "text_encoders.clip_l.transformer.")) {
-                LOG_WARN("loading clip_l from '%s' failed", clip_l_path.c_str());
+        // contexts that keep their params loaded share them when everything that
+        // decides their content and placement matches, the files are only stat'ed here
+        uint64_t weights_key = 0;
+        if (!free_params_immediately) {
+            weights_key = fnv1a_hash("sd-weights-v2");
+            for (const std::string& path : {model_path, clip_l_path, clip_g_path, t5xxl_path,
+                                            diffusion_model_path, vae_path, id_embeddings_path, embeddings_path}) {
+                weights_key = path.size() > 0 ? identify_file(path, weights_key) : fnv1a_hash("-", weights_key);
+            }
+            weights_key = fnv1a_hash(&wtype, sizeof(wtype), weights_key);
+            weights_key = fnv1a_hash(tensor_type_recipe, weights_key);
+            weights_key = fnv1a_hash(ggml_backend_name(backend), weights_key);
+            weights_key = fnv1a_hash(format("%d%d%d%d", vae_decode_only, use_tiny_autoencoder, clip_on_cpu, vae_on_cpu), weights_key);
+
+            std::lock_guard<std::mutex> lock(weight_stores_mutex);
+            auto it = weight_stores.find(weights_key);
+            if (it != weight_stores.end()) {
+                weight_store = it->second.lock();
+            }
+            if (weight_store != NULL && weight_store->retired) {
+                weight_store = NULL;
             }
         }
 
-        if (clip_g_path.size() > 0) {
-            LOG_INFO("loading clip_g from '%s'", clip_g_path.c_str());
-            if (!model_loader.init_from_file(clip_g_path, "text_encoders.clip_g.transformer.")) {
-                LOG_WARN("loading clip_g from '%s' failed", clip_g_path.c_str());
+        if (snapshot_path.size() > 0 && weight_store == NULL) {
+            if (file_exists(snapshot_path)) {
+                LOG_INFO("loading prepared model snapshot from '%s'", snapshot_path.c_str());
+                from_snapshot = load_snapshot_metadata(snapshot_path, snapshot_meta) && model_loader.init_from_file(snapshot_path);
+                if (!from_snapshot) {
+                    LOG_WARN("loading snapshot '%s' failed, loading from the model files", snapshot_path.c_str());
+                    model_loader = ModelLoader();
+                    model_loader.set_tensor_type_rules(tensor_type_rules);
+                }
             }
         }
 
-        if (t5xxl_path.size() > 0) {
-            LOG_INFO("loading t5xxl from '%s'", t5xxl_path.c_str());
-            if (!model_loader.init_from_file(t5xxl_path, "text_encoders.t5xxl.transformer.")) {
-                LOG_WARN("loading t5xxl from '%s' failed", t5xxl_path.c_str());
+        if (!from_snapshot) {
+            if (model_path.size() > 0) {
+                LOG_INFO("loading model from '%s'", model_path.c_str());
+                if (!model_loader.init_from_file(model_path)) {
+                    LOG_ERROR("init model loader from file failed: '%s'", model_path.c_str());
+                }
             }
-        }
 
-        if (diffusion_model_path.size() > 0) {
-            LOG_INFO("loading diffusion model from '%s'", diffusion_model_path.c_str());
-            if (!model_loader.init_from_file(diffusion_model_path, "model.diffusion_model.")) {
-                LOG_WARN("loading diffusion model from '%s' failed", diffusion_model_path.c_str());
+            if (clip_l_path.size() > 0) {
+                LOG_INFO("loading clip_l from '%s'", clip_l_path.c_str());
+                if (!model_loader.init_from_file(clip_l_path, "text_encoders.clip_l.transformer.")) {
+                    LOG_WARN("loading clip_l from '%s' failed", clip_l_path.c_str());
+                }
             }
-        }
 
-        if (vae_path.size() > 0) {
-            LOG_INFO("loading vae from '%s'", vae_path.c_str());
-            if (!model_loader.init_from_file(vae_path, "vae.")) {
-                LOG_WARN("loading vae from '%s' failed", vae_path.c_str());
+            if (clip_g_path.size() > 0) {
+                LOG_INFO("loading clip_g from '%s'", clip_g_path.c_str());
+                if (!model_loader.init_from_file(clip_g_path, "text_encoders.clip_g.transformer.")) {
+                    LOG_WARN("loading clip_g from '%s' failed", clip_g_path.c_str());
+                }
+            }
+
+            if (t5xxl_path.size() > 0) {
+                LOG_INFO("loading t5xxl from '%s'", t5xxl_path.c_str());
+                if (!model_loader.init_from_file(t5xxl_path, "text_encoders.t5xxl.transformer.")) {
+                    LOG_WARN("loading t5xxl from '%s' failed", t5xxl_path.c_str());
+                }
+            }
+
+            if (diffusion_model_path.size() > 0) {
+                LOG_INFO("loading diffusion model from '%s'", diffusion_model_path.c_str());
+                if (!model_loader.init_from_file(diffusion_model_path, "model.diffusion_model.")) {
+                    LOG_WARN("loading diffusion model from '%s' failed", diffusion_model_path.c_str());
+                }
+            }
+
+            if (vae_path.size() > 0) {
+                LOG_INFO("loading vae from '%s'", vae_path.c_str());
+                if (!model_loader.init_from_file(vae_path, "vae.")) {
+                    LOG_WARN("loading vae from '%s' failed", vae_path.c_str());
+                }
             }
         }
 
-        version = model_loader.get_sd_version();
+        version = from_snapshot ? snapshot_meta.version : model_loader.get_sd_version();
         if (version == VERSION_COUNT) {
             LOG_ERROR("get sd version from file failed: '%s'", model_path.c_str());
             return false;
@@ -255,6 +675,9 @@ public:
             if (vae_wtype == GGML_TYPE_COUNT) {
                 vae_wtype = wtype;
             }
+            if (tensor_type_rules.size() > 0) {
+                model_loader.set_wtype_override(wtype);
+            }
         } else {
             model_wtype           = wtype;
             conditioner_wtype     = wtype;
@@ -293,16 +716,13 @@ public:
 
         if (version == VERSION_SVD) {
             clip_vision = std::make_shared<FrozenCLIPVisionEmbedder>(backend, model_loader.tensor_storages_types);
-            clip_vision->alloc_params_buffer();
             clip_vision->get_param_tensors(tensors);
 
             diffusion_model = std::make_shared<UNetModel>(backend, model_loader.tensor_storages_types, version);
-            diffusion_model->alloc_params_buffer();
             diffusion_model->get_param_tensors(tensors);
 
             first_stage_model = std::make_shared<AutoEncoderKL>(backend, model_loader.tensor_storages_types, "first_stage_model", vae_decode_only, true, version);
             LOG_DEBUG("vae_decode_only %d", vae_decode_only);
-            first_stage_model->alloc_params_buffer();
             first_stage_model->get_param_tensors(tensors, "first_stage_model");
         } else {
             clip_backend   = backend;
@@ -339,10 +759,7 @@ public:
                 diffusion_model = std::make_shared<UNetModel>(backend, model_loader.tensor_storages_types, version, diffusion_flash_attn);
             }
 
-            cond_stage_model->alloc_params_buffer();
             cond_stage_model->get_param_tensors(tensors);
-
-            diffusion_model->alloc_params_buffer();
             diffusion_model->get_param_tensors(tensors);
 
             if (!use_tiny_autoencoder) {
@@ -353,7 +770,6 @@ public:
                     vae_backend = backend;
                 }
                 first_stage_model = std::make_shared<AutoEncoderKL>(vae_backend, model_loader.tensor_storages_types, "first_stage_model", vae_decode_only, false, version);
-                first_stage_model->alloc_params_buffer();
                 first_stage_model->get_param_tensors(tensors, "first_stage_model");
             } else {
                 tae_first_stage = std::make_shared<TinyAutoEncoder>(backend, model_loader.tensor_storages_types, "decoder.layers", vae_decode_only);
@@ -368,7 +784,8 @@ public:
                 } else {
                     controlnet_backend = backend;
                 }
-                control_net = std::make_shared<ControlNet>(controlnet_backend, model_loader.tensor_storages_types, version);
+                control_net_backend = controlnet_backend;
+                control_net         = std::make_shared<ControlNet>(controlnet_backend, model_loader.tensor_storages_types, version);
             }
 
             if (id_embeddings_path.find("v2") != std::string::npos) {
@@ -384,17 +801,16 @@ public:
                     return false;
                 }
                 LOG_INFO("loading stacked ID embedding (PHOTOMAKER) model file from '%s'", id_embeddings_path.c_str());
-                if (!model_loader.init_from_file(id_embeddings_path, "pmid.")) {
+                if (from_snapshot) {
+                    // the snapshot only holds the pmid tensors when they loaded back then
+                    stacked_id = snapshot_meta.stacked_id;
+                } else if (!model_loader.init_from_file(id_embeddings_path, "pmid.")) {
                     LOG_WARN("loading stacked ID embedding from '%s' failed", id_embeddings_path.c_str());
                 } else {
                     stacked_id = true;
                 }
             }
             if (stacked_id) {
-                if (!pmid_model->alloc_params_buffer()) {
-                    LOG_ERROR(" pmid model params buffer allocation failed");
-                    return false;
-                }
                 pmid_model->get_param_tensors(tensors, "pmid");
             }
         }
@@ -430,7 +846,31 @@ public:
         if (version == VERSION_SVD) {
             ignore_tensors.insert("conditioner.embedders.3");
         }
-        bool success = model_loader.load_tensors(tensors, backend, ignore_tensors);
+        if (weight_store != NULL && !attach_weight_store(alphas_cumprod_tensor)) {
+            LOG_WARN("the shared weights do not match the model, loading a private copy");
+            weight_store = NULL;
+        }
+        bool success = true;
+        if (weight_store != NULL) {
+            LOG_INFO("sharing the weights loaded by another context");
+        } else {
+            if (clip_vision) {
+                clip_vision->alloc_params_buffer();
+            }
+            if (cond_stage_model) {
+                cond_stage_model->alloc_params_buffer();
+            }
+            diffusion_model->alloc_params_buffer();
+            if (first_stage_model) {
+                first_stage_model->alloc_params_buffer();
+            }
+            if (stacked_id && !pmid_model->alloc_params_buffer()) {
+                LOG_ERROR(" pmid model params buffer allocation failed");
+                ggml_free(ctx);
+                return false;
+            }
+            success = model_loader.load_tensors(tensors, backend, ignore_tensors);
+        }
         if (!success) {
             LOG_ERROR("load tensors from model loader failed");
             ggml_free(ctx);
@@ -517,7 +957,12 @@ public:
 
         // check is_using_v_parameterization_for_sd2
         bool is_using_v_parameterization = false;
-        if (version == VERSION_SD2) {
+        if (weight_store != NULL) {
+            is_using_v_parameterization = weight_store->is_using_v_parameterization;
+        } else if (from_snapshot) {
+            is_using_v_parameterization = snapshot_meta.v_prediction;
+            scale_factor                = snapshot_meta.scale_factor;
+        } else if (version == VERSION_SD2) {
             if (is_using_v_parameterization_for_sd2(ctx)) {
                 is_using_v_parameterization = true;
             }
@@ -587,11 +1032,217 @@ public:
             }
         }
 
+        if (snapshot_path.size() > 0 && !from_snapshot && weight_store == NULL) {
+            save_snapshot(snapshot_path);
+        }
+
+        if (weights_key != 0 && weight_store == NULL) {
+            register_weight_store(weights_key, alphas_cumprod_tensor, is_using_v_parameterization);
+        }
+
         LOG_DEBUG("finished loaded file");
         ggml_free(ctx);
         return true;
     }
 
+    // points the params tensors at the buffers of the shared store, every tensor has to match
+    bool attach_weight_store(ggml_tensor* alphas_cumprod_tensor) {
+        for (auto& pair : tensors) {
+            if (pair.first == "alphas_cumprod") {
+                continue;
+            }
+            auto it = weight_store->tensors.find(pair.first);
+            if (it == weight_store->tensors.end() || it->second.type != pair.second->type ||
+                !ggml_are_same_shape(&it->second, pair.second)) {
+                LOG_DEBUG("shared weights: tensor '%s' not found or mismatched", pair.first.c_str());
+                return false;
+            }
+        }
+        for (auto& pair : tensors) {
+            if (pair.first == "alphas_cumprod") {
+                continue;
+            }
+            const ggml_tensor& shared = weight_store->tensors[pair.first];
+            pair.second->data         = shared.data;
+            pair.second->buffer       = shared.buffer;
+        }
+        memcpy(alphas_cumprod_tensor->data, weight_store->alphas_cumprod.data(), ggml_nbytes(alphas_cumprod_tensor));
+        return true;
+    }
+
+    void register_weight_store(uint64_t key, ggml_tensor* alphas_cumprod_tensor, bool is_using_v_parameterization) {
+        auto store = std::make_shared<WeightStore>();
+        store->key = key;
+        for (auto& pair : tensors) {
+            if (pair.first != "alphas_cumprod" && pair.second->data != NULL) {
+                store->tensors[pair.first] = *pair.second;
+            }
+        }
+        float* alphas_cumprod              = (float*)alphas_cumprod_tensor->data;
+        store->alphas_cumprod              = std::vector<float>(alphas_cumprod, alphas_cumprod + TIMESTEPS);
+        store->is_using_v_parameterization = is_using_v_parameterization;
+        store->owners                      = {cond_stage_model, clip_vision, diffusion_model, first_stage_model};
+        if (stacked_id) {
+            store->owners.push_back(pmid_model);
+        }
+
+        std::lock_guard<std::mutex> lock(weight_stores_mutex);
+        weight_stores[key] = store;
+        weight_store       = store;
+    }
+
+    // called before merging a LoRA into names, the shared ones get a private copy
+    // unless this context is the last one using the store
+    bool make_tensors_private(const std::set<std::string>& names) {
+        if (weight_store == NULL) {
+            return true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(weight_stores_mutex);
+            if (weight_store->retired) {
+                return true;
+            }
+            if (weight_store.use_count() == 1) {
+                weight_store->retired = true;
+                auto it               = weight_stores.find(weight_store->key);
+                if (it != weight_stores.end() && it->second.lock() == weight_store) {
+                    weight_stores.erase(it);
+                }
+                return true;
+            }
+        }
+
+        std::map<ggml_backend_buffer_type_t, std::vector<std::string>> groups;
+        for (const std::string& name : names) {
+            auto it = tensors.find(name);
+            if (it == tensors.end() || it->second->buffer == NULL || private_tensors.count(name) > 0) {
+                continue;
+            }
+            groups[ggml_backend_buffer_get_type(it->second->buffer)].push_back(name);
+        }
+        for (auto& group : groups) {
+            ggml_context* overlay_ctx = ggml_init({group.second.size() * ggml_tensor_overhead(), NULL, true});
+            std::vector<ggml_tensor*> copies;
+            for (const std::string& name : group.second) {
+                copies.push_back(ggml_dup_tensor(overlay_ctx, tensors[name]));
+            }
+            ggml_backend_buffer_t buffer = ggml_backend_alloc_ctx_tensors_from_buft(overlay_ctx, group.first);
+            if (buffer == NULL) {
+                LOG_ERROR("alloc private copy of the shared weights failed");
+                ggml_free(overlay_ctx);
+                return false;
+            }
+            for (size_t i = 0; i < copies.size(); i++) {
+                ggml_tensor* tensor = tensors[group.second[i]];
+                ggml_backend_tensor_copy(tensor, copies[i]);
+                tensor->data   = copies[i]->data;
+                tensor->buffer = copies[i]->buffer;
+                private_tensors.insert(group.second[i]);
+            }
+            lora_overlays.push_back({overlay_ctx, buffer});
+            LOG_DEBUG("copied %d shared tensors (%.2fMB) for the LoRAs of this context",
+                      (int)copies.size(), ggml_backend_buffer_get_size(buffer) / 1024.0 / 1024.0);
+        }
+        return true;
+    }
+
+    std::string get_denoiser_name() {
+        if (std::dynamic_pointer_cast<FluxFlowDenoiser>(denoiser)) {
+            return "flux_flow";
+        } else if (std::dynamic_pointer_cast<DiscreteFlowDenoiser>(denoiser)) {
+            return "flow";
+        } else if (std::dynamic_pointer_cast<CompVisVDenoiser>(denoiser)) {
+            return "v";
+        }
+        return "eps";
+    }
+
+    // what a snapshot records next to the tensors
+    struct SnapshotMetadata {
+        SDVersion version  = VERSION_COUNT;
+        bool v_prediction  = false;
+        bool stacked_id    = false;
+        float scale_factor = 0.18215f;
+    };
+
+    // returns false when the snapshot can not be read or misses a key
+    bool load_snapshot_metadata(const std::string& path, SnapshotMetadata& meta) {
+        gguf_context* gguf_ctx = gguf_init_from_file(path.c_str(), {true, NULL});
+        if (gguf_ctx == NULL) {
+            return false;
+        }
+        int64_t version_key    = gguf_find_key(gguf_ctx, "sd.version");
+        int64_t denoiser_key   = gguf_find_key(gguf_ctx, "sd.denoiser");
+        int64_t scale_key      = gguf_find_key(gguf_ctx, "sd.scale_factor");
+        int64_t stacked_id_key = gguf_find_key(gguf_ctx, "sd.stacked_id");
+        bool success           = version_key >= 0 && denoiser_key >= 0 && scale_key >= 0 && stacked_id_key >= 0;
+        if (success) {
+            int32_t snapshot_version = gguf_get_val_i32(gguf_ctx, version_key);
+            meta.version             = snapshot_version >= 0 && snapshot_version < VERSION_COUNT ? (SDVersion)snapshot_version : VERSION_COUNT;
+            meta.v_prediction        = std::string(gguf_get_val_str(gguf_ctx, denoiser_key)) == "v";
+            meta.scale_factor        = gguf_get_val_f32(gguf_ctx, scale_key);
+            meta.stacked_id          = gguf_get_val_bool(gguf_ctx, stacked_id_key);
+            success                  = meta.version != VERSION_COUNT;
+        }
+        gguf_free(gguf_ctx);
+        return success;
+    }
+
+    // writes the loaded (converted) params, so the next start can skip every load-time transform
+    bool save_snapshot(const std::string& path) {
+        int64_t t0 = ggml_time_ms();
+
+        ggml_context* meta_ctx = ggml_init({(tensors.size() + 1) * ggml_tensor_overhead(), NULL, true});
+        gguf_context* gguf_ctx = gguf_init_empty();
+        gguf_set_i32(gguf_ctx, "sd.version", (int32_t)version);
+        gguf_set_str(gguf_ctx, "sd.denoiser", get_denoiser_name().c_str());
+        gguf_set_f32(gguf_ctx, "sd.scale_factor", scale_factor);
+        gguf_set_bool(gguf_ctx, "sd.stacked_id", stacked_id);
+
+        std::vector<std::pair<ggml_tensor*, ggml_tensor*>> pairs;  // (params tensor, meta tensor)
+        for (auto& pair : tensors) {
+            ggml_tensor* tensor = pair.second;
+            if (pair.first == "alphas_cumprod" || tensor->data == NULL) {
+                continue;
+            }
+            ggml_tensor* meta = ggml_dup_tensor(meta_ctx, tensor);
+            ggml_set_name(meta, pair.first.c_str());
+            gguf_add_tensor(gguf_ctx, meta);
+            pairs.push_back({tensor, meta});
+        }
+
+        // write to a temporary file first, a half written snapshot must never be picked up
+        std::string tmp_path = path + ".tmp";
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        bool success = file.is_open();
+        if (success) {
+            std::vector<uint8_t> buffer(gguf_get_meta_size(gguf_ctx));
+            gguf_get_meta_data(gguf_ctx, buffer.data());
+            file.write((const char*)buffer.data(), buffer.size());
+
+            size_t alignment = gguf_get_alignment(gguf_ctx);
+            for (auto& pair : pairs) {
+                size_t nbytes = ggml_nbytes(pair.first);
+                buffer.assign(GGML_PAD(nbytes, alignment), 0);
+                ggml_backend_tensor_get(pair.first, buffer.data(), 0, nbytes);
+                file.write((const char*)buffer.data(), buffer.size());
+            }
+            file.close();
+            success = !file.fail();
+        }
+        ggml_free(meta_ctx);
+        gguf_free(gguf_ctx);
+
+        if (!success || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            LOG_WARN("save model snapshot to '%s' failed", path.c_str());
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+        int64_t t1 = ggml_time_ms();
+        LOG_INFO("saved model snapshot to '%s', taking %.2fs", path.c_str(), (t1 - t0) * 1.0f / 1000);
+        return true;
+    }
+
     bool is_using_v_parameterization_for_sd2(ggml_context* work_ctx) {
         struct ggml_tensor* x_t = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, 8, 8, 4, 1);
         ggml_set_f32(x_t, 0.5);
@@ -641,6 +1292,9 @@ public:
             return;
         }
 
+        if (!make_tensors_private(lora.get_target_tensors(tensors))) {
+            return;
+        }
         lora.multiplier = multiplier;
         lora.apply(tensors, n_threads);
         lora.free_params_buffer();
@@ -784,7 +1438,18 @@ public:
                         std::vector<int> skip_layers = {},
                         float slg_scale              = 0,
                         float skip_layer_start       = 0.01,
-                        float skip_layer_end         = 0.2) {
+                        float skip_layer_end         = 0.2,
+                        float adaptive_rtol          = 0.05f,
+                        float adaptive_atol          = 0.0078f,
+                        float cfg_sigma_min          = 0.f,
+                        float cfg_sigma_max          = INFINITY,
+                        int cfg_every                = 1,
+                        int diffusion_tile_size      = 0,
+                        float diffusion_tile_overlap = 0.25f,
+                        int diffusion_tile_batch     = 1,
+                        float control_start          = 0.f,
+                        float control_end            = 1.f,
+                        bool control_share_uncond    = false) {
         size_t steps = sigmas.size() - 1;
         // noise = load_tensor_from_file(work_ctx, "./rand0.bin");
         // print_ggml_tensor(noise);
@@ -802,8 +1467,19 @@ public:
         struct ggml_tensor* out_uncond = NULL;
         struct ggml_tensor* out_skip   = NULL;
 
+        // cfg interval: the uncond pass only runs while sigma is in [cfg_sigma_min, cfg_sigma_max],
+        // and only every cfg_every sampler steps in there, reusing the last (cond - uncond) delta in between
+        struct ggml_tensor* cfg_delta = NULL;
+        bool has_cfg_delta            = false;
+        int cfg_first_step            = -1;
+        int uncond_skipped            = 0;
+        cfg_every                     = std::max(cfg_every, 1);
+
         if (has_unconditioned) {
             out_uncond = ggml_dup_tensor(work_ctx, x);
+            if (cfg_every > 1) {
+                cfg_delta = ggml_dup_tensor(work_ctx, x);
+            }
         }
         if (has_skiplayer) {
             if (sd_version_is_dit(version)) {
@@ -815,7 +1491,262 @@ public:
         }
         struct ggml_tensor* denoised = ggml_dup_tensor(work_ctx, x);
 
+        // tiled diffusion (MultiDiffusion): the model runs on overlapping latent windows of diffusion_tile_size pixels,
+        // diffusion_tile_batch of them per forward, and the window outputs are blended with feathered weights
+        int W      = (int)x->ne[0];
+        int H      = (int)x->ne[1];
+        bool tiled = diffusion_tile_size > 0 && (W * 8 > diffusion_tile_size || H * 8 > diffusion_tile_size);
+        if (tiled && (control_hint != NULL || x->ne[3] != 1)) {
+            LOG_WARN("tiled diffusion does not support control net and video models, running untiled");
+            tiled = false;
+        }
+        int tile_w     = 0;
+        int tile_h     = 0;
+        int tile_batch = 1;
+        int overlap    = 0;
+        std::vector<std::pair<int, int>> tiles;
+        std::vector<float> tile_weight_sum;
+        std::map<const ggml_tensor*, ggml_tensor*> batched_conds;
+        struct ggml_context* tiles_ctx     = NULL;
+        struct ggml_tensor* tile_input     = NULL;
+        struct ggml_tensor* tile_output    = NULL;
+        struct ggml_tensor* tile_concat    = NULL;
+        struct ggml_tensor* tile_timesteps = NULL;
+        struct ggml_tensor* tile_guidance  = NULL;
+
+        auto tile_weight = [&](int tx, int ty, int ix, int iy) -> float {
+            float wx = 1.f;
+            float wy = 1.f;
+            if (tx > 0) {
+                wx = std::min(wx, (ix + 1.f) / (overlap + 1.f));
+            }
+            if (tx + tile_w < W) {
+                wx = std::min(wx, (tile_w - ix) / (overlap + 1.f));
+            }
+            if (ty > 0) {
+                wy = std::min(wy, (iy + 1.f) / (overlap + 1.f));
+            }
+            if (ty + tile_h < H) {
+                wy = std::min(wy, (tile_h - iy) / (overlap + 1.f));
+            }
+            return wx * wy;
+        };
+
+        if (tiled) {
+            // windows are kept a multiple of 8 latent pixels for the unet down sampling
+            int tile_size = std::max(diffusion_tile_size / 64 * 8, 8);
+            tile_w        = std::min(W, tile_size);
+            tile_h        = std::min(H, tile_size);
+            overlap       = (int)(std::min(tile_w, tile_h) * std::min(std::max(diffusion_tile_overlap, 0.f), 0.5f));
+
+            auto positions = [&](int size, int tile) {
+                std::vector<int> pos;
+                int stride = std::max(tile - overlap, 1);
+                for (int p = 0;; p += stride) {
+                    if (p + tile >= size) {
+                        pos.push_back(size - tile);
+                        break;
+                    }
+                    pos.push_back(p);
+                }
+                return pos;
+            };
+            for (int ty : positions(H, tile_h)) {
+                for (int tx : positions(W, tile_w)) {
+                    tiles.push_back({tx, ty});
+                }
+            }
+            tile_batch = std::max(1, std::min(diffusion_tile_batch, (int)tiles.size()));
+
+            tile_weight_sum.assign((size_t)W * H, 0.f);
+            for (auto& tile : tiles) {
+                for (int iy = 0; iy < tile_h; iy++) {
+                    for (int ix = 0; ix < tile_w; ix++) {
+                        tile_weight_sum[(size_t)(tile.second + iy) * W + tile.first + ix] += tile_weight(tile.first, tile.second, ix, iy);
+                    }
+                }
+            }
+
+            bool spatial_concat = cond.c_concat != NULL && cond.c_concat->ne[0] == W && cond.c_concat->ne[1] == H;
+
+            struct ggml_init_params params;
+            params.mem_size = 2 * (size_t)tile_w * tile_h * x->ne[2] * tile_batch * sizeof(float);  // input and output windows
+            if (spatial_concat) {
+                params.mem_size += (size_t)tile_w * tile_h * cond.c_concat->ne[2] * tile_batch * sizeof(float);
+            }
+            if (tile_batch > 1) {
+                // conditions repeated along the batch dimension
+                for (const SDCondition* c : {&cond, &uncond, &id_cond}) {
+                    for (ggml_tensor* t : {c->c_crossattn, c->c_vector, spatial_concat ? NULL : c->c_concat}) {
+                        if (t != NULL) {
+                            params.mem_size += ggml_nbytes(t) * tile_batch + GGML_MEM_ALIGN;
+                        }
+                    }
+                }
+            }
+            params.mem_size += 2 * tile_batch * sizeof(float) + 16 * (ggml_tensor_overhead() + GGML_MEM_ALIGN);
+            params.mem_buffer = NULL;
+            params.no_alloc   = false;
+            tiles_ctx         = ggml_init(params);
+            if (!tiles_ctx) {
+                LOG_ERROR("ggml_init() failed");
+                return NULL;
+            }
+
+            tile_input     = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_w, tile_h, x->ne[2], tile_batch);
+            tile_output    = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_w, tile_h, x->ne[2], tile_batch);
+            tile_timesteps = ggml_new_tensor_1d(tiles_ctx, GGML_TYPE_F32, tile_batch);
+            tile_guidance  = ggml_new_tensor_1d(tiles_ctx, GGML_TYPE_F32, tile_batch);
+            if (spatial_concat) {
+                tile_concat = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_w, tile_h, cond.c_concat->ne[2], tile_batch);
+            }
+            LOG_INFO("tiled diffusion: %zu windows of %dx%d, %d per forward", tiles.size(), tile_w * 8, tile_h * 8, tile_batch);
+        }
+
+        // repeats a condition along its batch dimension for batched windows:
+        // ne[2] for c_crossattn [C, T, N], ne[1] for c_vector [C, N], ne[3] for c_concat [W, H, C, N]
+        auto batch_cond = [&](ggml_tensor* t, int dim) -> ggml_tensor* {
+            if (t == NULL || tile_batch == 1) {
+                return t;
+            }
+            auto it = batched_conds.find(t);
+            if (it != batched_conds.end()) {
+                return it->second;
+            }
+            GGML_ASSERT(ggml_is_contiguous(t));
+            for (int d = dim; d < GGML_MAX_DIMS; d++) {
+                GGML_ASSERT(t->ne[d] == 1);
+            }
+            int64_t ne[GGML_MAX_DIMS] = {t->ne[0], t->ne[1], t->ne[2], t->ne[3]};
+            ne[dim]                   = tile_batch;
+            ggml_tensor* result       = ggml_new_tensor(tiles_ctx, t->type, GGML_MAX_DIMS, ne);
+            for (int b = 0; b < tile_batch; b++) {
+                memcpy((char*)result->data + b * ggml_nbytes(t), t->data, ggml_nbytes(t));
+            }
+            batched_conds[t] = result;
+            return result;
+        };
+
+        auto diffusion_compute = [&](ggml_tensor* input,
+                                     float t,
+                                     ggml_tensor* timesteps,
+                                     ggml_tensor* guidance_tensor,
+                                     const SDCondition& c,
+                                     const std::vector<struct ggml_tensor*>& controls,
+                                     ggml_tensor** output,
+                                     const std::vector<int>& skip = std::vector<int>()) {
+            if (!tiled) {
+                diffusion_model->compute(n_threads,
+                                         input,
+                                         timesteps,
+                                         c.c_crossattn,
+                                         c.c_concat,
+                                         c.c_vector,
+                                         guidance_tensor,
+                                         -1,
+                                         controls,
+                                         control_strength,
+                                         output,
+                                         NULL,
+                                         skip);
+                return;
+            }
+
+            ggml_set_f32(tile_timesteps, t);
+            ggml_set_f32(tile_guidance, guidance);
+            ggml_tensor* c_crossattn = batch_cond(c.c_crossattn, 2);
+            ggml_tensor* c_vector    = batch_cond(c.c_vector, 1);
+            ggml_tensor* c_concat    = c.c_concat != NULL && tile_concat != NULL ? tile_concat : batch_cond(c.c_concat, 3);
+
+            float* vec_output = (float*)(*output)->data;
+            float* vec_tile   = (float*)tile_output->data;
+            int64_t channels  = input->ne[2];
+            memset(vec_output, 0, ggml_nbytes(*output));
+            for (size_t i = 0; i < tiles.size(); i += tile_batch) {
+                // the last batch is padded with the last window
+                for (int b = 0; b < tile_batch; b++) {
+                    auto tile = tiles[std::min(i + b, tiles.size() - 1)];
+                    for (int k = 0; k < channels; k++) {
+                        for (int iy = 0; iy < tile_h; iy++) {
+                            for (int ix = 0; ix < tile_w; ix++) {
+                                ggml_tensor_set_f32(tile_input, ggml_tensor_get_f32(input, tile.first + ix, tile.second + iy, k), ix, iy, k, b);
+                            }
+                        }
+                    }
+                    if (c_concat == tile_concat && tile_concat != NULL) {
+                        for (int k = 0; k < tile_concat->ne[2]; k++) {
+                            for (int iy = 0; iy < tile_h; iy++) {
+                                for (int ix = 0; ix < tile_w; ix++) {
+                                    ggml_tensor_set_f32(tile_concat, ggml_tensor_get_f32(c.c_concat, tile.first + ix, tile.second + iy, k), ix, iy, k, b);
+                                }
+                            }
+                        }
+                    }
+                }
+                diffusion_model->compute(n_threads,
+                                         tile_input,
+                                         tile_timesteps,
+                                         c_crossattn,
+                                         c_concat,
+                                         c_vector,
+                                         guidance_tensor != NULL ? tile_guidance : NULL,
+                                         -1,
+                                         {},
+                                         0.f,
+                                         &tile_output,
+                                         NULL,
+                                         skip);
+                for (int b = 0; b < tile_batch && i + b < tiles.size(); b++) {
+                    auto tile = tiles[i + b];
+                    for (int k = 0; k < channels; k++) {
+                        for (int iy = 0; iy < tile_h; iy++) {
+                            for (int ix = 0; ix < tile_w; ix++) {
+                                size_t dst = ((size_t)k * H + tile.second + iy) * W + tile.first + ix;
+                                size_t src = (((size_t)b * channels + k) * tile_h + iy) * tile_w + ix;
+                                vec_output[dst] += vec_tile[src] * tile_weight(tile.first, tile.second, ix, iy);
+                            }
+                        }
+                    }
+                }
+            }
+            for (int k = 0; k < channels; k++) {
+                for (size_t j = 0; j < (size_t)W * H; j++) {
+                    vec_output[k * (size_t)W * H + j] /= tile_weight_sum[j];
+                }
+            }
+        };
+
+        const SDPreviewCallback preview = get_preview_callback();
+        int last_preview_step           = 0;
+        bool aborted                    = false;
+
+        // the sampling progress in [0, 1] the control net, slg and photomaker windows are measured in;
+        // the adaptive sampler numbers its calls by accepted steps out of an nfe budget,
+        // so there it comes from sigma between the first and the last non zero one
+        bool adaptive       = method == DPM_ADAPTIVE;
+        float log_sigma_max = std::log(sigmas[0]);
+        float log_sigma_min = log_sigma_max;
+        for (float s : sigmas) {
+            if (s > 0) {
+                log_sigma_min = std::log(s);
+            }
+        }
+        auto get_progress = [&](float sigma, int step) -> float {
+            if (adaptive) {
+                if (log_sigma_max <= log_sigma_min) {
+                    return 1.f;
+                }
+                float progress = (log_sigma_max - std::log(sigma)) / (log_sigma_max - log_sigma_min);
+                return std::min(std::max(progress, 0.f), 1.f);
+            }
+            return steps > 0 ? std::max(std::abs(step) - 1, 0) * 1.0f / steps : 0.f;
+        };
+
         auto denoise = [&](ggml_tensor* input, float sigma, int step) -> ggml_tensor* {
+            if (aborted) {
+                // the remaining steps only do the sampler arithmetic
+                return denoised;
+            }
             if (step == 1) {
                 pretty_progress(0, (int)steps, 0);
             }
@@ -839,89 +1770,79 @@ public:
 
             std::vector<struct ggml_tensor*> controls;
 
-            if (control_hint != NULL) {
+            // control net only runs while the sampling progress is in [control_start, control_end]
+            float progress       = get_progress(sigma, step);
+            bool is_control_step = control_hint != NULL && progress >= control_start && progress <= control_end;
+            if (is_control_step) {
                 control_net->compute(n_threads, noised_input, control_hint, timesteps, cond.c_crossattn, cond.c_vector);
                 controls = control_net->controls;
                 // print_ggml_tensor(controls[12]);
                 // GGML_ASSERT(0);
             }
 
-            if (start_merge_step == -1 || step <= start_merge_step) {
+            bool is_merge_step = start_merge_step != -1 && (adaptive ? progress * steps : (float)step) > start_merge_step;
+            if (!is_merge_step) {
                 // cond
-                diffusion_model->compute(n_threads,
-                                         noised_input,
-                                         timesteps,
-                                         cond.c_crossattn,
-                                         cond.c_concat,
-                                         cond.c_vector,
-                                         guidance_tensor,
-                                         -1,
-                                         controls,
-                                         control_strength,
-                                         &out_cond);
+                diffusion_compute(noised_input, t, timesteps, guidance_tensor, cond, controls, &out_cond);
             } else {
-                diffusion_model->compute(n_threads,
-                                         noised_input,
-                                         timesteps,
-                                         id_cond.c_crossattn,
-                                         cond.c_concat,
-                                         id_cond.c_vector,
-                                         guidance_tensor,
-                                         -1,
-                                         controls,
-                                         control_strength,
-                                         &out_cond);
+                SDCondition merged_cond(id_cond.c_crossattn, id_cond.c_vector, cond.c_concat);
+                diffusion_compute(noised_input, t, timesteps, guidance_tensor, merged_cond, controls, &out_cond);
+            }
+
+            bool is_cfg_step    = has_unconditioned && sigma >= cfg_sigma_min && sigma <= cfg_sigma_max;
+            bool is_uncond_step = is_cfg_step;
+            if (is_cfg_step && cfg_every > 1) {
+                // decided by the sampler step, so every model call of a multi-stage step takes the same branch
+                int step_index = std::max(std::abs(step) - 1, 0);
+                if (cfg_first_step < 0) {
+                    cfg_first_step = step_index;
+                }
+                is_uncond_step = !has_cfg_delta || (step_index - cfg_first_step) % cfg_every == 0;
+            }
+            if (has_unconditioned && !is_uncond_step) {
+                uncond_skipped++;
             }
 
             float* negative_data = NULL;
-            if (has_unconditioned) {
+            if (is_uncond_step) {
                 // uncond
-                if (control_hint != NULL) {
+                if (is_control_step && !control_share_uncond) {
                     control_net->compute(n_threads, noised_input, control_hint, timesteps, uncond.c_crossattn, uncond.c_vector);
                     controls = control_net->controls;
                 }
-                diffusion_model->compute(n_threads,
-                                         noised_input,
-                                         timesteps,
-                                         uncond.c_crossattn,
-                                         uncond.c_concat,
-                                         uncond.c_vector,
-                                         guidance_tensor,
-                                         -1,
-                                         controls,
-                                         control_strength,
-                                         &out_uncond);
+                diffusion_compute(noised_input, t, timesteps, guidance_tensor, uncond, controls, &out_uncond);
                 negative_data = (float*)out_uncond->data;
             }
 
             int step_count         = sigmas.size();
             bool is_skiplayer_step = has_skiplayer && step > (int)(skip_layer_start * step_count) && step < (int)(skip_layer_end * step_count);
+            if (has_skiplayer && adaptive) {
+                is_skiplayer_step = progress > skip_layer_start && progress < skip_layer_end;
+            }
             float* skip_layer_data = NULL;
             if (is_skiplayer_step) {
                 LOG_DEBUG("Skipping layers at step %d\n", step);
                 // skip layer (same as conditionned)
-                diffusion_model->compute(n_threads,
-                                         noised_input,
-                                         timesteps,
-                                         cond.c_crossattn,
-                                         cond.c_concat,
-                                         cond.c_vector,
-                                         guidance_tensor,
-                                         -1,
-                                         controls,
-                                         control_strength,
-                                         &out_skip,
-                                         NULL,
-                                         skip_layers);
+                diffusion_compute(noised_input, t, timesteps, guidance_tensor, cond, controls, &out_skip, skip_layers);
                 skip_layer_data = (float*)out_skip->data;
             }
             float* vec_denoised  = (float*)denoised->data;
             float* vec_input     = (float*)input->data;
             float* positive_data = (float*)out_cond->data;
+            float* delta_data    = cfg_delta != NULL ? (float*)cfg_delta->data : NULL;
             int ne_elements      = (int)ggml_nelements(denoised);
+            if (is_uncond_step && delta_data != NULL) {
+                for (int i = 0; i < ne_elements; i++) {
+                    delta_data[i] = positive_data[i] - negative_data[i];
+                }
+                has_cfg_delta = true;
+            }
             for (int i = 0; i < ne_elements; i++) {
                 float latent_result = positive_data[i];
-                if (has_unconditioned) {
+                if (is_cfg_step && !is_uncond_step) {
+                    // out_cond + (cfg_scale - 1) * last (out_cond - out_uncond)
+                    latent_result = positive_data[i] + (cfg_scale - 1) * delta_data[i];
+                } else if (is_uncond_step) {
                     // out_uncond + cfg_scale * (out_cond - out_uncond)
                     int64_t ne3 = out_cond->ne[3];
                     if (min_cfg != cfg_scale && ne3 != 1) {
@@ -943,10 +1864,18 @@ public:
                 pretty_progress(step, (int)steps, (t1 - t0) / 1000000.f);
                 // LOG_INFO("step %d sampling completed taking %.2fs", step, (t1 - t0) * 1.0f / 1000000);
             }
+            if (preview.cb != NULL && step > last_preview_step && (step % preview.interval == 0 || step == (int)steps)) {
+                last_preview_step = step;
+                aborted           = !preview_latent(preview, denoised, step, (int)steps);
+            }
             return denoised;
         };
 
-        sample_k_diffusion(method, denoise, work_ctx, x, sigmas, rng);
+        sample_k_diffusion(method, denoise, work_ctx, x, sigmas, rng, adaptive_rtol, adaptive_atol, sd_version_is_dit(version));
+
+        if (uncond_skipped > 0) {
+            LOG_INFO("cfg interval: skipped %d unconditional passes", uncond_skipped);
+        }
 
         x = denoiser->inverse_noise_scaling(sigmas[sigmas.size() - 1], x);
 
@@ -955,6 +1884,16 @@ public:
             control_net->free_compute_buffer();
         }
         diffusion_model->free_compute_buffer();
+        if (tiles_ctx != NULL) {
+            ggml_free(tiles_ctx);
+        }
+        if (preview.cb != NULL && use_tiny_autoencoder) {
+            tae_first_stage->free_compute_buffer();
+        }
+        if (aborted) {
+            LOG_INFO("sampling aborted by the preview callback at step %d", last_preview_step);
+            return NULL;
+        }
         return x;
     }
 
@@ -990,6 +1929,118 @@ public:
         return latent;
     }
 
+    // sends the first frame of the denoised latent to the preview callback as rgb,
+    // returns false when the callback asks to abort
+    bool preview_latent(const SDPreviewCallback& preview, ggml_tensor* latent, int step, int steps) {
+        int64_t t0 = ggml_time_us();
+        int W      = (int)latent->ne[0];
+        int H      = (int)latent->ne[1];
+        int C      = (int)latent->ne[2];
+
+        sd_image_t image = {(uint32_t)W, (uint32_t)H, 3, NULL};
+        if (preview.method == SD_PREVIEW_TAE && use_tiny_autoencoder && C == 4) {
+            struct ggml_init_params params;
+            params.mem_size           = (size_t)W * H * C * sizeof(float) + (size_t)W * H * 64 * 3 * sizeof(float) + 4 * (ggml_tensor_overhead() + GGML_MEM_ALIGN);
+            params.mem_buffer         = NULL;
+            params.no_alloc           = false;
+            ggml_context* preview_ctx = ggml_init(params);
+            if (!preview_ctx) {
+                LOG_ERROR("ggml_init() failed");
+                return true;
+            }
+            ggml_tensor* x      = ggml_new_tensor_4d(preview_ctx, GGML_TYPE_F32, W, H, C, 1);
+            ggml_tensor* result = ggml_new_tensor_4d(preview_ctx, GGML_TYPE_F32, W * 8, H * 8, 3, 1);
+            memcpy(x->data, latent->data, ggml_nbytes(x));
+            // the compute buffer is kept until the end of sampling
+            tae_first_stage->compute(n_threads, x, true, &result);
+            ggml_tensor_clamp(result, 0.0f, 1.0f);
+            image.width  = W * 8;
+            image.height = H * 8;
+            image.data   = sd_tensor_to_image(result);
+            ggml_free(preview_ctx);
+        } else {
+            LatentRGBProjection proj = get_latent_rgb_projection(version);
+            if (proj.channels != C) {
+                return true;
+            }
+            image.data = (uint8_t*)malloc((size_t)W * H * 3);
+            if (image.data == NULL) {
+                return true;
+            }
+            const float* vec_x = (const float*)latent->data;
+            for (int i = 0; i < W * H; i++) {
+                float rgb[3] = {proj.bias[0], proj.bias[1], proj.bias[2]};
+                for (int c = 0; c < C; c++) {
+                    float v = vec_x[(size_t)c * W * H + i];
+                    rgb[0] += v * proj.factors[c * 3];
+                    rgb[1] += v * proj.factors[c * 3 + 1];
+                    rgb[2] += v * proj.factors[c * 3 + 2];
+                }
+                for (int k = 0; k < 3; k++) {
+                    image.data[i * 3 + k] = (uint8_t)(std::min(std::max((rgb[k] + 1.f) / 2.f, 0.f), 1.f) * 255.f);
+                }
+            }
+        }
+        int64_t t1 = ggml_time_us();
+        LOG_DEBUG("step %d preview %ux%u, taking %.2fms", step, image.width, image.height, (t1 - t0) / 1000.f);
+
+        bool keep_going = preview.cb(step, steps, &image, preview.data);
+        free(image.data);
+        return keep_going;
+    }
+
+    // decodes the frames in chunks of vae_frame_chunk frames, the frames shared by two chunks
+    // are cross-faded. The time mixing layers only see the frames of their own chunk, so
+    // the result is close to, not the same as, decoding all the frames at once
+    void decode_frame_chunks(ggml_tensor* x, ggml_tensor* result) {
+        int T         = (int)x->ne[3];
+        int chunk     = vae_frame_chunk;
+        int overlap   = std::min(2, chunk / 2);
+        int stride    = chunk - overlap;
+        size_t in_ne  = (size_t)x->ne[0] * x->ne[1] * x->ne[2];
+        size_t out_ne = (size_t)result->ne[0] * result->ne[1] * result->ne[2];
+
+        struct ggml_init_params params;
+        params.mem_size         = (in_ne + out_ne) * chunk * sizeof(float) + 2 * (ggml_tensor_overhead() + GGML_MEM_ALIGN);
+        params.mem_buffer       = NULL;
+        params.no_alloc         = false;
+        ggml_context* chunk_ctx = ggml_init(params);
+        GGML_ASSERT(chunk_ctx != NULL);
+        ggml_tensor* in  = ggml_new_tensor_4d(chunk_ctx, GGML_TYPE_F32, x->ne[0], x->ne[1], x->ne[2], chunk);
+        ggml_tensor* out = ggml_new_tensor_4d(chunk_ctx, GGML_TYPE_F32, result->ne[0], result->ne[1], result->ne[2], chunk);
+
+        float* vec_result = (float*)result->data;
+        std::vector<float> weight_sum(T, 0.f);
+        memset(vec_result, 0, ggml_nbytes(result));
+        for (int start = 0;; start += stride) {
+            // the last chunk is moved back so all the chunks share one graph
+            start = std::min(start, T - chunk);
+            LOG_DEBUG("decoding frames %d-%d/%d", start + 1, start + chunk, T);
+            memcpy(in->data, (float*)x->data + start * in_ne, in_ne * chunk * sizeof(float));
+            first_stage_model->compute(n_threads, in, true, &out);
+            const float* vec_out = (const float*)out->data;
+            for (int j = 0; j < chunk; j++) {
+                // ramps up and down over the overlapping frames
+                float weight = (float)std::min(std::min(j + 1, chunk - j), overlap + 1);
+                float* dst   = vec_result + (start + j) * out_ne;
+                for (size_t i = 0; i < out_ne; i++) {
+                    dst[i] += weight * vec_out[j * out_ne + i];
+                }
+                weight_sum[start + j] += weight;
+            }
+            if (start + chunk >= T) {
+                break;
+            }
+        }
+        for (int t = 0; t < T; t++) {
+            float* dst = vec_result + t * out_ne;
+            for (size_t i = 0; i < out_ne; i++) {
+                dst[i] /= weight_sum[t];
+            }
+        }
+        ggml_free(chunk_ctx);
+    }
+
     ggml_tensor* compute_first_stage(ggml_context* work_ctx, ggml_tensor* x, bool decode) {
         int64_t W = x->ne[0];
         int64_t H = x->ne[1];
@@ -1015,12 +2066,21 @@ public:
             } else {
                 ggml_tensor_scale_input(x);
             }
-            if (vae_tiling && decode) {  // TODO: support tiling vae encode
+            if (decode && vae_frame_chunk > 0 && x->ne[3] > vae_frame_chunk) {
+                decode_frame_chunks(x, result);
+            } else if (vae_tiling && decode) {
                 // split latent in 32x32 tiles and compute in several steps
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
                     first_stage_model->compute(n_threads, in, decode, &out);
                 };
                 sd_tiling(x, result, 8, 32, 0.5f, on_tiling);
+            } else if (vae_tiling && W >= 256 && H >= 256) {
+                // split image in 256x256 tiles, the moments (mean and logvar channels) are blended like the decoded tiles
+                auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                    first_stage_model->compute(n_threads, in, decode, &out);
+                };
+                ggml_set_f32(result, 0.f);  // tiles are accumulated into the result
+                sd_tiling(x, result, 1.f / 8, 256, 0.5f, on_tiling);
             } else {
                 first_stage_model->compute(n_threads, x, decode, &result);
             }
@@ -1029,12 +2089,19 @@ public:
                 ggml_tensor_scale_output(result);
             }
         } else {
-            if (vae_tiling && decode) {  // TODO: support tiling vae encode
+            if (vae_tiling && decode) {
                 // split latent in 64x64 tiles and compute in several steps
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
                     tae_first_stage->compute(n_threads, in, decode, &out);
                 };
                 sd_tiling(x, result, 8, 64, 0.5f, on_tiling);
+            } else if (vae_tiling && W >= 512 && H >= 512) {
+                // split image in 512x512 tiles and compute in several steps
+                auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                    tae_first_stage->compute(n_threads, in, decode, &out);
+                };
+                ggml_set_f32(result, 0.f);  // tiles are accumulated into the result
+                sd_tiling(x, result, 1.f / 8, 512, 0.5f, on_tiling);
             } else {
                 tae_first_stage->compute(n_threads, x, decode, &result);
             }
@@ -1053,6 +2120,65 @@ public:
         return compute_first_stage(work_ctx, x, false);
     }
 
+    // same as encode_first_stage, but the result is looked up in/added to the latent cache
+    ggml_tensor* encode_first_stage_cached(ggml_context* work_ctx, ggml_tensor* x, const sd_image_t& image) {
+        std::string source_tag = format("%u:%u:%u:%d%d", image.width, image.height, image.channel, use_tiny_autoencoder, vae_tiling);
+        size_t source_size     = (size_t)image.width * image.height * image.channel;
+        uint64_t key           = fnv1a_hash(image.data, source_size, fnv1a_hash(source_tag));
+        for (auto it = latent_cache.begin(); it != latent_cache.end(); it++) {
+            if (it->key == key && it->source_tag == source_tag && it->source.size() == source_size &&
+                memcmp(it->source.data(), image.data, source_size) == 0) {
+                latent_cache.splice(latent_cache.begin(), latent_cache, it);
+                LatentCacheEntry& entry = latent_cache.front();
+                ggml_tensor* result     = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, entry.ne[0], entry.ne[1], entry.ne[2], entry.ne[3]);
+                memcpy(result->data, entry.data.data(), ggml_nbytes(result));
+                LOG_INFO("init image latent cache hit");
+                return result;
+            }
+        }
+
+        ggml_tensor* result = encode_first_stage(work_ctx, x);
+        size_t nbytes       = source_size + ggml_nbytes(result);
+        if (nbytes > latent_cache_max_bytes) {
+            return result;
+        }
+        while (latent_cache.size() > 0 && latent_cache_bytes + nbytes > latent_cache_max_bytes) {
+            latent_cache_bytes -= latent_cache.back().nbytes();
+            latent_cache.pop_back();
+        }
+        LatentCacheEntry entry;
+        entry.key        = key;
+        entry.source_tag = source_tag;
+        entry.source.assign(image.data, image.data + source_size);
+        for (int i = 0; i < 4; i++) {
+            entry.ne[i] = result->ne[i];
+        }
+        entry.data.resize(ggml_nelements(result));
+        memcpy(entry.data.data(), result->data, ggml_nbytes(result));
+        latent_cache.push_front(std::move(entry));
+        latent_cache_bytes += nbytes;
+        return result;
+    }
+
+    template <typename T>
+    T* find_id_cache_entry(std::list<T>& cache, uint64_t key, const std::string& source) {
+        for (auto it = cache.begin(); it != cache.end(); it++) {
+            if (it->key == key && it->source == source) {
+                cache.splice(cache.begin(), cache, it);
+                return &cache.front();
+            }
+        }
+        return NULL;
+    }
+
+    template <typename T>
+    void add_id_cache_entry(std::list<T>& cache, T&& entry) {
+        cache.push_front(std::move(entry));
+        while (cache.size() > id_cache_max_entries) {
+            cache.pop_back();
+        }
+    }
+
     ggml_tensor* decode_first_stage(ggml_context* work_ctx, ggml_tensor* x) {
         return compute_first_stage(work_ctx, x, true);
     }
@@ -1060,10 +2186,170 @@ public:
 
 /*================================================= SD API ==================================================*/
 
+/*================================================= SDWorkerPool =================================================*/
+
+// a request checks out a worker for its whole duration: a StableDiffusionGGML holding the
+// per request state (rng, compute buffers, control outputs, loras, caches), the params of
+// the extra workers are shared with the first one through the WeightStore
+struct SDWorkerPool {
+    std::function<StableDiffusionGGML*()> create_worker;  // NULL on failure
+    std::vector<std::function<void(StableDiffusionGGML*)>> settings;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<StableDiffusionGGML*> workers;  // the first one is the one loaded by new_sd_ctx
+    std::vector<StableDiffusionGGML*> idle_workers;
+    std::map<StableDiffusionGGML*, size_t> n_applied;  // how many of settings each worker has seen
+
+    ~SDWorkerPool() {
+        for (auto it = workers.rbegin(); it != workers.rend(); it++) {
+            delete *it;
+        }
+    }
+
+    StableDiffusionGGML* acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return idle_workers.size() > 0; });
+        StableDiffusionGGML* sd = idle_workers.back();
+        idle_workers.pop_back();
+        apply_settings(sd);
+        return sd;
+    }
+
+    void release(StableDiffusionGGML* sd) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            idle_workers.push_back(sd);
+        }
+        cv.notify_one();
+    }
+
+    // runs the settings sd has not seen yet, with the mutex held and sd not serving a request
+    void apply_settings(StableDiffusionGGML* sd) {
+        size_t& n = n_applied[sd];
+        for (; n < settings.size(); n++) {
+            settings[n](sd);
+        }
+    }
+
+    // applies setting to every worker, including the ones created later; the idle workers
+    // get it right away, the busy ones when they are acquired for their next request
+    void configure(const std::function<void(StableDiffusionGGML*)>& setting) {
+        std::lock_guard<std::mutex> lock(mutex);
+        settings.push_back(setting);
+        for (StableDiffusionGGML* sd : idle_workers) {
+            apply_settings(sd);
+        }
+    }
+
+    void add_worker(StableDiffusionGGML* sd) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            apply_settings(sd);
+            workers.push_back(sd);
+            idle_workers.push_back(sd);
+        }
+        cv.notify_one();
+    }
+};
+
 struct sd_ctx_t {
-    StableDiffusionGGML* sd = NULL;
+    StableDiffusionGGML* sd = NULL;  // the worker of the current request
+    SDWorkerPool* pool      = NULL;  // NULL for a request view
+};
+
+// a request view of a context, holding one of its workers until it goes out of scope
+struct SDRequest {
+    sd_ctx_t* owner;
+    sd_ctx_t ctx;
+
+    SDRequest(sd_ctx_t* owner)
+        : owner(owner) {
+        ctx.sd = owner->pool->acquire();
+    }
+
+    ~SDRequest() {
+        owner->pool->release(ctx.sd);
+    }
 };
 
+void sd_set_preview_callback(sd_preview_cb_t cb, int interval, enum sd_preview_t method, void* data) {
+    sd_preview_cb.cb       = cb;
+    sd_preview_cb.interval = std::max(interval, 1);
+    sd_preview_cb.method   = method;
+    sd_preview_cb.data     = data;
+}
+
+void sd_set_thread_preview_callback(sd_preview_cb_t cb, int interval, enum sd_preview_t method, void* data) {
+    sd_thread_preview_cb.cb       = cb;
+    sd_thread_preview_cb.interval = std::max(interval, 1);
+    sd_thread_preview_cb.method   = method;
+    sd_thread_preview_cb.data     = data;
+}
+
+void sd_set_latent_cache_limit(sd_ctx_t* sd_ctx, size_t max_bytes) {
+    if (sd_ctx == NULL || sd_ctx->pool == NULL) {
+        return;
+    }
+    sd_ctx->pool->configure([max_bytes](StableDiffusionGGML* sd) {
+        sd->latent_cache_max_bytes = max_bytes;
+        while (sd->latent_cache.size() > 0 && sd->latent_cache_bytes > max_bytes) {
+            sd->latent_cache_bytes -= sd->latent_cache.back().nbytes();
+            sd->latent_cache.pop_back();
+        }
+    });
+}
+
+void sd_set_video_frame_chunks(sd_ctx_t* sd_ctx, int unet_frames, int vae_frames) {
+    if (sd_ctx == NULL || sd_ctx->pool == NULL) {
+        return;
+    }
+    sd_ctx->pool->configure([unet_frames, vae_frames](StableDiffusionGGML* sd) {
+        auto unet = std::dynamic_pointer_cast<UNetModel>(sd->diffusion_model);
+        if (unet) {
+            unet->unet.unet.spatial_frame_chunk = std::max(unet_frames, 0);
+        }
+        sd->vae_frame_chunk = std::max(vae_frames, 0);
+    });
+}
+
+void sd_set_vae_attention_chunk(sd_ctx_t* sd_ctx, int query_rows) {
+    if (sd_ctx == NULL || sd_ctx->pool == NULL) {
+        return;
+    }
+    sd_ctx->pool->configure([query_rows](StableDiffusionGGML* sd) {
+        if (sd->first_stage_model) {
+            sd->first_stage_model->set_attn_query_chunk(std::max(query_rows, 0));
+        }
+    });
+}
+
+int sd_set_max_concurrent_requests(sd_ctx_t* sd_ctx, int n) {
+    if (sd_ctx == NULL || sd_ctx->pool == NULL) {
+        return 0;
+    }
+    SDWorkerPool* pool = sd_ctx->pool;
+    if (sd_ctx->sd->free_params_immediately && n > 1) {
+        LOG_WARN("contexts freeing their params immediately can not share them, serving one request at a time");
+        n = 1;
+    }
+    // the workers are created upfront, so they attach to the weights before any LoRA is merged
+    int n_workers = 0;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        n_workers = (int)pool->workers.size();
+    }
+    for (; n_workers < n; n_workers++) {
+        StableDiffusionGGML* sd = pool->create_worker();
+        if (sd == NULL) {
+            LOG_WARN("create worker failed, serving up to %d concurrent requests", n_workers);
+            break;
+        }
+        pool->add_worker(sd);
+    }
+    return n_workers;
+}
+
 sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
                      const char* clip_l_path_c_str,
                      const char* clip_g_path_c_str,
@@ -1085,8 +2371,10 @@ sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
                      bool keep_clip_on_cpu,
                      bool keep_control_net_cpu,
                      bool keep_vae_on_cpu,
-                     bool diffusion_flash_attn) {
-    sd_ctx_t* sd_ctx = (sd_ctx_t*)malloc(sizeof(sd_ctx_t));
+                     bool diffusion_flash_attn,
+                     const char* tensor_type_rules_c_str,
+                     const char* snapshot_dir_c_str) {
+    sd_ctx_t* sd_ctx = new sd_ctx_t();
     if (sd_ctx == NULL) {
         return NULL;
     }
@@ -1101,47 +2389,123 @@ sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
     std::string embd_path(embed_dir_c_str);
     std::string id_embd_path(id_embed_dir_c_str);
     std::string lora_model_dir(lora_model_dir_c_str);
+    std::string tensor_type_rules(tensor_type_rules_c_str != NULL ? tensor_type_rules_c_str : "");
+    std::string snapshot_dir(snapshot_dir_c_str != NULL ? snapshot_dir_c_str : "");
+
+    // every worker of the context loads the same way, the later ones share the params of the first
+    auto create_worker = [=]() -> StableDiffusionGGML* {
+        StableDiffusionGGML* sd = new StableDiffusionGGML(n_threads,
+                                                          vae_decode_only,
+                                                          free_params_immediately,
+                                                          lora_model_dir,
+                                                          rng_type);
+        if (!sd->load_from_file(model_path,
+                                clip_l_path,
+                                clip_g_path,
+                                t5xxl_path,
+                                diffusion_model_path,
+                                vae_path,
+                                control_net_path,
+                                embd_path,
+                                id_embd_path,
+                                taesd_path,
+                                vae_tiling,
+                                (ggml_type)wtype,
+                                tensor_type_rules,
+                                snapshot_dir,
+                                s,
+                                keep_clip_on_cpu,
+                                keep_control_net_cpu,
+                                keep_vae_on_cpu,
+                                diffusion_flash_attn)) {
+            delete sd;
+            return NULL;
+        }
+        sd->init_threadpool(NULL, GGML_SCHED_PRIO_NORMAL, 50, false);
+        return sd;
+    };
 
-    sd_ctx->sd = new StableDiffusionGGML(n_threads,
-                                         vae_decode_only,
-                                         free_params_immediately,
-                                         lora_model_dir,
-                                         rng_type);
+    sd_ctx->sd = create_worker();
     if (sd_ctx->sd == NULL) {
+        delete sd_ctx;
         return NULL;
     }
+    sd_ctx->pool                = new SDWorkerPool();
+    sd_ctx->pool->create_worker = create_worker;
+    sd_ctx->pool->add_worker(sd_ctx->sd);
+    return sd_ctx;
+}
 
-    if (!sd_ctx->sd->load_from_file(model_path,
-                                    clip_l_path,
-                                    clip_g_path,
-                                    t5xxl_path_c_str,
-                                    diffusion_model_path,
-                                    vae_path,
-                                    control_net_path,
-                                    embd_path,
-                                    id_embd_path,
-                                    taesd_path,
-                                    vae_tiling,
-                                    (ggml_type)wtype,
-                                    s,
-                                    keep_clip_on_cpu,
-                                    keep_control_net_cpu,
-                                    keep_vae_on_cpu,
-                                    diffusion_flash_attn)) {
-        delete sd_ctx->sd;
-        sd_ctx->sd = NULL;
-        free(sd_ctx);
-        return NULL;
+// "0xff00" style hex masks (lowest bit is cpu 0) or "0-7,16-23" style lists
+static bool parse_cpumask(const std::string& str, bool* cpumask) {
+    memset(cpumask, 0, GGML_MAX_N_THREADS * sizeof(bool));
+    if (str.rfind("0x", 0) == 0 || str.rfind("0X", 0) == 0) {
+        int cpu = 0;
+        for (size_t i = str.size(); i > 2 && cpu < GGML_MAX_N_THREADS; i--, cpu += 4) {
+            char c = (char)tolower(str[i - 1]);
+            int v  = c >= '0' && c <= '9' ? c - '0' : (c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1);
+            if (v < 0) {
+                return false;
+            }
+            for (int b = 0; b < 4 && cpu + b < GGML_MAX_N_THREADS; b++) {
+                cpumask[cpu + b] = (v >> b) & 1;
+            }
+        }
+        return true;
     }
-    return sd_ctx;
+    std::stringstream ss(str);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        int first = 0, last = 0;
+        size_t dash = range.find('-');
+        try {
+            first = std::stoi(range.substr(0, dash));
+            last  = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        } catch (...) {
+            return false;
+        }
+        if (first < 0 || last < first || last >= GGML_MAX_N_THREADS) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpumask[cpu] = true;
+        }
+    }
+    return true;
+}
+
+bool sd_set_threadpool(sd_ctx_t* sd_ctx, const char* cpumask_c_str, int priority, int poll, bool strict_cpu) {
+    if (sd_ctx == NULL || sd_ctx->pool == NULL) {
+        return false;
+    }
+    bool cpumask[GGML_MAX_N_THREADS] = {false};
+    bool has_cpumask                 = cpumask_c_str != NULL && strlen(cpumask_c_str) > 0;
+    if (has_cpumask && !parse_cpumask(cpumask_c_str, cpumask)) {
+        LOG_ERROR("invalid cpu mask '%s'", cpumask_c_str);
+        return false;
+    }
+    // every worker gets its own pool with the same settings, a worker serving a request
+    // keeps computing on its current pool until it is acquired again
+    std::vector<bool> mask(cpumask, cpumask + GGML_MAX_N_THREADS);
+    std::shared_ptr<std::atomic<bool>> ok = std::make_shared<std::atomic<bool>>(true);
+    sd_ctx->pool->configure([=](StableDiffusionGGML* sd) {
+        bool worker_cpumask[GGML_MAX_N_THREADS];
+        std::copy(mask.begin(), mask.end(), worker_cpumask);
+        if (!sd->init_threadpool(has_cpumask ? worker_cpumask : NULL, priority, poll, strict_cpu)) {
+            *ok = false;
+        }
+    });
+    // reports the idle workers, which got it right away
+    return *ok;
 }
 
 void free_sd_ctx(sd_ctx_t* sd_ctx) {
-    if (sd_ctx->sd != NULL) {
-        delete sd_ctx->sd;
-        sd_ctx->sd = NULL;
+    if (sd_ctx->pool != NULL) {
+        delete sd_ctx->pool;  // deletes sd_ctx->sd too
+        sd_ctx->pool = NULL;
+        sd_ctx->sd   = NULL;
     }
-    free(sd_ctx);
+    delete sd_ctx;
 }
 
 sd_image_t* generate_image(sd_ctx_t* sd_ctx,
@@ -1151,6 +2515,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
                            std::string negative_prompt,
                            int clip_skip,
                            float cfg_scale,
+                           float min_cfg,
                            float guidance,
                            int width,
                            int height,
@@ -1163,10 +2528,26 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
                            float style_ratio,
                            bool normalize_input,
                            std::string input_id_images_path,
-                           std::vector<int> skip_layers = {},
-                           float slg_scale              = 0,
-                           float skip_layer_start       = 0.01,
-                           float skip_layer_end         = 0.2) {
+                           std::vector<int> skip_layers    = {},
+                           float slg_scale                 = 0,
+                           float skip_layer_start          = 0.01,
+                           float skip_layer_end            = 0.2,
+                           float adaptive_rtol             = 0.05f,
+                           float adaptive_atol             = 0.0078f,
+                           float cfg_sigma_min             = 0.f,
+                           float cfg_sigma_max             = INFINITY,
+                           int cfg_every                   = 1,
+                           int hires_width                 = 0,
+                           int hires_height                = 0,
+                           int hires_steps                 = 0,
+                           float hires_strength            = 0.5f,
+                           hires_upscaler_t hires_upscaler = HIRES_LATENT_BILINEAR,
+                           int diffusion_tile_size         = 0,
+                           float diffusion_tile_overlap    = 0.25f,
+                           int diffusion_tile_batch        = 1,
+                           float control_start             = 0.f,
+                           float control_end               = 1.f,
+                           bool control_share_uncond       = false) {
     if (seed < 0) {
         // Generally, when using the provided command line, the seed is always >0.
         // However, to prevent potential issues if 'stable-diffusion.cpp' is invoked as a library
@@ -1206,6 +2587,12 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     if (sd_ctx->sd->stacked_id) {
         if (!sd_ctx->sd->pmid_lora->applied) {
             t0 = ggml_time_ms();
+            if (!sd_ctx->sd->make_tensors_private(sd_ctx->sd->pmid_lora->get_target_tensors(sd_ctx->sd->tensors))) {
+                // merging into the shared weights would change them for the other contexts
+                LOG_ERROR("pmid_lora apply failed");
+                ggml_free(work_ctx);
+                return NULL;
+            }
             sd_ctx->sd->pmid_lora->apply(sd_ctx->sd->tensors, sd_ctx->sd->n_threads);
             t1                             = ggml_time_ms();
             sd_ctx->sd->pmid_lora->applied = true;
@@ -1214,76 +2601,136 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
                 sd_ctx->sd->pmid_lora->free_params_buffer();
             }
         }
-        // preprocess input id images
-        std::vector<sd_image_t*> input_id_images;
+        // the id images are keyed on the directory content, the id condition also on the prompt
+        // (trigger word and class tokens), its encoding and the loras merged into the text encoders,
+        // style_ratio only moves the merge step
         bool pmv2 = sd_ctx->sd->pmid_model->get_version() == PM_VERSION_2;
+        std::vector<std::string> img_files;
+        std::string images_source = format("pmid:%d\n", normalize_input);
         if (sd_ctx->sd->pmid_model && input_id_images_path.size() > 0) {
-            std::vector<std::string> img_files = get_files_from_dir(input_id_images_path);
-            for (std::string img_file : img_files) {
-                int c = 0;
-                int width, height;
-                if (ends_with(img_file, "safetensors")) {
-                    continue;
+            img_files = get_files_from_dir(input_id_images_path);
+            for (const std::string& img_file : img_files) {
+                images_source += format("%s:%016llx\n", img_file.c_str(), (unsigned long long)fingerprint_file(img_file));
+            }
+        }
+        std::string cond_source = images_source + format("%d:%d:%d\n", clip_skip, width, height);
+        std::map<std::string, float> lora_state(sd_ctx->sd->curr_lora_state.begin(), sd_ctx->sd->curr_lora_state.end());
+        for (auto& kv : lora_state) {
+            cond_source += format("lora:%s:%g\n", kv.first.c_str(), kv.second);
+        }
+        cond_source += prompt;
+        uint64_t images_key = fnv1a_hash(images_source);
+        uint64_t cond_key   = fnv1a_hash(cond_source);
+
+        StableDiffusionGGML::IDCondCacheEntry* cond_entry = NULL;
+        if (img_files.size() > 0) {
+            cond_entry = sd_ctx->sd->find_id_cache_entry(sd_ctx->sd->id_cond_cache, cond_key, cond_source);
+        }
+        if (cond_entry != NULL) {
+            id_cond.c_crossattn = cond_entry->c_crossattn.restore(work_ctx);
+            id_cond.c_vector    = cond_entry->c_vector.restore(work_ctx);
+            class_tokens_mask   = cond_entry->class_tokens_mask;
+            LOG_INFO("PhotoMaker id condition cache hit");
+        } else {
+            StableDiffusionGGML::IDImagesCacheEntry* images_entry = NULL;
+            if (img_files.size() > 0) {
+                images_entry = sd_ctx->sd->find_id_cache_entry(sd_ctx->sd->id_images_cache, images_key, images_source);
+            }
+            struct ggml_tensor* id_embeds = NULL;
+            if (images_entry != NULL) {
+                init_img  = images_entry->images.restore(work_ctx);
+                id_embeds = images_entry->id_embeds.restore(work_ctx);
+                LOG_INFO("PhotoMaker id images cache hit");
+            } else {
+                // preprocess input id images
+                std::vector<sd_image_t*> input_id_images;
+                for (std::string img_file : img_files) {
+                    int c = 0;
+                    int width, height;
+                    if (ends_with(img_file, "safetensors")) {
+                        continue;
+                    }
+                    uint8_t* input_image_buffer = stbi_load(img_file.c_str(), &width, &height, &c, 3);
+                    if (input_image_buffer == NULL) {
+                        LOG_ERROR("PhotoMaker load image from '%s' failed", img_file.c_str());
+                        continue;
+                    } else {
+                        LOG_INFO("PhotoMaker loaded image from '%s'", img_file.c_str());
+                    }
+                    sd_image_t* input_image = NULL;
+                    input_image             = new sd_image_t{(uint32_t)width,
+                                                 (uint32_t)height,
+                                                 3,
+                                                 input_image_buffer};
+                    input_image             = preprocess_id_image(input_image);
+                    if (input_image == NULL) {
+                        LOG_ERROR("preprocess input id image from '%s' failed", img_file.c_str());
+                        continue;
+                    }
+                    input_id_images.push_back(input_image);
                 }
-                uint8_t* input_image_buffer = stbi_load(img_file.c_str(), &width, &height, &c, 3);
-                if (input_image_buffer == NULL) {
-                    LOG_ERROR("PhotoMaker load image from '%s' failed", img_file.c_str());
-                    continue;
-                } else {
-                    LOG_INFO("PhotoMaker loaded image from '%s'", img_file.c_str());
+                if (input_id_images.size() > 0) {
+                    int32_t w                = input_id_images[0]->width;
+                    int32_t h                = input_id_images[0]->height;
+                    int32_t channels         = input_id_images[0]->channel;
+                    int32_t num_input_images = (int32_t)input_id_images.size();
+                    init_img                 = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, w, h, channels, num_input_images);
+                    // TODO: move these to somewhere else and be user settable
+                    float mean[] = {0.48145466f, 0.4578275f, 0.40821073f};
+                    float std[]  = {0.26862954f, 0.26130258f, 0.27577711f};
+                    for (int i = 0; i < num_input_images; i++) {
+                        sd_image_t* init_image = input_id_images[i];
+                        if (normalize_input)
+                            sd_mul_images_to_tensor(init_image->data, init_img, i, mean, std);
+                        else
+                            sd_mul_images_to_tensor(init_image->data, init_img, i, NULL, NULL);
+                    }
+                    if (pmv2) {
+                        // id_embeds = sd_ctx->sd->pmid_id_embeds->get();
+                        id_embeds = load_tensor_from_file(work_ctx, path_join(input_id_images_path, "id_embeds.bin"));
+                        // print_ggml_tensor(id_embeds, true, "id_embeds:");
+                    }
+                    StableDiffusionGGML::IDImagesCacheEntry entry;
+                    entry.key    = images_key;
+                    entry.source = images_source;
+                    entry.images.store(init_img);
+                    entry.id_embeds.store(id_embeds);
+                    sd_ctx->sd->add_id_cache_entry(sd_ctx->sd->id_images_cache, std::move(entry));
                 }
-                sd_image_t* input_image = NULL;
-                input_image             = new sd_image_t{(uint32_t)width,
-                                             (uint32_t)height,
-                                             3,
-                                             input_image_buffer};
-                input_image             = preprocess_id_image(input_image);
-                if (input_image == NULL) {
-                    LOG_ERROR("preprocess input id image from '%s' failed", img_file.c_str());
-                    continue;
+                for (sd_image_t* img : input_id_images) {
+                    free(img->data);
                 }
-                input_id_images.push_back(input_image);
+                input_id_images.clear();
+            }
+            if (init_img != NULL) {
+                int32_t num_input_images = (int32_t)init_img->ne[3];
+                t0                       = ggml_time_ms();
+                auto cond_tup            = sd_ctx->sd->cond_stage_model->get_learned_condition_with_trigger(work_ctx,
+                                                                                                        sd_ctx->sd->n_threads, prompt,
+                                                                                                        clip_skip,
+                                                                                                        width,
+                                                                                                        height,
+                                                                                                        num_input_images,
+                                                                                                        sd_ctx->sd->diffusion_model->get_adm_in_channels());
+                id_cond                  = std::get<0>(cond_tup);
+                class_tokens_mask        = std::get<1>(cond_tup);  //
+                id_cond.c_crossattn      = sd_ctx->sd->id_encoder(work_ctx, init_img, id_cond.c_crossattn, id_embeds, class_tokens_mask);
+                t1                       = ggml_time_ms();
+                LOG_INFO("Photomaker ID Stacking, taking %" PRId64 " ms", t1 - t0);
+                if (sd_ctx->sd->free_params_immediately) {
+                    sd_ctx->sd->pmid_model->free_params_buffer();
+                }
+                StableDiffusionGGML::IDCondCacheEntry entry;
+                entry.key    = cond_key;
+                entry.source = cond_source;
+                entry.c_crossattn.store(id_cond.c_crossattn);
+                entry.c_vector.store(id_cond.c_vector);
+                entry.class_tokens_mask = class_tokens_mask;
+                sd_ctx->sd->add_id_cache_entry(sd_ctx->sd->id_cond_cache, std::move(entry));
             }
         }
-        if (input_id_images.size() > 0) {
+        if (id_cond.c_crossattn != NULL) {
             sd_ctx->sd->pmid_model->style_strength = style_ratio;
-            int32_t w                              = input_id_images[0]->width;
-            int32_t h                              = input_id_images[0]->height;
-            int32_t channels                       = input_id_images[0]->channel;
-            int32_t num_input_images               = (int32_t)input_id_images.size();
-            init_img                               = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, w, h, channels, num_input_images);
-            // TODO: move these to somewhere else and be user settable
-            float mean[] = {0.48145466f, 0.4578275f, 0.40821073f};
-            float std[]  = {0.26862954f, 0.26130258f, 0.27577711f};
-            for (int i = 0; i < num_input_images; i++) {
-                sd_image_t* init_image = input_id_images[i];
-                if (normalize_input)
-                    sd_mul_images_to_tensor(init_image->data, init_img, i, mean, std);
-                else
-                    sd_mul_images_to_tensor(init_image->data, init_img, i, NULL, NULL);
-            }
-            t0                            = ggml_time_ms();
-            auto cond_tup                 = sd_ctx->sd->cond_stage_model->get_learned_condition_with_trigger(work_ctx,
-                                                                                                             sd_ctx->sd->n_threads, prompt,
-                                                                                                             clip_skip,
-                                                                                                             width,
-                                                                                                             height,
-                                                                                                             num_input_images,
-                                                                                                             sd_ctx->sd->diffusion_model->get_adm_in_channels());
-            id_cond                       = std::get<0>(cond_tup);
-            class_tokens_mask             = std::get<1>(cond_tup);  //
-            struct ggml_tensor* id_embeds = NULL;
-            if (pmv2) {
-                // id_embeds = sd_ctx->sd->pmid_id_embeds->get();
-                id_embeds = load_tensor_from_file(work_ctx, path_join(input_id_images_path, "id_embeds.bin"));
-                // print_ggml_tensor(id_embeds, true, "id_embeds:");
-            }
-            id_cond.c_crossattn = sd_ctx->sd->id_encoder(work_ctx, init_img, id_cond.c_crossattn, id_embeds, class_tokens_mask);
-            t1                  = ggml_time_ms();
-            LOG_INFO("Photomaker ID Stacking, taking %" PRId64 " ms", t1 - t0);
-            if (sd_ctx->sd->free_params_immediately) {
-                sd_ctx->sd->pmid_model->free_params_buffer();
-            }
             // Encode input prompt without the trigger word for delayed conditioning
             prompt_text_only = sd_ctx->sd->cond_stage_model->remove_trigger_from_prompt(work_ctx, prompt);
             // printf("%s || %s \n", prompt.c_str(), prompt_text_only.c_str());
@@ -1297,36 +2744,62 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
             LOG_WARN("Turn off PhotoMaker");
             sd_ctx->sd->stacked_id = false;
         }
-        for (sd_image_t* img : input_id_images) {
-            free(img->data);
-        }
-        input_id_images.clear();
     }
 
     // Get learned condition
-    t0               = ggml_time_ms();
-    SDCondition cond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                           sd_ctx->sd->n_threads,
-                                                                           prompt,
-                                                                           clip_skip,
-                                                                           width,
-                                                                           height,
-                                                                           sd_ctx->sd->diffusion_model->get_adm_in_channels());
-
+    t0 = ggml_time_ms();
+    SDCondition cond;
     SDCondition uncond;
     if (cfg_scale != 1.0) {
         bool force_zero_embeddings = false;
         if (sd_ctx->sd->version == VERSION_SDXL && negative_prompt.size() == 0) {
             force_zero_embeddings = true;
         }
-        uncond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                     sd_ctx->sd->n_threads,
-                                                                     negative_prompt,
-                                                                     clip_skip,
-                                                                     width,
-                                                                     height,
-                                                                     sd_ctx->sd->diffusion_model->get_adm_in_channels(),
-                                                                     force_zero_embeddings);
+        // both at once, the conditioner may overlap them
+        auto conds = sd_ctx->sd->cond_stage_model->get_learned_condition_pair(work_ctx,
+                                                                              sd_ctx->sd->n_threads,
+                                                                              prompt,
+                                                                              negative_prompt,
+                                                                              clip_skip,
+                                                                              width,
+                                                                              height,
+                                                                              sd_ctx->sd->diffusion_model->get_adm_in_channels(),
+                                                                              force_zero_embeddings);
+        cond   = conds.first;
+        uncond = conds.second;
+    } else {
+        cond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
+                                                                   sd_ctx->sd->n_threads,
+                                                                   prompt,
+                                                                   clip_skip,
+                                                                   width,
+                                                                   height,
+                                                                   sd_ctx->sd->diffusion_model->get_adm_in_channels());
+    }
+
+    // hires fix: sample at width x height, then upscale the latent and re-denoise at hires_width x hires_height
+    bool has_hires = hires_width > 0 && hires_height > 0 && (hires_width != width || hires_height != height);
+    SDCondition hires_cond   = cond;
+    SDCondition hires_uncond = uncond;
+    if (has_hires && sd_ctx->sd->version == VERSION_SDXL) {
+        // the size conditioning of SDXL depends on the target resolution
+        hires_cond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
+                                                                         sd_ctx->sd->n_threads,
+                                                                         prompt,
+                                                                         clip_skip,
+                                                                         hires_width,
+                                                                         hires_height,
+                                                                         sd_ctx->sd->diffusion_model->get_adm_in_channels());
+        if (cfg_scale != 1.0) {
+            hires_uncond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
+                                                                               sd_ctx->sd->n_threads,
+                                                                               negative_prompt,
+                                                                               clip_skip,
+                                                                               hires_width,
+                                                                               hires_height,
+                                                                               sd_ctx->sd->diffusion_model->get_adm_in_channels(),
+                                                                               negative_prompt.size() == 0);
+        }
     }
     t1 = ggml_time_ms();
     LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
@@ -1379,7 +2852,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
                                                      image_hint,
                                                      control_strength,
                                                      cfg_scale,
-                                                     cfg_scale,
+                                                     min_cfg,
                                                      guidance,
                                                      sample_method,
                                                      sigmas,
@@ -1388,11 +2861,82 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
                                                      skip_layers,
                                                      slg_scale,
                                                      skip_layer_start,
-                                                     skip_layer_end);
+                                                     skip_layer_end,
+                                                     adaptive_rtol,
+                                                     adaptive_atol,
+                                                     cfg_sigma_min,
+                                                     cfg_sigma_max,
+                                                     cfg_every,
+                                                     diffusion_tile_size,
+                                                     diffusion_tile_overlap,
+                                                     diffusion_tile_batch,
+                                                     control_start,
+                                                     control_end,
+                                                     control_share_uncond);
         // struct ggml_tensor* x_0 = load_tensor_from_file(ctx, "samples_ddim.bin");
         // print_ggml_tensor(x_0);
+        if (x_0 == NULL) {
+            ggml_free(work_ctx);
+            return NULL;
+        }
         int64_t sampling_end = ggml_time_ms();
         LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
+
+        if (has_hires) {
+            // upscale the latent and re-denoise from hires_strength, no intermediate decode
+            int steps                       = hires_steps > 0 ? hires_steps : sample_steps;
+            std::vector<float> hires_sigmas = sd_ctx->sd->denoiser->get_sigmas(steps);
+            int t_enc                       = std::min(static_cast<int>(steps * hires_strength), steps);
+            std::vector<float> sigma_sched(hires_sigmas.begin() + steps - t_enc, hires_sigmas.end());
+
+            struct ggml_tensor* hires_latent = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, hires_width / 8, hires_height / 8, C, 1);
+            ggml_tensor_resize_2d(x_0, hires_latent, hires_upscaler == HIRES_LATENT_BICUBIC);
+            x_0 = hires_latent;
+
+            if (t_enc > 0) {
+                LOG_INFO("hires fix: %dx%d -> %dx%d, %d steps", width, height, hires_width, hires_height, t_enc);
+                struct ggml_tensor* hires_noise = ggml_dup_tensor(work_ctx, hires_latent);
+                ggml_tensor_set_f32_randn(hires_noise, sd_ctx->sd->rng);
+
+                int hires_merge_step = -1;
+                if (sd_ctx->sd->stacked_id) {
+                    hires_merge_step = int(sd_ctx->sd->pmid_model->style_strength / 100.f * t_enc);
+                }
+                // the control hint has the base resolution, so control net is not applied here
+                x_0 = sd_ctx->sd->sample(work_ctx,
+                                         hires_latent,
+                                         hires_noise,
+                                         hires_cond,
+                                         hires_uncond,
+                                         NULL,
+                                         control_strength,
+                                         cfg_scale,
+                                         min_cfg,
+                                         guidance,
+                                         sample_method,
+                                         sigma_sched,
+                                         hires_merge_step,
+                                         id_cond,
+                                         skip_layers,
+                                         slg_scale,
+                                         skip_layer_start,
+                                         skip_layer_end,
+                                         adaptive_rtol,
+                                         adaptive_atol,
+                                         cfg_sigma_min,
+                                         cfg_sigma_max,
+                                         cfg_every,
+                                         diffusion_tile_size,
+                                         diffusion_tile_overlap,
+                                         diffusion_tile_batch);
+                if (x_0 == NULL) {
+                    ggml_free(work_ctx);
+                    return NULL;
+                }
+            }
+            int64_t hires_end = ggml_time_ms();
+            LOG_INFO("hires fix completed, taking %.2fs", (hires_end - sampling_end) * 1.0f / 1000);
+        }
         final_latents.push_back(x_0);
     }
 
@@ -1428,8 +2972,8 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     }
 
     for (size_t i = 0; i < decoded_images.size(); i++) {
-        result_images[i].width   = width;
-        result_images[i].height  = height;
+        result_images[i].width   = has_hires ? hires_width : width;
+        result_images[i].height  = has_hires ? hires_height : height;
         result_images[i].channel = 3;
         result_images[i].data    = sd_tensor_to_image(decoded_images[i]);
     }
@@ -1455,16 +2999,38 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                     float style_ratio,
                     bool normalize_input,
                     const char* input_id_images_path_c_str,
-                    int* skip_layers         = NULL,
-                    size_t skip_layers_count = 0,
-                    float slg_scale          = 0,
-                    float skip_layer_start   = 0.01,
-                    float skip_layer_end     = 0.2) {
+                    int* skip_layers                     = NULL,
+                    size_t skip_layers_count             = 0,
+                    float slg_scale                      = 0,
+                    float skip_layer_start               = 0.01,
+                    float skip_layer_end                 = 0.2,
+                    float adaptive_rtol                  = 0.05f,
+                    float adaptive_atol                  = 0.0078f,
+                    float cfg_sigma_min                  = 0.f,
+                    float cfg_sigma_max                  = INFINITY,
+                    int cfg_every                        = 1,
+                    int hires_width                      = 0,
+                    int hires_height                     = 0,
+                    int hires_steps                      = 0,
+                    float hires_strength                 = 0.5f,
+                    enum hires_upscaler_t hires_upscaler = HIRES_LATENT_BILINEAR,
+                    int diffusion_tile_size              = 0,
+                    float diffusion_tile_overlap         = 0.25f,
+                    int diffusion_tile_batch             = 1,
+                    float control_start                  = 0.f,
+                    float control_end                    = 1.f,
+                    bool control_share_uncond            = false) {
     std::vector<int> skip_layers_vec(skip_layers, skip_layers + skip_layers_count);
     LOG_DEBUG("txt2img %dx%d", width, height);
     if (sd_ctx == NULL) {
         return NULL;
     }
+    if (hires_width < 0 || hires_height < 0 || hires_width % 8 != 0 || hires_height % 8 != 0) {
+        LOG_ERROR("the hires width and height must be multiples of 8, got %dx%d", hires_width, hires_height);
+        return NULL;
+    }
+    SDRequest request(sd_ctx);
+    sd_ctx = &request.ctx;
 
     struct ggml_init_params params;
     params.mem_size = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
@@ -1478,6 +3044,11 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
         params.mem_size += static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
     }
     params.mem_size += width * height * 3 * sizeof(float);
+    if (hires_width > 0 && hires_height > 0) {
+        // upscaled latents, sampler buffers and the decoded image of the hires pass
+        params.mem_size += static_cast<size_t>(10 * 1024 * 1024) * hires_width * hires_height / (width * height);
+        params.mem_size += hires_width * hires_height * 3 * sizeof(float);
+    }
     params.mem_size *= batch_count;
     params.mem_buffer = NULL;
     params.no_alloc   = false;
@@ -1517,6 +3088,7 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                                                negative_prompt_c_str,
                                                clip_skip,
                                                cfg_scale,
+                                               cfg_scale,
                                                guidance,
                                                width,
                                                height,
@@ -1532,7 +3104,23 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                                                skip_layers_vec,
                                                slg_scale,
                                                skip_layer_start,
-                                               skip_layer_end);
+                                               skip_layer_end,
+                                               adaptive_rtol,
+                                               adaptive_atol,
+                                               cfg_sigma_min,
+                                               cfg_sigma_max,
+                                               cfg_every,
+                                               hires_width,
+                                               hires_height,
+                                               hires_steps,
+                                               hires_strength,
+                                               hires_upscaler,
+                                               diffusion_tile_size,
+                                               diffusion_tile_overlap,
+                                               diffusion_tile_batch,
+                                               control_start,
+                                               control_end,
+                                               control_share_uncond);
 
     size_t t1 = ggml_time_ms();
 
@@ -1560,16 +3148,29 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
                     float style_ratio,
                     bool normalize_input,
                     const char* input_id_images_path_c_str,
-                    int* skip_layers         = NULL,
-                    size_t skip_layers_count = 0,
-                    float slg_scale          = 0,
-                    float skip_layer_start   = 0.01,
-                    float skip_layer_end     = 0.2) {
+                    int* skip_layers             = NULL,
+                    size_t skip_layers_count     = 0,
+                    float slg_scale              = 0,
+                    float skip_layer_start       = 0.01,
+                    float skip_layer_end         = 0.2,
+                    float adaptive_rtol          = 0.05f,
+                    float adaptive_atol          = 0.0078f,
+                    float cfg_sigma_min          = 0.f,
+                    float cfg_sigma_max          = INFINITY,
+                    int cfg_every                = 1,
+                    int diffusion_tile_size      = 0,
+                    float diffusion_tile_overlap = 0.25f,
+                    int diffusion_tile_batch     = 1,
+                    float control_start          = 0.f,
+                    float control_end            = 1.f,
+                    bool control_share_uncond    = false) {
     std::vector<int> skip_layers_vec(skip_layers, skip_layers + skip_layers_count);
     LOG_DEBUG("img2img %dx%d", width, height);
     if (sd_ctx == NULL) {
         return NULL;
     }
+    SDRequest request(sd_ctx);
+    sd_ctx = &request.ctx;
 
     struct ggml_init_params params;
     params.mem_size = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
@@ -1606,10 +3207,10 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
     sd_image_to_tensor(init_image.data, init_img);
     ggml_tensor* init_latent = NULL;
     if (!sd_ctx->sd->use_tiny_autoencoder) {
-        ggml_tensor* moments = sd_ctx->sd->encode_first_stage(work_ctx, init_img);
+        ggml_tensor* moments = sd_ctx->sd->encode_first_stage_cached(work_ctx, init_img, init_image);
         init_latent          = sd_ctx->sd->get_first_stage_encoding(work_ctx, moments);
     } else {
-        init_latent = sd_ctx->sd->encode_first_stage(work_ctx, init_img);
+        init_latent = sd_ctx->sd->encode_first_stage_cached(work_ctx, init_img, init_image);
     }
     print_ggml_tensor(init_latent, true);
     size_t t1 = ggml_time_ms();
@@ -1628,6 +3229,7 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
                                                negative_prompt_c_str,
                                                clip_skip,
                                                cfg_scale,
+                                               cfg_scale,
                                                guidance,
                                                width,
                                                height,
@@ -1643,7 +3245,23 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
                                                skip_layers_vec,
                                                slg_scale,
                                                skip_layer_start,
-                                               skip_layer_end);
+                                               skip_layer_end,
+                                               adaptive_rtol,
+                                               adaptive_atol,
+                                               cfg_sigma_min,
+                                               cfg_sigma_max,
+                                               cfg_every,
+                                               0,
+                                               0,
+                                               0,
+                                               0.5f,
+                                               HIRES_LATENT_BILINEAR,
+                                               diffusion_tile_size,
+                                               diffusion_tile_overlap,
+                                               diffusion_tile_batch,
+                                               control_start,
+                                               control_end,
+                                               control_share_uncond);
 
     size_t t2 = ggml_time_ms();
 
@@ -1669,6 +3287,8 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
     if (sd_ctx == NULL) {
         return NULL;
     }
+    SDRequest request(sd_ctx);
+    sd_ctx = &request.ctx;
 
     LOG_INFO("img2vid %dx%d", width, height);
 
@@ -1745,6 +3365,10 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
                                                  sigmas,
                                                  -1,
                                                  SDCondition(NULL, NULL, NULL));
+    if (x_0 == NULL) {
+        ggml_free(work_ctx);
+        return NULL;
+    }
 
     int64_t t2 = ggml_time_ms();
     LOG_INFO("sampling completed, taking %.2fs", (t2 - t1) * 1.0f / 1000);
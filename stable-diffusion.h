@@ -44,9 +44,20 @@ enum sample_method_t {
     IPNDM,
     IPNDM_V,
     LCM,
+    DPM_ADAPTIVE,
+    UNIPC_BH1,
+    UNIPC_BH2,
+    DPMPP3M_SDE,
+    DEIS,
     N_SAMPLE_METHODS
 };
 
+enum hires_upscaler_t {
+    HIRES_LATENT_BILINEAR,
+    HIRES_LATENT_BICUBIC,
+    N_HIRES_UPSCALERS
+};
+
 enum schedule_t {
     DEFAULT,
     DISCRETE,
@@ -112,6 +123,9 @@ typedef void (*sd_progress_cb_t)(int step, int steps, float time, void* data);
 
 SD_API void sd_set_log_callback(sd_log_cb_t sd_log_cb, void* data);
 SD_API void sd_set_progress_callback(sd_progress_cb_t cb, void* data);
+// override the callbacks above for the calling thread only, NULL restores them
+SD_API void sd_set_thread_log_callback(sd_log_cb_t sd_log_cb, void* data);
+SD_API void sd_set_thread_progress_callback(sd_progress_cb_t cb, void* data);
 SD_API int32_t get_num_physical_cores();
 SD_API const char* sd_get_system_info();
 
@@ -122,8 +136,25 @@ typedef struct {
     uint8_t* data;
 } sd_image_t;
 
+enum sd_preview_t {
+    SD_PREVIEW_PROJ,  // linear latent -> rgb projection, latent resolution, well under 1 ms
+    SD_PREVIEW_TAE,   // taesd decode at full resolution, needs --taesd, falls back to PROJ
+};
+
+// gets the denoised latent of the running step as an rgb image, the image is only
+// valid during the call. Returning false aborts the generation: the remaining steps
+// skip the model and txt2img/img2img/img2vid return NULL.
+typedef bool (*sd_preview_cb_t)(int step, int steps, const sd_image_t* image, void* data);
+
+// calls cb every `interval` steps and on the last one, NULL disables it
+SD_API void sd_set_preview_callback(sd_preview_cb_t cb, int interval, enum sd_preview_t method, void* data);
+// override for the calling thread only, NULL restores the callback above
+SD_API void sd_set_thread_preview_callback(sd_preview_cb_t cb, int interval, enum sd_preview_t method, void* data);
+
 typedef struct sd_ctx_t sd_ctx_t;
 
+// contexts created from the same model files and settings (and free_params_immediately
+// off) share their params buffers, a LoRA applied to one of them only changes its own copy
 SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
                             const char* clip_l_path,
                             const char* clip_g_path,
@@ -145,10 +176,40 @@ SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
                             bool keep_clip_on_cpu,
                             bool keep_control_net_cpu,
                             bool keep_vae_on_cpu,
-                            bool diffusion_flash_attn);
+                            bool diffusion_flash_attn,
+                            const char* tensor_type_rules,
+                            const char* snapshot_dir);
 
 SD_API void free_sd_ctx(sd_ctx_t* sd_ctx);
 
+// replaces the persistent cpu threadpool shared by the cpu backends of the context,
+// workers busy with a request switch when they start their next one
+// cpumask: "0xff00" style hex mask or "0-7,16-23" style list, NULL or "" for no affinity
+// priority: 0 normal, 1 medium, 2 high, 3 realtime
+// poll: 0 sleeps between graphs, up to 100 spins longer (default: 50)
+// strict_cpu: pin each thread to its own cpu of the mask
+SD_API bool sd_set_threadpool(sd_ctx_t* sd_ctx, const char* cpumask, int priority, int poll, bool strict_cpu);
+
+// bounds the img2img init image latent cache, 0 disables it (default: 256 MB)
+SD_API void sd_set_latent_cache_limit(sd_ctx_t* sd_ctx, size_t max_bytes);
+
+// bounds the img2vid memory for long videos by working on chunks of frames, 0 for all
+// frames at once (default). unet_frames: frames per chunk in the spatial attention of the
+// unet, same result. vae_frames: frames per chunk in the video decoder, neighbouring chunks
+// overlap and are cross-faded, the result changes slightly
+SD_API void sd_set_video_frame_chunks(sd_ctx_t* sd_ctx, int unet_frames, int vae_frames);
+
+// computes the vae mid block attention for query_rows latent pixels at a time, the scores
+// then take query_rows * h * w floats instead of (h * w)^2, so large images can be decoded
+// without tiling. Same result, independent of diffusion_flash_attn. 0 for all at once (default)
+SD_API void sd_set_vae_attention_chunk(sd_ctx_t* sd_ctx, int query_rows);
+
+// lets up to n threads run txt2img/img2img/img2vid on the context at the same time,
+// further calls wait for a free slot. Each slot has its own rng, compute buffers, LoRA
+// and ControlNet state while the weights are loaded once, so call it before applying LoRAs.
+// returns the number of slots (default: 1)
+SD_API int sd_set_max_concurrent_requests(sd_ctx_t* sd_ctx, int n);
+
 SD_API sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                            const char* prompt,
                            const char* negative_prompt,
@@ -170,7 +231,23 @@ SD_API sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                            size_t skip_layers_count,
                            float slg_scale,
                            float skip_layer_start,
-                           float skip_layer_end);
+                           float skip_layer_end,
+                           float adaptive_rtol,
+                           float adaptive_atol,
+                           float cfg_sigma_min,
+                           float cfg_sigma_max,
+                           int cfg_every,
+                           int hires_width,
+                           int hires_height,
+                           int hires_steps,
+                           float hires_strength,
+                           enum hires_upscaler_t hires_upscaler,
+                           int diffusion_tile_size,
+                           float diffusion_tile_overlap,
+                           int diffusion_tile_batch,
+                           float control_start,
+                           float control_end,
+                           bool control_share_uncond);
 
 SD_API sd_image_t* img2img(sd_ctx_t* sd_ctx,
                            sd_image_t init_image,
@@ -195,7 +272,18 @@ SD_API sd_image_t* img2img(sd_ctx_t* sd_ctx,
                            size_t skip_layers_count,
                            float slg_scale,
                            float skip_layer_start,
-                           float skip_layer_end);
+                           float skip_layer_end,
+                           float adaptive_rtol,
+                           float adaptive_atol,
+                           float cfg_sigma_min,
+                           float cfg_sigma_max,
+                           int cfg_every,
+                           int diffusion_tile_size,
+                           float diffusion_tile_overlap,
+                           int diffusion_tile_batch,
+                           float control_start,
+                           float control_end,
+                           bool control_share_uncond);
 
 SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
                            sd_image_t init_image,
@@ -220,7 +308,20 @@ SD_API void free_upscaler_ctx(upscaler_ctx_t* upscaler_ctx);
 
 SD_API sd_image_t upscale(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_t upscale_factor);
 
-SD_API bool convert(const char* input_path, const char* vae_path, const char* output_path, enum sd_type_t output_type);
+// upscales count images in one call, the tiles of all images share the batched forwards
+// (at most two images are held in f32 at a time),
+// returns a malloc'ed array of count images, NULL on failure
+SD_API sd_image_t* upscale_batch(upscaler_ctx_t* upscaler_ctx, const sd_image_t* input_images, int count, uint32_t upscale_factor);
+
+// tile_size: tile size in input pixels, 0 to derive it from compute_budget in bytes
+// tile_batch: number of tiles per forward (default: 0, 1 and 1 GB)
+SD_API void sd_set_upscaler_tiling(upscaler_ctx_t* upscaler_ctx, int tile_size, int tile_batch, size_t compute_budget);
+
+SD_API bool convert(const char* input_path,
+                    const char* vae_path,
+                    const char* output_path,
+                    enum sd_type_t output_type,
+                    const char* tensor_type_rules);
 
 SD_API uint8_t* preprocess_canny(uint8_t* img,
                                  int width,
@@ -60,10 +60,35 @@ public:
         blocks["time_mixer"] = std::shared_ptr<GGMLBlock>(new AlphaBlender());
     }
 
+    // the spatial blocks work on each frame alone, running them on chunks of frames
+    // keeps only the attention scores of one chunk alive in the compute buffer
+    struct ggml_tensor* spatial_forward(struct ggml_context* ctx,
+                                        std::shared_ptr<BasicTransformerBlock> block,
+                                        struct ggml_tensor* x,
+                                        struct ggml_tensor* context,
+                                        int frame_chunk) {
+        // x: [N, h * w, inner_dim]
+        // context: [N, n_context, context_dim]
+        int64_t n = x->ne[2];
+        if (frame_chunk <= 0 || frame_chunk >= n || context->ne[2] != n) {
+            return block->forward(ctx, x, context);
+        }
+        struct ggml_tensor* out = NULL;
+        for (int64_t i = 0; i < n; i += frame_chunk) {
+            int64_t len    = std::min((int64_t)frame_chunk, n - i);
+            auto x_i       = ggml_view_3d(ctx, x, x->ne[0], x->ne[1], len, x->nb[1], x->nb[2], x->nb[2] * i);
+            auto context_i = ggml_view_3d(ctx, context, context->ne[0], context->ne[1], len, context->nb[1], context->nb[2], context->nb[2] * i);
+            auto out_i     = block->forward(ctx, x_i, context_i);  // [len, h * w, inner_dim]
+            out            = out == NULL ? out_i : ggml_concat(ctx, out, out_i, 2);
+        }
+        return out;
+    }
+
     struct ggml_tensor* forward(struct ggml_context* ctx,
                                 struct ggml_tensor* x,
                                 struct ggml_tensor* context,
-                                int timesteps) {
+                                int timesteps,
+                                int frame_chunk = 0) {
         // x: [N, in_channels, h, w] aka [b*t, in_channels, h, w], t == timesteps
         // context: [N, max_position(aka n_context), hidden_size(aka context_dim)] aka [b*t, n_context, context_dim], t == timesteps
         // t_emb: [N, in_channels] aka [b*t, in_channels]
@@ -127,7 +152,7 @@ public:
             auto block     = std::dynamic_pointer_cast<BasicTransformerBlock>(blocks[transformer_name]);
             auto mix_block = std::dynamic_pointer_cast<BasicTransformerBlock>(blocks[time_stack_name]);
 
-            x = block->forward(ctx, x, spatial_context);  // [N, h * w, inner_dim]
+            x = spatial_forward(ctx, block, x, spatial_context, frame_chunk);  // [N, h * w, inner_dim]
 
             // in_channels == inner_dim
             auto x_mix = x;
@@ -180,8 +205,9 @@ protected:
     int context_dim                        = 768;  // 1024 for VERSION_SD2, 2048 for VERSION_SDXL
 
 public:
-    int model_channels  = 320;
-    int adm_in_channels = 2816;  // only for VERSION_SDXL/SVD
+    int model_channels      = 320;
+    int adm_in_channels     = 2816;  // only for VERSION_SDXL/SVD
+    int spatial_frame_chunk = 0;     // only for VERSION_SVD, frames per spatial attention chunk, 0 for all
 
     UnetModelBlock(SDVersion version = VERSION_SD1, bool flash_attn = false)
         : version(version) {
@@ -363,7 +389,7 @@ public:
         if (version == VERSION_SVD) {
             auto block = std::dynamic_pointer_cast<SpatialVideoTransformer>(blocks[name]);
 
-            return block->forward(ctx, x, context, timesteps);
+            return block->forward(ctx, x, context, timesteps, spatial_frame_chunk);
         } else {
             auto block = std::dynamic_pointer_cast<SpatialTransformer>(blocks[name]);
 
@@ -548,6 +574,15 @@ struct UNetModelRunner : public GGMLRunner {
         unet.get_param_tensors(tensors, prefix);
     }
 
+    // every extra chunk of frames repeats the spatial transformer blocks in the graph
+    size_t get_frame_chunk_graph_size(int num_video_frames) {
+        int chunk = unet.spatial_frame_chunk;
+        if (chunk <= 0 || num_video_frames <= chunk) {
+            return 0;
+        }
+        return (size_t)((num_video_frames + chunk - 1) / chunk - 1) * 2048;
+    }
+
     struct ggml_cgraph* build_graph(struct ggml_tensor* x,
                                     struct ggml_tensor* timesteps,
                                     struct ggml_tensor* context,
@@ -556,12 +591,12 @@ struct UNetModelRunner : public GGMLRunner {
                                     int num_video_frames                      = -1,
                                     std::vector<struct ggml_tensor*> controls = {},
                                     float control_strength                    = 0.f) {
-        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, UNET_GRAPH_SIZE, false);
-
         if (num_video_frames == -1) {
             num_video_frames = x->ne[3];
         }
 
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, UNET_GRAPH_SIZE + get_frame_chunk_graph_size(num_video_frames), false);
+
         x         = to_backend(x);
         context   = to_backend(context);
         y         = to_backend(y);
@@ -606,6 +641,7 @@ struct UNetModelRunner : public GGMLRunner {
             return build_graph(x, timesteps, context, c_concat, y, num_video_frames, controls, control_strength);
         };
 
+        compute_graph_size = MAX_GRAPH_SIZE + get_frame_chunk_graph_size(num_video_frames == -1 ? (int)x->ne[3] : num_video_frames);
         GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
     }
 
@@ -10,6 +10,20 @@ struct UpscalerGGML {
     std::string esrgan_path;
     int n_threads;
 
+    // tiling, a tile_size of 0 derives the largest tile whose batch fits in compute_budget
+    int tile_size             = 0;
+    int tile_batch            = 1;
+    size_t compute_budget     = 1024 * 1024 * 1024;  // 1 GB
+    size_t bytes_per_pixel    = 0;                   // measured on first use
+    float tile_overlap_factor = 0.25f;
+
+    struct UpscaleTile {
+        int image;
+        int x;
+        int y;
+        int size;
+    };
+
     UpscalerGGML(int n_threads)
         : n_threads(n_threads) {
     }
@@ -49,48 +63,210 @@ struct UpscalerGGML {
         return true;
     }
 
-    sd_image_t upscale(sd_image_t input_image, uint32_t upscale_factor) {
-        // upscale_factor, unused for RealESRGAN_x4plus_anime_6B.pth
-        sd_image_t upscaled_image = {0, 0, 0, NULL};
-        int output_width          = (int)input_image.width * esrgan_upscaler->scale;
-        int output_height         = (int)input_image.height * esrgan_upscaler->scale;
-        LOG_INFO("upscaling from (%i x %i) to (%i x %i)",
-                 input_image.width, input_image.height, output_width, output_height);
-
-        struct ggml_init_params params;
-        params.mem_size = output_width * output_height * 3 * sizeof(float) * 2;
-        params.mem_size += 2 * ggml_tensor_overhead();
-        params.mem_buffer = NULL;
-        params.no_alloc   = false;
-
-        // draft context
-        struct ggml_context* upscale_ctx = ggml_init(params);
-        if (!upscale_ctx) {
-            LOG_ERROR("ggml_init() failed");
-            return upscaled_image;
+    int get_tile_size() {
+        if (tile_size > 0) {
+            return tile_size;
+        }
+        if (compute_budget == 0) {
+            return esrgan_upscaler->tile_size;
+        }
+        if (bytes_per_pixel == 0) {
+            bytes_per_pixel = std::max(esrgan_upscaler->get_compute_buffer_size_per_pixel(), (size_t)1);
+        }
+        int size = (int)sqrt((double)compute_budget / bytes_per_pixel / tile_batch);
+        size     = std::min(std::max(size / 32 * 32, 32), 1024);
+        LOG_DEBUG("upscale tile size %d (%.2f KB per pixel, %.2f MB budget, %d tiles per batch)",
+                  size, bytes_per_pixel / 1024.f, compute_budget / 1024.f / 1024.f, tile_batch);
+        return size;
+    }
+
+    // the tiles of all images are queued together, so batches span images. An image is only
+    // materialized (f32 input and output) from its first batched tile until its last tile is
+    // merged, with at most max_images_in_flight of them at a time, so memory does not grow with count
+    bool upscale_batch(const sd_image_t* input_images, int count, sd_image_t* upscaled_images) {
+        int scale = esrgan_upscaler->scale;
+        for (int i = 0; i < count; i++) {
+            upscaled_images[i] = {0, 0, 0, NULL};
         }
-        LOG_DEBUG("upscale work buffer size: %.2f MB", params.mem_size / 1024.f / 1024.f);
-        ggml_tensor* input_image_tensor = ggml_new_tensor_4d(upscale_ctx, GGML_TYPE_F32, input_image.width, input_image.height, 3, 1);
-        sd_image_to_tensor(input_image.data, input_image_tensor);
 
-        ggml_tensor* upscaled = ggml_new_tensor_4d(upscale_ctx, GGML_TYPE_F32, output_width, output_height, 3, 1);
-        auto on_tiling        = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
-            esrgan_upscaler->compute(n_threads, in, &out);
+        int max_tile_size = get_tile_size();
+        std::vector<UpscaleTile> tiles;
+        std::vector<int> pending_tiles(count, 0);
+        for (int i = 0; i < count; i++) {
+            const sd_image_t& input_image = input_images[i];
+            LOG_INFO("upscaling from (%i x %i) to (%i x %i)",
+                     input_image.width, input_image.height, (int)input_image.width * scale, (int)input_image.height * scale);
+
+            // same tile placement as sd_tiling, the tile is shrunk for images smaller than it
+            int size             = std::min(max_tile_size, (int)std::min(input_image.width, input_image.height)) / 2 * 2;
+            int non_tile_overlap = size - (int)(size * tile_overlap_factor);
+            if (size < 2) {
+                LOG_ERROR("image %d is too small to upscale", i);
+                return false;
+            }
+            bool last_y = false, last_x = false;
+            for (int y = 0; y < (int)input_image.height && !last_y; y += non_tile_overlap) {
+                if (y + size >= (int)input_image.height) {
+                    y      = input_image.height - size;
+                    last_y = true;
+                }
+                for (int x = 0; x < (int)input_image.width && !last_x; x += non_tile_overlap) {
+                    if (x + size >= (int)input_image.width) {
+                        x      = input_image.width - size;
+                        last_x = true;
+                    }
+                    tiles.push_back({i, x, y, size});
+                    pending_tiles[i]++;
+                }
+                last_x = false;
+            }
+        }
+
+        const int max_images_in_flight = 2;
+        std::vector<ggml_context*> image_ctxs(count, NULL);
+        std::vector<ggml_tensor*> inputs(count, NULL);
+        std::vector<ggml_tensor*> outputs(count, NULL);
+        int images_in_flight = 0;
+
+        auto open_image = [&](int i) -> bool {
+            const sd_image_t& input_image = input_images[i];
+            int output_width              = (int)input_image.width * scale;
+            int output_height             = (int)input_image.height * scale;
+
+            struct ggml_init_params params;
+            params.mem_size   = 2 * ggml_tensor_overhead() + input_image.width * input_image.height * 3 * sizeof(float) * (1 + scale * scale);
+            params.mem_buffer = NULL;
+            params.no_alloc   = false;
+            image_ctxs[i]     = ggml_init(params);
+            if (!image_ctxs[i]) {
+                LOG_ERROR("ggml_init() failed");
+                return false;
+            }
+            inputs[i] = ggml_new_tensor_4d(image_ctxs[i], GGML_TYPE_F32, input_image.width, input_image.height, 3, 1);
+            sd_image_to_tensor(input_image.data, inputs[i]);
+            outputs[i] = ggml_new_tensor_4d(image_ctxs[i], GGML_TYPE_F32, output_width, output_height, 3, 1);
+            ggml_set_f32(outputs[i], 0.f);
+            images_in_flight++;
+            return true;
         };
-        int64_t t0 = ggml_time_ms();
-        sd_tiling(input_image_tensor, upscaled, esrgan_upscaler->scale, esrgan_upscaler->tile_size, 0.25f, on_tiling);
+        auto close_image = [&](int i) {
+            ggml_tensor_clamp(outputs[i], 0.f, 1.f);
+            upscaled_images[i] = {
+                (uint32_t)outputs[i]->ne[0],
+                (uint32_t)outputs[i]->ne[1],
+                3,
+                sd_tensor_to_image(outputs[i]),
+            };
+            ggml_free(image_ctxs[i]);
+            image_ctxs[i] = NULL;
+            images_in_flight--;
+        };
+
+        // consecutive tiles of the same size are stacked into one forward, the batch shape is kept
+        // for the trailing batch (the unused slots are computed but ignored) so the graph is reused
+        struct ggml_context* tiles_ctx = NULL;
+        ggml_tensor* input_batch       = NULL;
+        ggml_tensor* output_batch      = NULL;
+        std::vector<ggml_tensor*> input_slots;
+        std::vector<ggml_tensor*> output_slots;
+        bool success    = true;
+        int tile_count  = 0;
+        float last_time = 0.0f;
+        int64_t t0      = ggml_time_ms();
+        LOG_INFO("processing %i tiles", (int)tiles.size());
+        pretty_progress(0, (int)tiles.size(), 0.0f);
+        for (size_t begin = 0; begin < tiles.size() && success;) {
+            int size   = tiles[begin].size;
+            size_t run = begin;
+            while (run < tiles.size() && tiles[run].size == size) {
+                run++;
+            }
+            if (input_batch == NULL || input_batch->ne[0] != size) {
+                if (tiles_ctx != NULL) {
+                    ggml_free(tiles_ctx);
+                }
+                int n        = (int)std::min((size_t)std::max(tile_batch, 1), run - begin);
+                int out_size = size * scale;
+
+                struct ggml_init_params tiles_params;
+                tiles_params.mem_size = (size_t)n * 3 * (size * size + out_size * out_size) * sizeof(float);
+                tiles_params.mem_size += (2 + 2 * n) * ggml_tensor_overhead();
+                tiles_params.mem_buffer = NULL;
+                tiles_params.no_alloc   = false;
+                tiles_ctx               = ggml_init(tiles_params);
+                if (!tiles_ctx) {
+                    LOG_ERROR("ggml_init() failed");
+                    success = false;
+                    break;
+                }
+                input_batch  = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, size, size, 3, n);
+                output_batch = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, out_size, out_size, 3, n);
+                input_slots.clear();
+                output_slots.clear();
+                for (int k = 0; k < n; k++) {
+                    input_slots.push_back(ggml_view_3d(tiles_ctx, input_batch, size, size, 3, input_batch->nb[1], input_batch->nb[2], k * input_batch->nb[3]));
+                    output_slots.push_back(ggml_view_3d(tiles_ctx, output_batch, out_size, out_size, 3, output_batch->nb[1], output_batch->nb[2], k * output_batch->nb[3]));
+                }
+            }
+
+            // the batch ends early rather than materializing one image too many
+            int64_t t1 = ggml_time_ms();
+            size_t end = begin;
+            while (end < std::min(begin + (size_t)input_batch->ne[3], run)) {
+                int image = tiles[end].image;
+                if (image_ctxs[image] == NULL) {
+                    if (images_in_flight >= max_images_in_flight) {
+                        break;
+                    }
+                    if (!open_image(image)) {
+                        success = false;
+                        break;
+                    }
+                }
+                ggml_split_tensor_2d(inputs[image], input_slots[end - begin], tiles[end].x, tiles[end].y);
+                end++;
+            }
+            if (!success || !esrgan_upscaler->compute_batch(n_threads, input_batch, output_batch)) {
+                success = false;
+                break;
+            }
+            for (size_t j = begin; j < end; j++) {
+                int image        = tiles[j].image;
+                int tile_overlap = (int)(size * tile_overlap_factor);
+                ggml_merge_tensor_2d(output_slots[j - begin], outputs[image], tiles[j].x * scale, tiles[j].y * scale, tile_overlap * scale);
+                if (--pending_tiles[image] == 0) {
+                    close_image(image);
+                }
+            }
+            int64_t t2 = ggml_time_ms();
+            last_time  = (t2 - t1) / 1000.0f;
+            tile_count += (int)(end - begin);
+            pretty_progress(tile_count, (int)tiles.size(), last_time);
+            begin = end;
+        }
+        if (tiles_ctx != NULL) {
+            ggml_free(tiles_ctx);
+        }
         esrgan_upscaler->free_compute_buffer();
-        ggml_tensor_clamp(upscaled, 0.f, 1.f);
-        uint8_t* upscaled_data = sd_tensor_to_image(upscaled);
-        ggml_free(upscale_ctx);
+
+        for (int i = 0; i < count; i++) {
+            if (image_ctxs[i] != NULL) {
+                ggml_free(image_ctxs[i]);
+            }
+            if (!success && upscaled_images[i].data != NULL) {
+                free(upscaled_images[i].data);
+                upscaled_images[i] = {0, 0, 0, NULL};
+            }
+        }
         int64_t t3 = ggml_time_ms();
-        LOG_INFO("input_image_tensor upscaled, taking %.2fs", (t3 - t0) / 1000.0f);
-        upscaled_image = {
-            (uint32_t)output_width,
-            (uint32_t)output_height,
-            3,
-            upscaled_data,
-        };
+        LOG_INFO("%d images upscaled, taking %.2fs", count, (t3 - t0) / 1000.0f);
+        return success;
+    }
+
+    sd_image_t upscale(sd_image_t input_image, uint32_t upscale_factor) {
+        // upscale_factor, unused for RealESRGAN_x4plus_anime_6B.pth
+        sd_image_t upscaled_image = {0, 0, 0, NULL};
+        upscale_batch(&input_image, 1, &upscaled_image);
         return upscaled_image;
     }
 };
@@ -125,6 +301,32 @@ sd_image_t upscale(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_
     return upscaler_ctx->upscaler->upscale(input_image, upscale_factor);
 }
 
+sd_image_t* upscale_batch(upscaler_ctx_t* upscaler_ctx, const sd_image_t* input_images, int count, uint32_t upscale_factor) {
+    // upscale_factor, unused for RealESRGAN_x4plus_anime_6B.pth
+    if (count <= 0) {
+        return NULL;
+    }
+    sd_image_t* upscaled_images = (sd_image_t*)calloc(count, sizeof(sd_image_t));
+    if (upscaled_images == NULL) {
+        return NULL;
+    }
+    if (!upscaler_ctx->upscaler->upscale_batch(input_images, count, upscaled_images)) {
+        free(upscaled_images);
+        return NULL;
+    }
+    return upscaled_images;
+}
+
+void sd_set_upscaler_tiling(upscaler_ctx_t* upscaler_ctx, int tile_size, int tile_batch, size_t compute_budget) {
+    if (upscaler_ctx == NULL || upscaler_ctx->upscaler == NULL) {
+        return;
+    }
+    UpscalerGGML* upscaler   = upscaler_ctx->upscaler;
+    upscaler->tile_size      = tile_size > 0 ? tile_size / 2 * 2 : 0;
+    upscaler->tile_batch     = std::max(tile_batch, 1);
+    upscaler->compute_budget = compute_budget;
+}
+
 void free_upscaler_ctx(upscaler_ctx_t* upscaler_ctx) {
     if (upscaler_ctx->upscaler != NULL) {
         delete upscaler_ctx->upscaler;
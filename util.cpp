@@ -85,6 +85,25 @@ bool is_directory(const std::string& path) {
     return (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY));
 }
 
+bool get_file_stat(const std::string& path, int64_t& size, int64_t& mtime) {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data) || (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return false;
+    }
+    size  = ((int64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    mtime = ((int64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+std::string get_canonical_path(const std::string& path) {
+    char buffer[MAX_PATH];
+    DWORD length = GetFullPathNameA(path.c_str(), MAX_PATH, buffer, NULL);
+    if (length == 0 || length >= MAX_PATH) {
+        return path;
+    }
+    return std::string(buffer, length);
+}
+
 std::string get_full_path(const std::string& dir, const std::string& filename) {
     std::string full_path = dir + "\\" + filename;
 
@@ -150,6 +169,26 @@ bool is_directory(const std::string& path) {
     return (stat(path.c_str(), &buffer) == 0 && S_ISDIR(buffer.st_mode));
 }
 
+bool get_file_stat(const std::string& path, int64_t& size, int64_t& mtime) {
+    struct stat buffer;
+    if (stat(path.c_str(), &buffer) != 0 || !S_ISREG(buffer.st_mode)) {
+        return false;
+    }
+    size  = (int64_t)buffer.st_size;
+    mtime = (int64_t)buffer.st_mtime;
+    return true;
+}
+
+std::string get_canonical_path(const std::string& path) {
+    char* resolved = realpath(path.c_str(), NULL);
+    if (resolved == NULL) {
+        return path;
+    }
+    std::string canonical_path(resolved);
+    free(resolved);
+    return canonical_path;
+}
+
 // TODO: add windows version
 std::string get_full_path(const std::string& dir, const std::string& filename) {
     DIR* dp = opendir(dir.c_str());
@@ -234,6 +273,10 @@ int32_t get_num_physical_cores() {
 static sd_progress_cb_t sd_progress_cb = NULL;
 void* sd_progress_cb_data              = NULL;
 
+// per thread overrides, so concurrent requests on one context report to their own caller
+static thread_local sd_progress_cb_t sd_thread_progress_cb = NULL;
+static thread_local void* sd_thread_progress_cb_data       = NULL;
+
 std::u32string utf8_to_utf32(const std::string& utf8_str) {
     std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> converter;
     return converter.from_bytes(utf8_str);
@@ -328,6 +371,10 @@ sd_image_t* preprocess_id_image(sd_image_t* img) {
 }
 
 void pretty_progress(int step, int steps, float time) {
+    if (sd_thread_progress_cb) {
+        sd_thread_progress_cb(step, steps, time, sd_thread_progress_cb_data);
+        return;
+    }
     if (sd_progress_cb) {
         sd_progress_cb(step, steps, time, sd_progress_cb_data);
         return;
@@ -378,13 +425,16 @@ std::string trim(const std::string& s) {
 static sd_log_cb_t sd_log_cb = NULL;
 void* sd_log_cb_data         = NULL;
 
+static thread_local sd_log_cb_t sd_thread_log_cb = NULL;
+static thread_local void* sd_thread_log_cb_data  = NULL;
+
 #define LOG_BUFFER_SIZE 1024
 
 void log_printf(sd_log_level_t level, const char* file, int line, const char* format, ...) {
     va_list args;
     va_start(args, format);
 
-    static char log_buffer[LOG_BUFFER_SIZE + 1];
+    static thread_local char log_buffer[LOG_BUFFER_SIZE + 1];
     int written = snprintf(log_buffer, LOG_BUFFER_SIZE, "%s:%-4d - ", sd_basename(file).c_str(), line);
 
     if (written >= 0 && written < LOG_BUFFER_SIZE) {
@@ -392,7 +442,9 @@ void log_printf(sd_log_level_t level, const char* file, int line, const char* fo
     }
     strncat(log_buffer, "\n", LOG_BUFFER_SIZE - strlen(log_buffer));
 
-    if (sd_log_cb) {
+    if (sd_thread_log_cb) {
+        sd_thread_log_cb(level, log_buffer, sd_thread_log_cb_data);
+    } else if (sd_log_cb) {
         sd_log_cb(level, log_buffer, sd_log_cb_data);
     }
 
@@ -407,6 +459,26 @@ void sd_set_progress_callback(sd_progress_cb_t cb, void* data) {
     sd_progress_cb      = cb;
     sd_progress_cb_data = data;
 }
+void sd_set_thread_log_callback(sd_log_cb_t cb, void* data) {
+    sd_thread_log_cb      = cb;
+    sd_thread_log_cb_data = data;
+}
+void sd_set_thread_progress_callback(sd_progress_cb_t cb, void* data) {
+    sd_thread_progress_cb      = cb;
+    sd_thread_progress_cb_data = data;
+}
+sd_thread_callbacks_t sd_get_thread_callbacks() {
+    sd_thread_callbacks_t callbacks;
+    callbacks.log_cb           = sd_thread_log_cb;
+    callbacks.log_cb_data      = sd_thread_log_cb_data;
+    callbacks.progress_cb      = sd_thread_progress_cb;
+    callbacks.progress_cb_data = sd_thread_progress_cb_data;
+    return callbacks;
+}
+void sd_set_thread_callbacks(const sd_thread_callbacks_t& callbacks) {
+    sd_set_thread_log_callback(callbacks.log_cb, callbacks.log_cb_data);
+    sd_set_thread_progress_callback(callbacks.progress_cb, callbacks.progress_cb_data);
+}
 const char* sd_get_system_info() {
     static char buffer[1024];
     std::stringstream ss;
@@ -17,6 +17,9 @@ void replace_all_chars(std::string& str, char target, char replacement);
 
 bool file_exists(const std::string& filename);
 bool is_directory(const std::string& path);
+// size in bytes and last modification time (platform units), false when not a regular file
+bool get_file_stat(const std::string& path, int64_t& size, int64_t& mtime);
+std::string get_canonical_path(const std::string& path);  // the path itself if it can not be resolved
 std::string get_full_path(const std::string& dir, const std::string& filename);
 
 std::vector<std::string> get_files_from_dir(const std::string& dir);
@@ -50,6 +53,17 @@ void pretty_progress(int step, int steps, float time);
 
 void log_printf(sd_log_level_t level, const char* file, int line, const char* format, ...);
 
+// the per thread log and progress callbacks of a thread, so the helper threads it starts can report to the same caller
+struct sd_thread_callbacks_t {
+    sd_log_cb_t log_cb           = NULL;
+    void* log_cb_data            = NULL;
+    sd_progress_cb_t progress_cb = NULL;
+    void* progress_cb_data       = NULL;
+};
+
+sd_thread_callbacks_t sd_get_thread_callbacks();
+void sd_set_thread_callbacks(const sd_thread_callbacks_t& callbacks);
+
 std::string trim(const std::string& s);
 
 std::vector<std::pair<std::string, float>> parse_prompt_attention(const std::string& text);
@@ -66,6 +66,8 @@ protected:
     int64_t in_channels;
 
 public:
+    int64_t query_chunk = 0;  // query rows per attention chunk, 0 for all at once
+
     AttnBlock(int64_t in_channels)
         : in_channels(in_channels) {
         blocks["norm"] = std::shared_ptr<GGMLBlock>(new GroupNorm32(in_channels));
@@ -102,7 +104,7 @@ public:
         auto v = v_proj->forward(ctx, h_);              // [N, in_channels, h, w]
         v      = ggml_reshape_3d(ctx, v, h * w, c, n);  // [N, in_channels, h * w]
 
-        h_ = ggml_nn_attention(ctx, q, k, v, false);  // [N, h * w, in_channels]
+        h_ = ggml_nn_attention_chunked(ctx, q, k, v, query_chunk);  // [N, h * w, in_channels]
 
         h_ = ggml_cont(ctx, ggml_permute(ctx, h_, 1, 0, 2, 3));  // [N, in_channels, h * w]
         h_ = ggml_reshape_4d(ctx, h_, w, h, c, n);               // [N, in_channels, h, w]
@@ -271,6 +273,10 @@ public:
         blocks["conv_out"] = std::shared_ptr<GGMLBlock>(new Conv2d(block_in, double_z ? z_channels * 2 : z_channels, {3, 3}, {1, 1}, {1, 1}));
     }
 
+    void set_attn_query_chunk(int64_t query_chunk) {
+        std::dynamic_pointer_cast<AttnBlock>(blocks["mid.attn_1"])->query_chunk = query_chunk;
+    }
+
     virtual struct ggml_tensor* forward(struct ggml_context* ctx, struct ggml_tensor* x) {
         // x: [N, in_channels, h, w]
 
@@ -388,6 +394,10 @@ public:
         blocks["conv_out"] = get_conv_out(block_in, out_ch, {3, 3}, {1, 1}, {1, 1});
     }
 
+    void set_attn_query_chunk(int64_t query_chunk) {
+        std::dynamic_pointer_cast<AttnBlock>(blocks["mid.attn_1"])->query_chunk = query_chunk;
+    }
+
     virtual struct ggml_tensor* forward(struct ggml_context* ctx, struct ggml_tensor* z) {
         // z: [N, z_channels, h, w]
         // alpha is always 0
@@ -493,6 +503,13 @@ public:
         }
     }
 
+    void set_attn_query_chunk(int64_t query_chunk) {
+        std::dynamic_pointer_cast<Decoder>(blocks["decoder"])->set_attn_query_chunk(query_chunk);
+        if (!decode_only) {
+            std::dynamic_pointer_cast<Encoder>(blocks["encoder"])->set_attn_query_chunk(query_chunk);
+        }
+    }
+
     struct ggml_tensor* decode(struct ggml_context* ctx, struct ggml_tensor* z) {
         // z: [N, z_channels, h, w]
         if (use_quant) {
@@ -532,18 +549,25 @@ struct AutoEncoderKL : public GGMLRunner {
                   SDVersion version      = VERSION_SD1)
         : decode_only(decode_only), ae(decode_only, use_video_decoder, version), GGMLRunner(backend) {
         ae.init(params_ctx, tensor_types, prefix);
+        compute_graph_size = VAE_GRAPH_SIZE;  // the chunked mid block attention adds nodes per query chunk
     }
 
     std::string get_desc() {
         return "vae";
     }
 
+    // the mid block attention scores grow with (h * w)^2 of the latent, chunking the
+    // queries bounds them to query_chunk * h * w, 0 computes them all at once
+    void set_attn_query_chunk(int64_t query_chunk) {
+        ae.set_attn_query_chunk(query_chunk);
+    }
+
     void get_param_tensors(std::map<std::string, struct ggml_tensor*>& tensors, const std::string prefix) {
         ae.get_param_tensors(tensors, prefix);
     }
 
     struct ggml_cgraph* build_graph(struct ggml_tensor* z, bool decode_graph) {
-        struct ggml_cgraph* gf = ggml_new_graph(compute_ctx);
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, VAE_GRAPH_SIZE, false);
 
         z = to_backend(z);
 